@@ -0,0 +1,473 @@
+#include <asm/processor-flags.h> /* Needed for X86_EFLAGS_FIXED */
+#include <linux/ktime.h> /* Needed for ktime_get_ns */
+#include <linux/minmax.h> /* Needed for min_t */
+#include <linux/printk.h> /* Needed for pr_info */
+#include <linux/sizes.h> /* Needed for SZ_2M */
+#include <linux/slab.h> /* Needed for kvmalloc_array */
+#include <linux/sort.h> /* Needed for sort */
+#include <linux/string.h> /* Needed for memcpy */
+
+#include "bench.h"
+#include "blk.h"
+#include "loader.h"
+#include "mem.h"
+#include "mmio.h"
+#include "ring.h"
+#include "vm.h"
+
+// Each exit type gets a small 64-bit payload that runs the exiting
+// instruction in a loop and stores the guest TSC cycles around it, one u64
+// per iteration, then reports back with an OUT to BENCH_DONE_PORT, which
+// goes to userspace and so ends run_vcpu(). The samples are read back from
+// guest RAM and sorted here. The block device benchmark is one more such
+// payload, its loop body drives the ring. Guest RAM layout:
+//
+//   BENCH_CODE_ADDR     a payload per exit type, BENCH_CODE_SIZE apart
+//   BENCH_PT_ADDR       identity-mapped page tables, see loader.c
+//   BENCH_SAMPLES_ADDR  the samples
+//   BENCH_RING_ADDR     TVISOR_BENCH_BLK: a one page struct tvisor_ring
+//   BENCH_BLK_BUF_ADDR  TVISOR_BENCH_BLK: a buffer per ring descriptor
+//
+// and right above RAM, a device page that reads 0 and ignores writes.
+
+#define BENCH_CODE_ADDR 0x10000
+#define BENCH_CODE_SIZE 0x100
+#define BENCH_PT_ADDR 0x20000
+#define BENCH_SAMPLES_ADDR 0x100000
+#define BENCH_RING_ADDR 0x200000
+#define BENCH_RING_SIZE TVISOR_BENCH_BLK_MAX_DEPTH // descriptors
+#define BENCH_BLK_BUF_ADDR 0x400000
+#define BENCH_BLK_CODE_ADDR \
+	(BENCH_CODE_ADDR + TVISOR_BENCH_NR_EXITS * BENCH_CODE_SIZE)
+#define BENCH_DONE_PORT 0xf4
+#define BENCH_DEFAULT_ITERATIONS 10000
+#define BENCH_WARMUP 16 // iterations thrown away before the samples
+
+// lfence; rdtsc; shl rdx, 32; or rax, rdx
+#define BENCH_RDTSC 0x0f, 0xae, 0xe8, 0x0f, 0x31, 0x48, 0xc1, 0xe2, 0x20, \
+		    0x48, 0x09, 0xd0
+
+// r8 = start TSC, r9 = iterations left; RCX, RDI and RSI come from the regs
+static const u8 bench_prologue[] = {
+	BENCH_RDTSC,
+	0x49, 0x89, 0xc0, // mov r8, rax
+	0x49, 0x89, 0xc9, // mov r9, rcx
+};
+
+static const u8 bench_epilogue[] = {
+	BENCH_RDTSC,
+	0x4c, 0x29, 0xc0, // sub rax, r8
+	0x48, 0x89, 0x07, // mov [rdi], rax
+	0x48, 0x83, 0xc7, 0x08, // add rdi, 8
+	0x4c, 0x89, 0xc9, // mov rcx, r9
+	0x48, 0xff, 0xc9, // dec rcx
+	0x0f, 0x85, 0, 0, 0, 0, // jnz to the prologue, rel32 filled in
+};
+
+// mov eax, TVISOR_HC_WAKE_SELF; vmcall, before the timed HLT
+static const u8 bench_hlt_setup[] = {
+	0xb8, TVISOR_HC_WAKE_SELF, 0x00, 0x00, 0x00, 0x0f, 0x01, 0xc1,
+};
+
+static const u8 bench_done[] = {
+	0x66, 0xba, BENCH_DONE_PORT, 0x00, // mov dx, BENCH_DONE_PORT
+	0xee, // out dx, al
+	0xeb, 0xfe, // jmp $
+};
+
+typedef struct _bench_body {
+	u8 len;
+	u8 code[15];
+} bench_body_t;
+
+static const bench_body_t bench_bodies[TVISOR_BENCH_NR_EXITS] = {
+	[TVISOR_BENCH_CPUID] = { 4, { 0x31, 0xc0, 0x0f, 0xa2 } },
+	[TVISOR_BENCH_VMCALL] = { 5, { 0x31, 0xc0, 0x0f, 0x01, 0xc1 } },
+	[TVISOR_BENCH_HLT] = { 1, { 0xf4 } },
+	// mov dx, 0x3ff; out dx, al
+	[TVISOR_BENCH_PIO] = { 5, { 0x66, 0xba, 0xff, 0x03, 0xee } },
+	// mov ecx, MSR_IA32_MISC_ENABLE; rdmsr
+	[TVISOR_BENCH_MSR] = { 7,
+			       { 0xb9, 0xa0, 0x01, 0x00, 0x00, 0x0f, 0x32 } },
+	// mov rax, [rsi]
+	[TVISOR_BENCH_MMIO] = { 3, { 0x48, 0x8b, 0x06 } },
+};
+
+// RBX = &ring->head, R10 = depth: publish the next `depth` descriptors, kick
+// the host if it asked for it, spin until `tail` catches up
+static const u8 bench_blk_body[] = {
+	0x8b, 0x03, // mov eax, [rbx]
+	0x44, 0x01, 0xd0, // add eax, r10d
+	0x89, 0x03, // mov [rbx], eax
+	0x0f, 0xae, 0xf0, // mfence, head before need_kick
+	0x83, 0x7b, 0x44, 0x00, // cmp dword [rbx + 0x44], 0 (need_kick)
+	0x74, 0x0e, // je over the kick
+	0x41, 0x89, 0xc3, // mov r11d, eax
+	0xb8, TVISOR_HC_RING_KICK, 0x00, 0x00, 0x00, // mov eax, RING_KICK
+	0x0f, 0x01, 0xc1, // vmcall
+	0x44, 0x89, 0xd8, // mov eax, r11d
+	0xf3, 0x90, // pause
+	0x39, 0x43, 0x40, // cmp [rbx + 0x40], eax (tail)
+	0x75, 0xf9, // jne to the pause
+};
+
+static int bench_mmio_read(mmio_dev_t *dev, u64 offset, int size, u64 *value)
+{
+	*value = 0;
+	return 0;
+}
+
+static int bench_mmio_write(mmio_dev_t *dev, u64 offset, int size, u64 value)
+{
+	return 0;
+}
+
+static const mmio_ops_t bench_mmio_ops = {
+	.read = bench_mmio_read,
+	.write = bench_mmio_write,
+};
+
+// `setup` (untimed), then `body` timed in a loop, at `addr`
+static int write_payload(vm_state_t *vm, u64 addr, const u8 *setup,
+			 size_t setup_len, const u8 *body, size_t body_len)
+{
+	u8 code[BENCH_CODE_SIZE];
+	size_t len = 0;
+
+	if (setup_len + sizeof(bench_prologue) + body_len +
+		    sizeof(bench_epilogue) + sizeof(bench_done) >
+	    sizeof(code)) {
+		return -E2BIG;
+	}
+	if (setup_len) {
+		memcpy(code, setup, setup_len);
+		len += setup_len;
+	}
+	memcpy(code + len, bench_prologue, sizeof(bench_prologue));
+	len += sizeof(bench_prologue);
+	memcpy(code + len, body, body_len);
+	len += body_len;
+	memcpy(code + len, bench_epilogue, sizeof(bench_epilogue));
+	len += sizeof(bench_epilogue);
+	s32 rel = -(s32)len; // from the end of the jnz back to the start
+	memcpy(code + len - sizeof(rel), &rel, sizeof(rel));
+	memcpy(code + len, bench_done, sizeof(bench_done));
+	len += sizeof(bench_done);
+
+	return write_guest_phys(vm, addr, code, len);
+}
+
+static int write_bench_payload(vm_state_t *vm, int type)
+{
+	const bench_body_t *body = &bench_bodies[type];
+	u64 addr = BENCH_CODE_ADDR + type * BENCH_CODE_SIZE;
+
+	if (type == TVISOR_BENCH_HLT) {
+		// so the HLT finds a wakeup pending and does not sleep
+		return write_payload(vm, addr, bench_hlt_setup,
+				     sizeof(bench_hlt_setup), body->code,
+				     body->len);
+	}
+	return write_payload(vm, addr, NULL, 0, body->code, body->len);
+}
+
+// vCPU 0 must not have run yet; identity-mapped page tables. Under vm->lock.
+static int setup_bench_guest(vm_state_t *vm)
+{
+	int ret;
+
+	if (READ_ONCE(vm->vcpus[0]->launched) ||
+	    READ_ONCE(vm->vcpus[0]->task) != NULL) {
+		return -EBUSY;
+	}
+
+	ret = build_identity_page_tables(vm, BENCH_PT_ADDR);
+	if (ret) {
+		return ret;
+	}
+	vm->boot_cr3 = BENCH_PT_ADDR;
+	return 0;
+}
+
+// guest RAM, the device and the payloads; under vm->lock
+static int setup_exit_bench(vm_state_t *vm, u32 types)
+{
+	int type;
+	int ret = setup_bench_guest(vm);
+	if (ret) {
+		return ret;
+	}
+
+	if (types & (1 << TVISOR_BENCH_MMIO)) {
+		// the payload reaches it through the identity mapping
+		if (vm->mem_size + PAGE_SIZE > (u64)TVISOR_LOAD_PT_MAP_GIB << 30) {
+			return -ENOSPC;
+		}
+		vm->bench_mmio.base = vm->mem_size;
+		vm->bench_mmio.len = PAGE_SIZE;
+		vm->bench_mmio.ops = &bench_mmio_ops;
+		ret = register_mmio_dev(vm, &vm->bench_mmio);
+		if (ret) {
+			return ret;
+		}
+	}
+
+	for (type = 0; type < TVISOR_BENCH_NR_EXITS; type++) {
+		if (types & (1 << type)) {
+			ret = write_bench_payload(vm, type);
+			if (ret) {
+				return ret;
+			}
+		}
+	}
+	return 0;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	u64 x = *(const u64 *)a;
+	u64 y = *(const u64 *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Point vCPU 0 at the payload at `addr` for `total` iterations, the caller
+// adds the registers its body wants.
+static struct tvisor_regs *start_payload(vm_state_t *vm, u64 addr, u32 total)
+{
+	vcpu_state_t *vcpu = vm->vcpus[0];
+	struct tvisor_regs *regs = &vcpu->run->regs;
+
+	memset(regs, 0, sizeof(*regs));
+	regs->rip = addr;
+	regs->rflags = X86_EFLAGS_FIXED;
+	regs->rcx = total;
+	regs->rdi = BENCH_SAMPLES_ADDR;
+	vcpu->run->regs_dirty = 1;
+	// the OUT that ended the last payload is done with, don't skip over
+	// the start of this one
+	vcpu->user_exit_pending = 0;
+	return regs;
+}
+
+// Run the payload set up by start_payload() on vCPU 0 from this thread and
+// sort the last `n` samples into `samples`.
+static int run_payload(vm_state_t *vm, u32 n, u64 *samples)
+{
+	struct tvisor_run *run = vm->vcpus[0]->run;
+
+	int ret = run_vcpu(vm->vcpus[0]);
+	if (ret) {
+		return ret;
+	}
+	if (run->exit_reason != TVISOR_EXIT_IO ||
+	    run->io.port != BENCH_DONE_PORT) {
+		pr_info("tvisor: benchmark at %llx stopped with exit %u\n",
+			run->regs.rip, run->exit_reason);
+		return -EIO;
+	}
+
+	ret = read_guest_phys(vm, BENCH_SAMPLES_ADDR + BENCH_WARMUP * 8,
+			      samples, n * sizeof(u64));
+	if (ret) {
+		return ret;
+	}
+	sort(samples, n, sizeof(u64), cmp_u64, NULL);
+	return 0;
+}
+
+static u64 percentile(const u64 *sorted, u32 n, u32 pct)
+{
+	return sorted[min_t(u32, (u64)n * pct / 100, n - 1)];
+}
+
+// Run the payload of `type` for `n` samples.
+static int run_bench_payload(vm_state_t *vm, int type, u32 n, u64 *samples,
+			     struct tvisor_exit_bench_result *result)
+{
+	vcpu_stats_t *s = &vm->vcpus[0]->stats;
+	u32 total = n + BENCH_WARMUP;
+
+	struct tvisor_regs *regs = start_payload(
+		vm, BENCH_CODE_ADDR + type * BENCH_CODE_SIZE, total);
+	regs->rsi = vm->mem_size; // the device
+
+	u64 run_cycles = s->run_cycles;
+	u64 guest_cycles = s->guest_cycles;
+	int ret = run_payload(vm, n, samples);
+	if (ret) {
+		return ret;
+	}
+	result->min = samples[0];
+	result->median = percentile(samples, n, 50);
+	result->p99 = percentile(samples, n, 99);
+	run_cycles = s->run_cycles - run_cycles;
+	guest_cycles = s->guest_cycles - guest_cycles;
+	result->host_cycles =
+		run_cycles > guest_cycles ? (run_cycles - guest_cycles) / total :
+					    0;
+	return 0;
+}
+
+// TVISOR_BENCH_EXITS
+int run_exit_bench(vm_state_t *vm, struct tvisor_exit_bench *args)
+{
+	u32 types = args->types ?: (1 << TVISOR_BENCH_NR_EXITS) - 1;
+	u32 n = args->iterations ?: BENCH_DEFAULT_ITERATIONS;
+	int type, ret;
+
+	if (types >= 1 << TVISOR_BENCH_NR_EXITS ||
+	    n > TVISOR_BENCH_MAX_ITERATIONS) {
+		return -EINVAL;
+	}
+	BUILD_BUG_ON(BENCH_SAMPLES_ADDR +
+			     (TVISOR_BENCH_MAX_ITERATIONS + BENCH_WARMUP) * 8 >
+		     SZ_2M);
+
+	mutex_lock(&vm->lock);
+	ret = setup_exit_bench(vm, types);
+	mutex_unlock(&vm->lock);
+	if (ret) {
+		return ret;
+	}
+
+	u64 *samples = kvmalloc_array(n, sizeof(u64), GFP_KERNEL);
+	if (samples == NULL) {
+		return -ENOMEM;
+	}
+	memset(args->results, 0, sizeof(args->results));
+	for (type = 0; type < TVISOR_BENCH_NR_EXITS; type++) {
+		if (types & (1 << type)) {
+			ret = run_bench_payload(vm, type, n, samples,
+						&args->results[type]);
+			if (ret) {
+				break;
+			}
+		}
+	}
+	kvfree(samples);
+	return ret;
+}
+
+// The ring and its descriptors, written once: the guest only moves `head`,
+// so descriptor i always asks for block i of the device, wrapping around.
+static int setup_blk_bench(vm_state_t *vm, struct tvisor_blk_bench *args)
+{
+	blk_state_t *blk = READ_ONCE(vm->blk);
+	u32 i;
+
+	BUILD_BUG_ON(offsetof(struct tvisor_ring, tail) -
+			     offsetof(struct tvisor_ring, head) !=
+		     0x40);
+	BUILD_BUG_ON(offsetof(struct tvisor_ring, need_kick) -
+			     offsetof(struct tvisor_ring, head) !=
+		     0x44);
+	BUILD_BUG_ON(sizeof(struct tvisor_ring) +
+			     BENCH_RING_SIZE * sizeof(struct tvisor_ring_desc) >
+		     PAGE_SIZE);
+
+	if (blk == NULL) {
+		return -ENODEV;
+	}
+	if (blk->capacity < args->block_size) {
+		return -ENOSPC;
+	}
+	if (vm->mem_size <
+	    BENCH_BLK_BUF_ADDR + BENCH_RING_SIZE * TVISOR_BENCH_BLK_MAX_SIZE) {
+		return -ENOSPC;
+	}
+	int ret = setup_bench_guest(vm);
+	if (ret) {
+		return ret;
+	}
+
+	struct tvisor_ring *ring = kzalloc(PAGE_SIZE, GFP_KERNEL);
+	if (ring == NULL) {
+		return -ENOMEM;
+	}
+	u64 nr_blocks = blk->capacity / args->block_size;
+	ring->size = BENCH_RING_SIZE;
+	for (i = 0; i < BENCH_RING_SIZE; i++) {
+		ring->desc[i].addr = BENCH_BLK_BUF_ADDR + i * args->block_size;
+		ring->desc[i].len = args->block_size;
+		ring->desc[i].op = args->op;
+		ring->desc[i].offset = (i % nr_blocks) * args->block_size;
+	}
+	ret = write_guest_phys(vm, BENCH_RING_ADDR, ring, PAGE_SIZE);
+	kfree(ring);
+	if (ret) {
+		return ret;
+	}
+
+	return write_payload(vm, BENCH_BLK_CODE_ADDR, NULL, 0, bench_blk_body,
+			     sizeof(bench_blk_body));
+}
+
+// TVISOR_BENCH_BLK
+int run_blk_bench(vm_state_t *vm, struct tvisor_blk_bench *args)
+{
+	u32 n = args->iterations ?: BENCH_DEFAULT_ITERATIONS;
+	u32 total = n + BENCH_WARMUP;
+	blk_stats_t before, after;
+	int ret;
+
+	if (!args->depth) {
+		args->depth = 1;
+	}
+	if (!args->block_size) {
+		args->block_size = 4096;
+	}
+	if (n > TVISOR_BENCH_MAX_ITERATIONS ||
+	    args->depth > TVISOR_BENCH_BLK_MAX_DEPTH ||
+	    args->block_size % TVISOR_BLK_SECTOR_SIZE ||
+	    args->block_size > TVISOR_BENCH_BLK_MAX_SIZE ||
+	    (args->op != TVISOR_RING_OP_BLK_READ &&
+	     args->op != TVISOR_RING_OP_BLK_WRITE)) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&vm->lock);
+	ret = setup_blk_bench(vm, args);
+	mutex_unlock(&vm->lock);
+	if (ret) {
+		return ret;
+	}
+
+	u64 *samples = kvmalloc_array(n, sizeof(u64), GFP_KERNEL);
+	if (samples == NULL) {
+		return -ENOMEM;
+	}
+	ret = register_ring(vm, BENCH_RING_ADDR, 1);
+	if (ret) {
+		kvfree(samples);
+		return ret;
+	}
+
+	struct tvisor_regs *regs = start_payload(vm, BENCH_BLK_CODE_ADDR, total);
+	regs->rbx = BENCH_RING_ADDR + offsetof(struct tvisor_ring, head);
+	regs->r10 = args->depth;
+
+	get_blk_stats(vm, &before);
+	u64 start = ktime_get_ns();
+	ret = run_payload(vm, n, samples);
+	u64 elapsed = ktime_get_ns() - start;
+	get_blk_stats(vm, &after);
+	if (ret) {
+		goto out;
+	}
+
+	u64 requests = after.reads + after.writes - before.reads - before.writes;
+	if (after.errors != before.errors) {
+		ret = -EIO; // e.g. writes to a read-only file
+		goto out;
+	}
+	args->iops = requests * NSEC_PER_SEC / (elapsed ?: 1);
+	args->min = samples[0];
+	args->median = percentile(samples, n, 50);
+	args->p99 = percentile(samples, n, 99);
+	args->host_latency_ns =
+		(after.latency_ns - before.latency_ns) / (requests ?: 1);
+out:
+	kvfree(samples);
+	unregister_ring(vm);
+	return ret;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "tvisor.h"
+
+struct _vm_state;
+
+int run_exit_bench(struct _vm_state *vm, struct tvisor_exit_bench *args);
+int run_blk_bench(struct _vm_state *vm, struct tvisor_blk_bench *args);
@@ -0,0 +1,279 @@
+#include <linux/bvec.h> /* Needed for bvec_set_page */
+#include <linux/file.h> /* Needed for fget, fput */
+#include <linux/fs.h> /* Needed for struct kiocb, vfs_fsync */
+#include <linux/ktime.h> /* Needed for ktime_get_ns */
+#include <linux/slab.h> /* Needed for kmalloc */
+#include <linux/uio.h> /* Needed for iov_iter_bvec */
+
+#include "blk.h"
+#include "ept.h"
+#include "ring.h"
+#include "vm.h"
+
+// Block requests are submitted to the host file as asynchronous kiocbs, the
+// way the loop driver does, straight from/to the guest pages. A run of
+// descriptors with the same op covering adjacent ranges of the device
+// becomes a single host request.
+
+#define BLK_MAX_MERGE 32 // descriptors per host request
+// pages per host request: TVISOR_BLK_MAX_LEN plus one more page for every
+// descriptor whose buffer is not page aligned
+#define BLK_MAX_SEGS (TVISOR_BLK_MAX_LEN / PAGE_SIZE + BLK_MAX_MERGE)
+
+struct _blk_request {
+	struct kiocb iocb;
+	ring_state_t *rs;
+	blk_state_t *blk;
+	int write;
+	u64 offset; // on the device
+	u64 len;
+	u64 start_ns;
+	int nr_slots;
+	u32 slots[BLK_MAX_MERGE];
+	int nr_segs;
+	struct bio_vec segs[BLK_MAX_SEGS];
+};
+
+int set_blk_file(vm_state_t *vm, int fd)
+{
+	struct file *file = fget(fd);
+	if (file == NULL) {
+		return -EBADF;
+	}
+	if (!(file->f_mode & FMODE_READ) || file->f_op->read_iter == NULL ||
+	    file->f_op->write_iter == NULL) {
+		fput(file);
+		return -EINVAL;
+	}
+
+	blk_state_t *blk = kzalloc(sizeof(blk_state_t), GFP_KERNEL);
+	if (blk == NULL) {
+		fput(file);
+		return -ENOMEM;
+	}
+	blk->file = file;
+	blk->capacity = i_size_read(file->f_mapping->host) &
+			~(u64)(TVISOR_BLK_SECTOR_SIZE - 1);
+	blk->writable = !!(file->f_mode & FMODE_WRITE);
+	spin_lock_init(&blk->lock);
+
+	// the ring thread may look at vm->blk any time
+	if (cmpxchg(&vm->blk, NULL, blk) != NULL) {
+		fput(file);
+		kfree(blk);
+		return -EBUSY;
+	}
+	return 0;
+}
+
+// the ring must be gone
+void free_blk(vm_state_t *vm)
+{
+	blk_state_t *blk = vm->blk;
+	if (blk == NULL) {
+		return;
+	}
+	fput(blk->file);
+	kfree(blk);
+	vm->blk = NULL;
+}
+
+// TVISOR_HC_BLK_CAPACITY
+s64 blk_capacity(vm_state_t *vm)
+{
+	blk_state_t *blk = READ_ONCE(vm->blk);
+	return blk != NULL ? blk->capacity : -ENODEV;
+}
+
+int get_blk_stats(vm_state_t *vm, blk_stats_t *stats)
+{
+	unsigned long flags;
+	blk_state_t *blk = READ_ONCE(vm->blk);
+	if (blk == NULL) {
+		return -ENOENT;
+	}
+	spin_lock_irqsave(&blk->lock, flags);
+	*stats = blk->stats;
+	spin_unlock_irqrestore(&blk->lock, flags);
+	return 0;
+}
+
+static void account_blk(blk_state_t *blk, u16 op, int n, u64 bytes,
+			int status, u64 start_ns)
+{
+	unsigned long flags;
+	u64 latency = ktime_get_ns() - start_ns;
+
+	spin_lock_irqsave(&blk->lock, flags);
+	blk_stats_t *s = &blk->stats;
+	if (op == TVISOR_RING_OP_BLK_READ) {
+		s->reads += n;
+		s->submissions++;
+	} else if (op == TVISOR_RING_OP_BLK_WRITE) {
+		s->writes += n;
+		s->submissions++;
+	} else {
+		s->flushes += n;
+	}
+	if (status) {
+		s->errors += n;
+	} else {
+		s->bytes += bytes;
+	}
+	s->latency_ns += latency * n;
+	if (latency > s->max_latency_ns) {
+		s->max_latency_ns = latency;
+	}
+	spin_unlock_irqrestore(&blk->lock, flags);
+}
+
+// ki_complete of a host request, any context
+static void blk_complete(struct kiocb *iocb, long ret)
+{
+	blk_request_t *req = container_of(iocb, blk_request_t, iocb);
+	int status = ret == req->len ? 0 : ret < 0 ? ret : -EIO;
+	int i;
+
+	if (req->write) {
+		kiocb_end_write(iocb);
+	}
+	account_blk(req->blk,
+		    req->write ? TVISOR_RING_OP_BLK_WRITE :
+				 TVISOR_RING_OP_BLK_READ,
+		    req->nr_slots, req->len, status, req->start_ns);
+	for (i = 0; i < req->nr_slots; i++) {
+		complete_ring_desc(req->rs, req->slots[i], status);
+	}
+	kfree(req);
+}
+
+void blk_batch_init(blk_batch_t *batch, ring_state_t *rs)
+{
+	batch->rs = rs;
+	batch->req = NULL;
+}
+
+// hand the open request of `batch` to the host file
+void blk_submit(blk_batch_t *batch)
+{
+	blk_request_t *req = batch->req;
+	struct iov_iter iter;
+	ssize_t ret;
+
+	if (req == NULL) {
+		return;
+	}
+	batch->req = NULL;
+
+	struct file *file = req->blk->file;
+	iov_iter_bvec(&iter, req->write ? ITER_SOURCE : ITER_DEST, req->segs,
+		      req->nr_segs, req->len);
+	init_sync_kiocb(&req->iocb, file);
+	req->iocb.ki_pos = req->offset;
+	req->iocb.ki_complete = blk_complete; // makes it asynchronous
+	if (req->write) {
+		req->iocb.ki_flags |= IOCB_WRITE;
+		kiocb_start_write(&req->iocb);
+		ret = file->f_op->write_iter(&req->iocb, &iter);
+	} else {
+		ret = file->f_op->read_iter(&req->iocb, &iter);
+	}
+	if (ret != -EIOCBQUEUED) {
+		blk_complete(&req->iocb, ret);
+	}
+}
+
+static int add_blk_segs(blk_request_t *req, vm_state_t *vm, u64 addr,
+			u32 len)
+{
+	int nr_segs = req->nr_segs;
+
+	while (len) {
+		u32 off = offset_in_page(addr);
+		u32 chunk = min_t(u32, len, PAGE_SIZE - off);
+		struct page *page = gphys_to_page(addr - off, vm->ept_pointer);
+		if (page == NULL || nr_segs == BLK_MAX_SEGS) {
+			return -EFAULT;
+		}
+		bvec_set_page(&req->segs[nr_segs++], page, chunk, off);
+		addr += chunk;
+		len -= chunk;
+	}
+	req->nr_segs = nr_segs;
+	return 0;
+}
+
+// Start block descriptor `slot`: merge it into the open request if it
+// continues it, or open a new one.
+void blk_queue(blk_batch_t *batch, u32 slot, struct tvisor_ring_desc *desc)
+{
+	ring_state_t *rs = batch->rs;
+	blk_state_t *blk = READ_ONCE(rs->vm->blk);
+	u16 op = READ_ONCE(desc->op);
+	u64 addr = READ_ONCE(desc->addr);
+	u64 offset = READ_ONCE(desc->offset);
+	u32 len = READ_ONCE(desc->len);
+
+	if (blk == NULL) {
+		complete_ring_desc(rs, slot, -ENODEV);
+		return;
+	}
+
+	if (op == TVISOR_RING_OP_BLK_FLUSH) {
+		u64 start_ns = ktime_get_ns();
+		blk_submit(batch);
+		int ret = vfs_fsync(blk->file, 0);
+		account_blk(blk, op, 1, 0, ret, start_ns);
+		complete_ring_desc(rs, slot, ret);
+		return;
+	}
+
+	int write = op == TVISOR_RING_OP_BLK_WRITE;
+	if (write && !blk->writable) {
+		complete_ring_desc(rs, slot, -EROFS);
+		return;
+	}
+	if (len == 0 || len > TVISOR_BLK_MAX_LEN ||
+	    (len | offset) % TVISOR_BLK_SECTOR_SIZE ||
+	    offset > blk->capacity || len > blk->capacity - offset) {
+		complete_ring_desc(rs, slot, -EINVAL);
+		return;
+	}
+
+	blk_request_t *req = batch->req;
+	if (req != NULL &&
+	    (req->write != write || req->offset + req->len != offset ||
+	     req->nr_slots == BLK_MAX_MERGE ||
+	     req->len + len > TVISOR_BLK_MAX_LEN ||
+	     req->nr_segs + len / PAGE_SIZE + 2 > BLK_MAX_SEGS)) {
+		blk_submit(batch);
+		req = NULL;
+	}
+	if (req == NULL) {
+		req = kmalloc(sizeof(blk_request_t), GFP_KERNEL);
+		if (req == NULL) {
+			complete_ring_desc(rs, slot, -ENOMEM);
+			return;
+		}
+		req->rs = rs;
+		req->blk = blk;
+		req->write = write;
+		req->offset = offset;
+		req->len = 0;
+		req->start_ns = ktime_get_ns();
+		req->nr_slots = 0;
+		req->nr_segs = 0;
+		batch->req = req;
+	}
+
+	if (add_blk_segs(req, rs->vm, addr, len)) {
+		complete_ring_desc(rs, slot, -EFAULT);
+		if (req->nr_slots == 0) {
+			kfree(req);
+			batch->req = NULL;
+		}
+		return;
+	}
+	req->slots[req->nr_slots++] = slot;
+	req->len += len;
+}
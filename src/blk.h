@@ -0,0 +1,47 @@
+#pragma once
+
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+#include "tvisor.h"
+
+struct _vm_state;
+struct _ring_state;
+struct file;
+
+typedef struct _blk_stats {
+	u64 reads; // descriptors completed, by op
+	u64 writes;
+	u64 flushes;
+	u64 submissions; // reads and writes handed to the host file, after merging
+	u64 errors;
+	u64 bytes;
+	u64 latency_ns; // sum over completed descriptors, from pickup to completion
+	u64 max_latency_ns;
+} blk_stats_t;
+
+// the VM's paravirtual block device, requests come through its ring
+typedef struct _blk_state {
+	struct file *file;
+	u64 capacity; // bytes, whole sectors
+	int writable;
+	spinlock_t lock; // protects stats
+	blk_stats_t stats;
+} blk_state_t;
+
+typedef struct _blk_request blk_request_t;
+
+// descriptors started by one pass over the ring; adjacent reads or writes
+// are merged into one host request
+typedef struct _blk_batch {
+	struct _ring_state *rs;
+	blk_request_t *req; // still open for merging
+} blk_batch_t;
+
+int set_blk_file(struct _vm_state *vm, int fd);
+void free_blk(struct _vm_state *vm);
+s64 blk_capacity(struct _vm_state *vm);
+int get_blk_stats(struct _vm_state *vm, blk_stats_t *stats);
+void blk_batch_init(blk_batch_t *batch, struct _ring_state *rs);
+void blk_queue(blk_batch_t *batch, u32 slot, struct tvisor_ring_desc *desc);
+void blk_submit(blk_batch_t *batch);
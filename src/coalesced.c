@@ -0,0 +1,123 @@
+#include <linux/gfp.h> /* Needed for get_zeroed_page */
+#include <linux/mm.h> /* Needed for virt_to_page */
+
+#include "coalesced.h"
+#include "vm.h"
+
+// Writes that need no answer from the device model are recorded in a page
+// shared with userspace and the guest resumes right away; userspace replays
+// them in batches. Called from the exit handlers with interrupts off.
+
+int init_coalesced(coalesced_state_t *cs)
+{
+	spin_lock_init(&cs->lock);
+	mutex_init(&cs->zones_lock);
+	cs->ring = (struct tvisor_coalesced_ring *)get_zeroed_page(GFP_KERNEL);
+	return cs->ring != NULL ? 0 : -ENOMEM;
+}
+
+// userspace mappings hold their own reference to the page
+void free_coalesced(coalesced_state_t *cs)
+{
+	if (cs->ring != NULL) {
+		free_page((unsigned long)cs->ring);
+	}
+}
+
+// Returns 0 if the write went into the ring, -ENOSPC if it is full.
+static int coalesce(coalesced_state_t *cs, u64 addr, int size, int pio,
+		    u64 data)
+{
+	struct tvisor_coalesced_ring *ring = cs->ring;
+	int ret = 0;
+
+	spin_lock(&cs->lock);
+	u32 last = ring->last;
+	// `first` is userspace's, never index with it
+	if ((last + 1) % TVISOR_COALESCED_MAX == READ_ONCE(ring->first) ||
+	    last >= TVISOR_COALESCED_MAX) {
+		cs->stats.full++;
+		ret = -ENOSPC;
+		goto out;
+	}
+	struct tvisor_coalesced_entry *e = &ring->entries[last];
+	e->addr = addr;
+	e->len = size;
+	e->pio = pio;
+	e->data = data;
+	smp_store_release(&ring->last, (last + 1) % TVISOR_COALESCED_MAX);
+	cs->stats.entries++;
+out:
+	spin_unlock(&cs->lock);
+	return ret;
+}
+
+static int coalesced_mmio_read(mmio_dev_t *dev, u64 offset, int size,
+			       u64 *value)
+{
+	return -EOPNOTSUPP; // reads need an answer, let userspace have them
+}
+
+static int coalesced_mmio_write(mmio_dev_t *dev, u64 offset, int size,
+				u64 value)
+{
+	coalesced_zone_t *z = dev->opaque;
+	return coalesce(z->state, dev->base + offset, size, 0, value);
+}
+
+static const mmio_ops_t coalesced_mmio_ops = {
+	.read = coalesced_mmio_read,
+	.write = coalesced_mmio_write,
+};
+
+int register_coalesced_zone(vm_state_t *vm,
+			    const struct tvisor_coalesced_zone *zone)
+{
+	coalesced_state_t *cs = &vm->coalesced;
+	int ret = 0;
+
+	if (zone->size == 0 || zone->pio > 1 ||
+	    (zone->pio && zone->addr + zone->size > 0x10000)) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&cs->zones_lock);
+	if (cs->nr_zones == TVISOR_COALESCED_MAX_ZONES) {
+		ret = -ENOSPC;
+		goto out;
+	}
+	coalesced_zone_t *z = &cs->zones[cs->nr_zones];
+	z->zone = *zone;
+	z->state = cs;
+	if (!zone->pio) {
+		z->dev.base = zone->addr;
+		z->dev.len = zone->size;
+		z->dev.ops = &coalesced_mmio_ops;
+		z->dev.opaque = z;
+		ret = register_mmio_dev(vm, &z->dev);
+		if (ret) {
+			goto out;
+		}
+	}
+	smp_store_release(&cs->nr_zones, cs->nr_zones + 1); // after zones[]
+out:
+	mutex_unlock(&cs->zones_lock);
+	return ret;
+}
+
+// OUT to `port`: returns 0 if it went into the ring, non-zero if it has to
+// go to userspace
+int coalesce_pio(coalesced_state_t *cs, u16 port, int size, u64 data)
+{
+	int nr = smp_load_acquire(&cs->nr_zones);
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		struct tvisor_coalesced_zone *zone = &cs->zones[i].zone;
+		if (zone->pio && port >= zone->addr &&
+		    port + size <= zone->addr + zone->size) {
+			return coalesce(cs, port, size, 1, data);
+		}
+	}
+	return -ENOENT;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+#include "mmio.h"
+#include "tvisor.h"
+
+struct _vm_state;
+
+typedef struct _coalesced_zone {
+	struct tvisor_coalesced_zone zone;
+	mmio_dev_t dev; // MMIO zones sit on the VM's MMIO bus
+	struct _coalesced_state *state;
+} coalesced_zone_t;
+
+typedef struct _coalesced_stats {
+	u64 entries; // writes appended to the ring
+	u64 full; // writes that exited because the ring was full
+} coalesced_stats_t;
+
+typedef struct _coalesced_state {
+	struct tvisor_coalesced_ring *ring; // page shared with userspace
+	spinlock_t lock; // serializes vCPUs appending to `ring`
+	struct mutex zones_lock; // serializes registration
+	int nr_zones; // zones are only ever added
+	coalesced_zone_t zones[TVISOR_COALESCED_MAX_ZONES];
+	coalesced_stats_t stats;
+} coalesced_state_t;
+
+int init_coalesced(coalesced_state_t *cs);
+void free_coalesced(coalesced_state_t *cs);
+int register_coalesced_zone(struct _vm_state *vm,
+			    const struct tvisor_coalesced_zone *zone);
+int coalesce_pio(coalesced_state_t *cs, u16 port, int size, u64 data);
@@ -1,12 +1,17 @@
 #include "cpu.h"
 
 cpuid_t get_cpuid(u32 level)
+{
+	return get_cpuid_count(level, 0);
+}
+
+cpuid_t get_cpuid_count(u32 level, u32 subleaf)
 {
 	cpuid_t cpuid = { 0, 0, 0, 0 };
 	asm volatile("cpuid"
 		     : "=a"(cpuid.eax), "=b"(cpuid.ebx), "=c"(cpuid.ecx),
 		       "=d"(cpuid.edx)
-		     : "r"(level));
+		     : "a"(level), "c"(subleaf));
 
 	return cpuid;
 }
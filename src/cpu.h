@@ -43,6 +43,7 @@ typedef struct _segment_descriptor {
 enum SEGREGS { ES = 0, CS, SS, DS, FS, GS, LDTR, TR };
 
 cpuid_t get_cpuid(u32 level);
+cpuid_t get_cpuid_count(u32 level, u32 subleaf);
 u16 read_es(void);
 u16 read_cs(void);
 u16 read_ss(void);
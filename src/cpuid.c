@@ -0,0 +1,396 @@
+#include <asm/processor-flags.h> /* Needed for X86_CR4_OSXSAVE */
+#include <linux/log2.h> /* Needed for order_base_2 */
+#include <linux/minmax.h> /* Needed for min_t */
+#include <linux/mutex.h> /* Needed for mutex_lock */
+#include <linux/overflow.h> /* Needed for struct_size */
+#include <linux/printk.h> /* Needed for pr_debug */
+#include <linux/slab.h> /* Needed for kzalloc */
+#include <linux/sort.h> /* Needed for sort */
+#include <linux/string.h> /* Needed for memcpy */
+
+#include "cpu.h"
+#include "cpuid.h"
+#include "pmu.h"
+#include "vm.h"
+#include "vmx.h"
+
+// The table is built from the host's CPUID once per VM, so CPUID exits are
+// answered by a binary search and never run a real (serializing) CPUID.
+// vCPUs read it with interrupts off, updates are published with RCU.
+
+#define CPUID_MAX_BASIC_LEAF 0x1f
+#define CPUID_MAX_EXT_LEAF 0x80000008
+#define CPUID_MAX_SUBLEAF 16
+#define CPUID_HYPERVISOR_BASE 0x40000000
+#define CPUID_HYPERVISOR_LAST 0x4fffffff
+
+// leaf 1
+#define CPUID_1_ECX_MONITOR (1u << 3)
+#define CPUID_1_ECX_VMX (1u << 5)
+#define CPUID_1_ECX_SMX (1u << 6)
+#define CPUID_1_ECX_OSXSAVE (1u << 27)
+#define CPUID_1_ECX_HYPERVISOR (1u << 31)
+#define CPUID_1_EDX_HTT (1u << 28)
+
+// leaf 7 subleaf 0
+#define CPUID_7_EBX_SGX (1u << 2)
+#define CPUID_7_EBX_RDT_M (1u << 12)
+#define CPUID_7_EBX_RDT_A (1u << 15)
+#define CPUID_7_ECX_SGX_LC (1u << 30)
+
+// leaf 0xb/0x1f level types
+#define CPUID_TOPO_SMT 1
+#define CPUID_TOPO_CORE 2
+
+static struct tvisor_cpuid_entry *add_entry(cpuid_table_t *t, u32 function,
+					    u32 index, u32 flags, cpuid_t c)
+{
+	if (t->nent >= TVISOR_MAX_CPUID_ENTRIES) {
+		return NULL;
+	}
+
+	struct tvisor_cpuid_entry *e = &t->entries[t->nent++];
+	e->function = function;
+	e->index = index;
+	e->flags = flags;
+	e->eax = c.eax;
+	e->ebx = c.ebx;
+	e->ecx = c.ecx;
+	e->edx = c.edx;
+	return e;
+}
+
+static struct tvisor_cpuid_entry *add_host_entry(cpuid_table_t *t,
+						 u32 function, u32 index,
+						 u32 flags)
+{
+	return add_entry(t, function, index, flags,
+			 get_cpuid_count(function, index));
+}
+
+// one package of TVISOR_MAX_VCPUS cores with one thread each; EDX (the
+// x2APIC ID) is filled in per vCPU by lookup_cpuid()
+static void add_topology(cpuid_table_t *t, u32 function)
+{
+	cpuid_t smt = { 0, 1, CPUID_TOPO_SMT << 8 | 0, 0 };
+	cpuid_t core = { order_base_2(TVISOR_MAX_VCPUS), TVISOR_MAX_VCPUS,
+			 CPUID_TOPO_CORE << 8 | 1, 0 };
+	cpuid_t invalid = { 0, 0, 2, 0 };
+
+	add_entry(t, function, 0, TVISOR_CPUID_FLAG_INDEXED, smt);
+	add_entry(t, function, 1, TVISOR_CPUID_FLAG_INDEXED, core);
+	add_entry(t, function, 2, TVISOR_CPUID_FLAG_INDEXED, invalid);
+}
+
+static void add_basic_leaf(cpuid_table_t *t, u32 function)
+{
+	const cpuid_t zero = { 0, 0, 0, 0 };
+	struct tvisor_cpuid_entry *e;
+	u32 i, max;
+
+	switch (function) {
+	case 1:
+		e = add_host_entry(t, function, 0, 0);
+		if (e != NULL) {
+			e->ecx &= ~(CPUID_1_ECX_VMX | CPUID_1_ECX_SMX |
+				    CPUID_1_ECX_MONITOR);
+			e->ecx |= CPUID_1_ECX_HYPERVISOR;
+			e->ebx = (e->ebx & 0x0000ffff) | (TVISOR_MAX_VCPUS << 16);
+			e->edx |= CPUID_1_EDX_HTT;
+		}
+		break;
+	case 4: // deterministic cache parameters, up to the null cache type
+		for (i = 0; i < CPUID_MAX_SUBLEAF; i++) {
+			e = add_host_entry(t, function, i,
+					   TVISOR_CPUID_FLAG_INDEXED);
+			if (e == NULL || (e->eax & 0x1f) == 0) {
+				break;
+			}
+			e->eax = (e->eax & 0x03ffffff) |
+				 ((TVISOR_MAX_VCPUS - 1) << 26);
+		}
+		break;
+	case 0xa: // the vPMU, if any
+		add_entry(t, function, 0, 0, guest_pmu_cpuid());
+		break;
+	case 5: // MONITOR/MWAIT are hidden
+	case 0xf: // no RDT
+	case 0x10:
+	case 0x12: // no SGX
+		add_entry(t, function, 0, 0, zero);
+		break;
+	case 7:
+	case 0x14:
+	case 0x17:
+	case 0x18: // subleaf 0 EAX is the highest subleaf
+		max = min_t(u32, get_cpuid_count(function, 0).eax,
+			    CPUID_MAX_SUBLEAF - 1);
+		for (i = 0; i <= max; i++) {
+			e = add_host_entry(t, function, i,
+					   TVISOR_CPUID_FLAG_INDEXED);
+			if (e != NULL && function == 7 && i == 0) {
+				e->ebx &= ~(CPUID_7_EBX_SGX | CPUID_7_EBX_RDT_M |
+					    CPUID_7_EBX_RDT_A);
+				e->ecx &= ~CPUID_7_ECX_SGX_LC;
+			}
+		}
+		break;
+	case 0xb:
+	case 0x1f:
+		add_topology(t, function);
+		break;
+	case 0xd: { // XSAVE, one subleaf per state component
+		cpuid_t c = get_cpuid_count(function, 0);
+		u64 supported = ((u64)c.edx << 32) | c.eax;
+
+		add_entry(t, function, 0, TVISOR_CPUID_FLAG_INDEXED, c);
+		add_host_entry(t, function, 1, TVISOR_CPUID_FLAG_INDEXED);
+		for (i = 2; i < 63; i++) {
+			if (supported & (1ull << i)) {
+				add_host_entry(t, function, i,
+					       TVISOR_CPUID_FLAG_INDEXED);
+			}
+		}
+		break;
+	}
+	default:
+		add_host_entry(t, function, 0, 0);
+		break;
+	}
+}
+
+static int cmp_cpuid_entry(const void *a, const void *b)
+{
+	const struct tvisor_cpuid_entry *x = a, *y = b;
+
+	if (x->function != y->function) {
+		return x->function < y->function ? -1 : 1;
+	}
+	if (x->index != y->index) {
+		return x->index < y->index ? -1 : 1;
+	}
+	return 0;
+}
+
+static cpuid_table_t *alloc_cpuid_table(void)
+{
+	cpuid_table_t *t;
+	return kzalloc(struct_size(t, entries, TVISOR_MAX_CPUID_ENTRIES),
+		       GFP_KERNEL_ACCOUNT);
+}
+
+cpuid_table_t *build_cpuid_table(void)
+{
+	cpuid_table_t *t = alloc_cpuid_table();
+	if (t == NULL) {
+		return NULL;
+	}
+
+	u32 max_basic =
+		min_t(u32, get_cpuid(0).eax, CPUID_MAX_BASIC_LEAF);
+	u32 f;
+	for (f = 0; f <= max_basic; f++) {
+		add_basic_leaf(t, f);
+	}
+	t->entries[0].eax = max_basic;
+
+	cpuid_t hv = { CPUID_HYPERVISOR_BASE + 1, 0, 0, 0 };
+	memcpy(&hv.ebx, "TvisorTvisor", 12);
+	add_entry(t, CPUID_HYPERVISOR_BASE, 0, 0, hv);
+	cpuid_t hv_features = { 0, 0, 0, 0 };
+	add_entry(t, CPUID_HYPERVISOR_BASE + 1, 0, 0, hv_features);
+
+	u32 max_ext = min_t(u32, get_cpuid(0x80000000).eax, CPUID_MAX_EXT_LEAF);
+	struct tvisor_cpuid_entry *e = add_host_entry(t, 0x80000000, 0, 0);
+	if (e != NULL) {
+		e->eax = max_ext;
+	}
+	for (f = 0x80000001; f <= max_ext; f++) {
+		add_host_entry(t, f, 0, 0);
+	}
+
+	// already in order, but keep the invariant explicit
+	sort(t->entries, t->nent, sizeof(t->entries[0]), cmp_cpuid_entry, NULL);
+
+	pr_debug("tvisor: CPUID table with %d entries\n", t->nent);
+	return t;
+}
+
+void free_cpuid_table(cpuid_table_t *table)
+{
+	kfree(table);
+}
+
+static struct tvisor_cpuid_entry *find_entry(cpuid_table_t *t, u32 function,
+					     u32 index)
+{
+	int lo = 0, hi = t->nent;
+
+	while (lo < hi) {
+		int mid = lo + (hi - lo) / 2;
+		if (t->entries[mid].function < function) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	for (; lo < t->nent && t->entries[lo].function == function; lo++) {
+		struct tvisor_cpuid_entry *e = &t->entries[lo];
+		if (!(e->flags & TVISOR_CPUID_FLAG_INDEXED) || e->index == index) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+// Merge `entry` into `t`, which need not be sorted: replace the entry with
+// the same function and index or append it. A leaf has either one
+// non-indexed entry or indexed ones, a new entry of the other kind replaces
+// all of the leaf's entries.
+static int merge_entry(cpuid_table_t *t, const struct tvisor_cpuid_entry *entry)
+{
+	int i, n = 0, replaced = 0;
+
+	for (i = 0; i < t->nent; i++) {
+		struct tvisor_cpuid_entry *e = &t->entries[i];
+		if (e->function == entry->function) {
+			if ((e->flags ^ entry->flags) & TVISOR_CPUID_FLAG_INDEXED) {
+				continue; // drop it
+			}
+			if (e->index == entry->index) {
+				*e = *entry;
+				replaced = 1;
+			}
+		}
+		t->entries[n++] = *e;
+	}
+	t->nent = n;
+
+	if (replaced) {
+		return 0;
+	}
+	if (t->nent >= TVISOR_MAX_CPUID_ENTRIES) {
+		return -E2BIG;
+	}
+	t->entries[t->nent++] = *entry;
+	return 0;
+}
+
+// Merge `entries` into a copy of the VM's table and publish it.
+int set_cpuid_entries(vm_state_t *vm, const struct tvisor_cpuid_entry *entries,
+		      int nent)
+{
+	int i;
+
+	for (i = 0; i < nent; i++) {
+		if (entries[i].flags & ~TVISOR_CPUID_FLAG_INDEXED) {
+			return -EINVAL;
+		}
+	}
+
+	cpuid_table_t *new = alloc_cpuid_table();
+	if (new == NULL) {
+		return -ENOMEM;
+	}
+
+	mutex_lock(&vm->lock);
+	cpuid_table_t *old =
+		rcu_dereference_protected(vm->cpuid, lockdep_is_held(&vm->lock));
+	new->nent = old->nent;
+	memcpy(new->entries, old->entries, old->nent * sizeof(old->entries[0]));
+
+	for (i = 0; i < nent; i++) {
+		struct tvisor_cpuid_entry entry = entries[i];
+		if (!(entry.flags & TVISOR_CPUID_FLAG_INDEXED)) {
+			entry.index = 0;
+		}
+		entry.padding = 0;
+
+		if (merge_entry(new, &entry)) {
+			mutex_unlock(&vm->lock);
+			kfree(new);
+			return -E2BIG;
+		}
+	}
+	sort(new->entries, new->nent, sizeof(new->entries[0]), cmp_cpuid_entry,
+	     NULL);
+
+	rcu_assign_pointer(vm->cpuid, new);
+	mutex_unlock(&vm->lock);
+
+	synchronize_rcu();
+	free_cpuid_table(old);
+	return 0;
+}
+
+// Returns the number of entries in the table; they are copied to `entries`
+// only if there is room for all of them.
+int get_cpuid_entries(vm_state_t *vm, struct tvisor_cpuid_entry *entries,
+		      int nent)
+{
+	mutex_lock(&vm->lock);
+	cpuid_table_t *t =
+		rcu_dereference_protected(vm->cpuid, lockdep_is_held(&vm->lock));
+	int n = t->nent;
+	if (n <= nent) {
+		memcpy(entries, t->entries, n * sizeof(t->entries[0]));
+	}
+	mutex_unlock(&vm->lock);
+
+	return n;
+}
+
+// leaves above the highest one of their range return the highest basic leaf
+static int is_out_of_range(cpuid_table_t *t, u32 function)
+{
+	if (function >= CPUID_HYPERVISOR_BASE &&
+	    function <= CPUID_HYPERVISOR_LAST) {
+		return 0;
+	}
+
+	struct tvisor_cpuid_entry *max = find_entry(t, function & 0x80000000, 0);
+	return max == NULL || function > max->eax;
+}
+
+// Called on CPUID exits with interrupts off, the VMCS of `vcpu` loaded.
+cpuid_t lookup_cpuid(vcpu_state_t *vcpu, u32 function, u32 index)
+{
+	cpuid_table_t *t = rcu_dereference_sched(vcpu->vm->cpuid);
+	cpuid_t c = { 0, 0, 0, 0 };
+
+	struct tvisor_cpuid_entry *e = find_entry(t, function, index);
+	if (e == NULL && is_out_of_range(t, function)) {
+		struct tvisor_cpuid_entry *max = find_entry(t, 0, 0);
+		if (max != NULL) {
+			function = max->eax;
+			e = find_entry(t, function, index);
+		}
+	}
+	if (e == NULL) {
+		return c;
+	}
+
+	c.eax = e->eax;
+	c.ebx = e->ebx;
+	c.ecx = e->ecx;
+	c.edx = e->edx;
+
+	// the per-vCPU bits
+	switch (function) {
+	case 1:
+		c.ebx = (c.ebx & 0x00ffffff) | ((u32)vcpu->id << 24);
+		if (vmcs_readl(GUEST_CR4) & X86_CR4_OSXSAVE) {
+			c.ecx |= CPUID_1_ECX_OSXSAVE;
+		} else {
+			c.ecx &= ~CPUID_1_ECX_OSXSAVE;
+		}
+		break;
+	case 0xb:
+	case 0x1f:
+		c.edx = vcpu->id;
+		break;
+	}
+
+	return c;
+}
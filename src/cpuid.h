@@ -0,0 +1,25 @@
+#pragma once
+
+#include <linux/rcupdate.h>
+#include <linux/types.h>
+
+#include "cpu.h"
+#include "tvisor.h"
+
+struct _vcpu_state;
+struct _vm_state;
+
+// a VM's answers to CPUID, sorted by function and index
+typedef struct _cpuid_table {
+	struct rcu_head rcu;
+	int nent;
+	struct tvisor_cpuid_entry entries[];
+} cpuid_table_t;
+
+cpuid_table_t *build_cpuid_table(void);
+void free_cpuid_table(cpuid_table_t *table);
+int set_cpuid_entries(struct _vm_state *vm,
+		      const struct tvisor_cpuid_entry *entries, int nent);
+int get_cpuid_entries(struct _vm_state *vm, struct tvisor_cpuid_entry *entries,
+		      int nent);
+cpuid_t lookup_cpuid(struct _vcpu_state *vcpu, u32 function, u32 index);
@@ -1,9 +1,13 @@
 #include <linux/mm.h>
+#include <linux/percpu.h> /* Needed for this_cpu_inc */
 #include <linux/slab.h>
+#include <linux/sizes.h> /* Needed for SZ_1M */
 
 #include "cpu.h"
 #include "ept.h"
+#include "stats.h"
 #include "util.h"
+#include "vmx.h"
 
 u64 gphys_to_hphys(u64 gphys, ept_pointer_t *eptp)
 {
@@ -28,12 +32,52 @@ u64 gphys_to_hphys(u64 gphys, ept_pointer_t *eptp)
 	return hphys;
 }
 
+// The EPT leaf entry for guest-physical `gphys`, or NULL if the guest has
+// no memory there. The entries for the rest of the 2 MiB region follow it,
+// check ignored1 before using them.
+ept_pte_t *gphys_to_ept_pte(u64 gphys, ept_pointer_t *eptp)
+{
+	u64 pa_ept_pml4 = (u64)eptp->fields.ept_pml4_table_address << 12;
+	ept_pml4e_t *pml4e = (ept_pml4e_t *)__va(pa_ept_pml4) +
+			     ((gphys >> 39) & 0x1ff);
+	if (gphys >> 48 || !pml4e->fields.ignored1) {
+		return NULL;
+	}
+	ept_pdpte_t *pdpte =
+		(ept_pdpte_t *)__va((u64)pml4e->fields.ept_pdpt_address << 12) +
+		((gphys >> 30) & 0x1ff);
+	if (!pdpte->fields.ignored1) {
+		return NULL;
+	}
+	ept_pde_t *pde =
+		(ept_pde_t *)__va((u64)pdpte->fields.ept_pd_address << 12) +
+		((gphys >> 21) & 0x1ff);
+	if (!pde->fields.ignored1) {
+		return NULL;
+	}
+	ept_pte_t *pte = (ept_pte_t *)__va((u64)pde->fields.ept_pt_address << 12) +
+			 ((gphys >> 12) & 0x1ff);
+	if (!pte->fields.ignored1) {
+		return NULL;
+	}
+	return pte;
+}
+
+// The host page backing guest-physical `gphys`, or NULL if the guest has no
+// memory there. Unlike gphys_to_hphys() it is safe on any address.
+struct page *gphys_to_page(u64 gphys, ept_pointer_t *eptp)
+{
+	ept_pte_t *pte = gphys_to_ept_pte(gphys, eptp);
+	return pte != NULL ? pfn_to_page(pte->fields.page_address) : NULL;
+}
+
 static void *alloc_ept_page(void)
 {
 	struct page *page = alloc_page(GFP_KERNEL_ACCOUNT);
 	if (page == NULL) {
 		return NULL;
 	}
+	this_cpu_inc(host_stats.pages_allocated);
 	void *page_va = page_address(page);
 	memset(page_va, 0xf4, 0x1000);
 
@@ -43,6 +87,7 @@ static void *alloc_ept_page(void)
 static void free_ept_page(void *page_va)
 {
 	__free_page(virt_to_page(page_va));
+	this_cpu_inc(host_stats.pages_freed);
 }
 
 static ept_pte_t *alloc_ept_pt(void)
@@ -51,6 +96,7 @@ static ept_pte_t *alloc_ept_pt(void)
 	if (page == NULL) {
 		return NULL;
 	}
+	this_cpu_inc(host_stats.pages_allocated);
 	ept_pte_t *pt = (ept_pte_t *)page_address(page);
 	memset(pt, 0, 0x1000);
 	return pt;
@@ -71,6 +117,7 @@ static void free_ept_pt_recursive(ept_pte_t *pt)
 		}
 	}
 	__free_page(virt_to_page(pt));
+	this_cpu_inc(host_stats.pages_freed);
 }
 
 static ept_pde_t *alloc_ept_pd(void)
@@ -79,6 +126,7 @@ static ept_pde_t *alloc_ept_pd(void)
 	if (page == NULL) {
 		return NULL;
 	}
+	this_cpu_inc(host_stats.pages_allocated);
 	ept_pde_t *pd = (ept_pde_t *)page_address(page);
 	memset(pd, 0, 0x1000);
 	return pd;
@@ -99,6 +147,7 @@ static void free_ept_pd_recursive(ept_pde_t *pd)
 		}
 	}
 	__free_page(virt_to_page(pd));
+	this_cpu_inc(host_stats.pages_freed);
 }
 
 static ept_pdpte_t *alloc_ept_pdpt(void)
@@ -107,6 +156,7 @@ static ept_pdpte_t *alloc_ept_pdpt(void)
 	if (page == NULL) {
 		return NULL;
 	}
+	this_cpu_inc(host_stats.pages_allocated);
 	ept_pdpte_t *pdpt = (ept_pdpte_t *)page_address(page);
 	memset(pdpt, 0, 0x1000);
 	return pdpt;
@@ -127,6 +177,7 @@ static void free_ept_pdpt_recursive(ept_pdpte_t *pdpt)
 		}
 	}
 	__free_page(virt_to_page(pdpt));
+	this_cpu_inc(host_stats.pages_freed);
 }
 
 static ept_pml4e_t *alloc_ept_pml4(void)
@@ -135,6 +186,7 @@ static ept_pml4e_t *alloc_ept_pml4(void)
 	if (page == NULL) {
 		return NULL;
 	}
+	this_cpu_inc(host_stats.pages_allocated);
 	ept_pml4e_t *pml4 = (ept_pml4e_t *)page_address(page);
 	memset(pml4, 0, 0x1000);
 	return pml4;
@@ -155,6 +207,7 @@ static void free_ept_pml4_recursive(ept_pml4e_t *pml4)
 		}
 	}
 	__free_page(virt_to_page(pml4));
+	this_cpu_inc(host_stats.pages_freed);
 }
 
 static ept_pointer_t *alloc_ept_pointer(void)
@@ -173,14 +226,15 @@ static void *alloc_page_rec_by_memsize(void)
 	return alloc_ept_page();
 }
 
-static ept_pte_t *alloc_pt_rec_by_memsize(u64 size_kib)
+// `nr_pages` 4KiB pages, up to 512 (2MiB)
+static ept_pte_t *alloc_pt_rec_by_memsize(u64 nr_pages)
 {
 	ept_pte_t *pt = alloc_ept_pt();
 	if (pt == NULL) {
 		return NULL;
 	} else {
 		size_t i;
-		for (i = 0; i < size_kib; i++) {
+		for (i = 0; i < nr_pages; i++) {
 			void *page = alloc_page_rec_by_memsize();
 			if (page == NULL) {
 				free_ept_pt_recursive(pt);
@@ -207,28 +261,29 @@ static ept_pte_t *alloc_pt_rec_by_memsize(u64 size_kib)
 	return pt;
 }
 
+// `size_mib` MiB, up to 1GiB
 static ept_pde_t *alloc_pd_rec_by_memsize(u64 size_mib)
 {
-	size_t size_kib = size_mib * 0x1000;
+	size_t nr_pages = size_mib * (SZ_1M / PAGE_SIZE);
 
-	const size_t max_kib_per_entry = 0x200;
+	const size_t max_pages_per_entry = 0x200; // 2MiB
 
 	ept_pde_t *pd = alloc_ept_pd();
 	if (pd == NULL) {
 		return NULL;
 	} else {
-		size_t i, copy_kib = size_kib;
-		for (i = 0; copy_kib > 0; i++) {
-			size_t assign_kib = 0;
-			if (copy_kib > max_kib_per_entry) {
-				assign_kib = max_kib_per_entry;
-				copy_kib -= max_kib_per_entry;
+		size_t i, copy_pages = nr_pages;
+		for (i = 0; copy_pages > 0; i++) {
+			size_t assign_pages = 0;
+			if (copy_pages > max_pages_per_entry) {
+				assign_pages = max_pages_per_entry;
+				copy_pages -= max_pages_per_entry;
 			} else {
-				assign_kib = copy_kib;
-				copy_kib -= assign_kib;
+				assign_pages = copy_pages;
+				copy_pages -= assign_pages;
 			}
-			// pr_debug("tvisor: alloc %lxKib memory\n", assign_kib);
-			ept_pte_t *pt = alloc_pt_rec_by_memsize(assign_kib);
+			// pr_debug("tvisor: alloc %lx pages\n", assign_pages);
+			ept_pte_t *pt = alloc_pt_rec_by_memsize(assign_pages);
 			if (pt == NULL) {
 				free_ept_pd_recursive(pd);
 				return NULL;
@@ -251,7 +306,7 @@ static ept_pde_t *alloc_pd_rec_by_memsize(u64 size_mib)
 
 static ept_pdpte_t *alloc_pdpt_rec_by_memsize(u64 size_mib)
 {
-	const size_t max_mib_per_entry = 0x40;
+	const size_t max_mib_per_entry = 0x400; // 1GiB
 
 	ept_pdpte_t *pdpt = alloc_ept_pdpt();
 	if (pdpt == NULL) {
@@ -291,7 +346,7 @@ static ept_pdpte_t *alloc_pdpt_rec_by_memsize(u64 size_mib)
 
 static ept_pml4e_t *alloc_pml4_rec_by_memsize(u64 size_mib)
 {
-	const size_t max_mib_per_entry = 0x8000;
+	const size_t max_mib_per_entry = 0x80000; // 512GiB
 
 	ept_pml4e_t *pml4 = alloc_ept_pml4();
 	if (pml4 == NULL) {
@@ -355,9 +410,15 @@ static ept_pointer_t *alloc_ept_rec_by_memsize(u64 size_mib)
 // request physical memory size is `size_mib`(MiB)
 ept_pointer_t *create_ept_by_memsize(u64 size_mib)
 {
-	// TODO:
-	// cpuid_t cpuid = get_cpuid(0x80000008);
-	// size_t phys_addr_bits = (size_t)(cpuid.eax & 0xff);
+	// guest-physical addresses are limited to MAXPHYADDR bits and to the
+	// 48 bits a 4-level walk covers; compare bytes, the last byte of RAM
+	// must still be addressable
+	u64 max_bytes = 1ull << min(VMX_CAP.max_phys_addr_bits, 48u);
+	if (size_mib == 0 || size_mib > max_bytes / SZ_1M) {
+		pr_alert("tvisor: guest memory size %llu MiB exceeds MAXPHYADDR(%u)\n",
+			 size_mib, VMX_CAP.max_phys_addr_bits);
+		return NULL;
+	}
 
 	ept_pointer_t *eptp = alloc_ept_rec_by_memsize(size_mib);
 
@@ -89,5 +89,10 @@ typedef union _ept_pte {
 	} fields;
 } ept_pte_t;
 
+struct page;
+
 ept_pointer_t *create_ept_by_memsize(u64 size_mib);
+u64 gphys_to_hphys(u64 gphys, ept_pointer_t *eptp);
+ept_pte_t *gphys_to_ept_pte(u64 gphys, ept_pointer_t *eptp);
+struct page *gphys_to_page(u64 gphys, ept_pointer_t *eptp);
 void free_ept(ept_pointer_t *eptp);
\ No newline at end of file
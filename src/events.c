@@ -0,0 +1,121 @@
+#include <linux/bitops.h> /* Needed for test_and_set_bit */
+#include <linux/ktime.h> /* Needed for ktime_get_ns */
+#include <linux/math.h> /* Needed for rounddown */
+#include <linux/uaccess.h> /* Needed for copy_to_user */
+
+#include "events.h"
+
+// Events are posted from the exit handlers with interrupts off and from
+// the run loop; the supervisor reads them from the VM fd or waits for them
+// with poll/epoll. A full queue drops events and reports how many with a
+// TVISOR_EVENT_LOST record.
+
+void init_event_queue(event_queue_t *eq)
+{
+	spin_lock_init(&eq->lock);
+	INIT_KFIFO(eq->fifo);
+	eq->lost = 0;
+	eq->console_queued = 0;
+	mutex_init(&eq->read_lock);
+	init_waitqueue_head(&eq->wq);
+}
+
+// Any context. Console output only queues an event if the last one was
+// read already, the supervisor reads the console until it is empty anyway.
+void post_event(event_queue_t *eq, u32 type, u32 vcpu, u64 data)
+{
+	struct tvisor_event ev = {
+		.type = type,
+		.vcpu = vcpu,
+		.data = data,
+		.timestamp_ns = ktime_get_ns(),
+	};
+	unsigned long flags;
+
+	if (type == TVISOR_EVENT_CONSOLE &&
+	    (test_bit(0, &eq->console_queued) ||
+	     test_and_set_bit(0, &eq->console_queued))) {
+		return;
+	}
+
+	spin_lock_irqsave(&eq->lock, flags);
+	if (!kfifo_put(&eq->fifo, ev)) {
+		eq->lost++;
+	}
+	spin_unlock_irqrestore(&eq->lock, flags);
+
+	if (wq_has_sleeper(&eq->wq)) {
+		wake_up_interruptible(&eq->wq);
+	}
+}
+
+static int has_events(event_queue_t *eq)
+{
+	return !kfifo_is_empty(&eq->fifo) || READ_ONCE(eq->lost);
+}
+
+// Copy whole records to userspace. Blocks until there is one unless
+// `nonblock`.
+ssize_t read_events(event_queue_t *eq, char __user *buf, size_t count,
+		    int nonblock)
+{
+	const size_t size = sizeof(struct tvisor_event);
+	unsigned long flags;
+	unsigned int copied;
+	size_t n = 0;
+	int ret = 0;
+
+	if (count < size) {
+		return -EINVAL;
+	}
+	for (;;) {
+		if (mutex_lock_interruptible(&eq->read_lock)) {
+			return -ERESTARTSYS;
+		}
+		if (has_events(eq)) {
+			break;
+		}
+		mutex_unlock(&eq->read_lock);
+		if (nonblock) {
+			return -EAGAIN;
+		}
+		if (wait_event_interruptible(eq->wq, has_events(eq))) {
+			return -ERESTARTSYS;
+		}
+	}
+
+	spin_lock_irqsave(&eq->lock, flags);
+	u64 lost = eq->lost;
+	eq->lost = 0;
+	spin_unlock_irqrestore(&eq->lock, flags);
+	if (lost) {
+		struct tvisor_event ev = {
+			.type = TVISOR_EVENT_LOST,
+			.data = lost,
+			.timestamp_ns = ktime_get_ns(),
+		};
+		if (copy_to_user(buf, &ev, size)) {
+			ret = -EFAULT;
+			goto out;
+		}
+		n = size;
+	}
+
+	// a console event posted from here on is queued anew
+	clear_bit(0, &eq->console_queued);
+	smp_mb__after_atomic();
+
+	// the only reader, so no lock against the vCPUs posting
+	ret = kfifo_to_user(&eq->fifo, buf + n, rounddown(count - n, size),
+			    &copied);
+	n += copied;
+out:
+	mutex_unlock(&eq->read_lock);
+	return n ? n : ret;
+}
+
+__poll_t poll_events(event_queue_t *eq, struct file *filp, poll_table *wait)
+{
+	poll_wait(filp, &eq->wq, wait);
+	return has_events(eq) ? EPOLLIN | EPOLLRDNORM : 0;
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <linux/kfifo.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <linux/wait.h>
+
+#include "tvisor.h"
+
+struct file;
+
+#define EVENT_QUEUE_SIZE 256 // records, a power of 2
+
+// What a VM has to tell its supervisor, read from the VM fd as struct
+// tvisor_event records.
+typedef struct _event_queue {
+	spinlock_t lock; // serializes the vCPUs posting, protects `lost`
+	DECLARE_KFIFO(fifo, struct tvisor_event, EVENT_QUEUE_SIZE);
+	u64 lost; // dropped while the queue was full
+	unsigned long console_queued; // bit 0: a CONSOLE event is unread
+	struct mutex read_lock; // one reader drains `fifo` at a time
+	wait_queue_head_t wq;
+} event_queue_t;
+
+void init_event_queue(event_queue_t *eq);
+void post_event(event_queue_t *eq, u32 type, u32 vcpu, u64 data);
+ssize_t read_events(event_queue_t *eq, char __user *buf, size_t count,
+		    int nonblock);
+__poll_t poll_events(event_queue_t *eq, struct file *filp, poll_table *wait);
@@ -0,0 +1,170 @@
+#include <asm/cpufeature.h> /* Needed for boot_cpu_has */
+#include <asm/fpu/api.h> /* Needed for kernel_fpu_begin */
+#include <asm/fpu/types.h> /* Needed for struct xregs_state, XFEATURE_MASK_* */
+#include <asm/fpu/xcr.h> /* Needed for xgetbv, xsetbv */
+#include <linux/gfp.h> /* Needed for __get_free_pages */
+#include <linux/printk.h> /* Needed for pr_info */
+
+#include "cpu.h"
+#include "fpu.h"
+#include "vm.h"
+#include "vmx.h"
+
+// The guest's x87/SSE/AVX state lives in the registers from load_guest_fpu()
+// to put_guest_fpu(), across as many exits as the kernel handles without
+// leaving run_vcpu()'s inner loop. In between we are inside a
+// kernel_fpu_begin() section: the user's FPU state was saved once on the way
+// in and gets restored on the way back to userspace, and interrupt handlers
+// see irq_fpu_usable() == false, so nothing else touches the registers.
+// The section also keeps bottom halves off, so run_vcpu() leaves the loop
+// whenever a softirq is pending and kernel_fpu_end() runs it.
+
+static int use_xsave;
+static int use_xsaveopt;
+static u64 host_xcr0;
+static u32 guest_fpu_size; // bytes of a standard-format XSAVE area
+
+void setup_guest_fpu_support(void)
+{
+	use_xsave = boot_cpu_has(X86_FEATURE_XSAVE) &&
+		    boot_cpu_has(X86_FEATURE_OSXSAVE);
+	use_xsaveopt = use_xsave && boot_cpu_has(X86_FEATURE_XSAVEOPT);
+
+	if (use_xsave) {
+		host_xcr0 = xgetbv(XCR_XFEATURE_ENABLED_MASK);
+		// size of the area for the features enabled in XCR0
+		guest_fpu_size = get_cpuid_count(0xd, 0).ebx;
+	} else {
+		host_xcr0 = XFEATURE_MASK_FPSSE;
+		guest_fpu_size = sizeof(struct fxregs_state);
+	}
+
+	pr_debug("tvisor: guest FPU: %s, XCR0[%llx], %u bytes\n",
+		 use_xsaveopt ? "xsaveopt" : use_xsave ? "xsave" : "fxsave",
+		 host_xcr0, guest_fpu_size);
+}
+
+int alloc_guest_fpu(vcpu_state_t *vcpu)
+{
+	// XSAVE needs 64 byte alignment, pages give us that
+	struct xregs_state *fpu = (struct xregs_state *)__get_free_pages(
+		GFP_KERNEL_ACCOUNT | __GFP_ZERO, get_order(guest_fpu_size));
+	if (fpu == NULL) {
+		return -ENOMEM;
+	}
+
+	// all components in their init state (XSTATE_BV == 0), except MXCSR
+	// which XRSTOR always loads: mask every SIMD exception like RESET does
+	fpu->i387.cwd = 0x37f;
+	fpu->i387.mxcsr = 0x1f80;
+
+	vcpu->guest_fpu = fpu;
+	vcpu->guest_xcr0 = XFEATURE_MASK_FP;
+	return 0;
+}
+
+void free_guest_fpu(vcpu_state_t *vcpu)
+{
+	if (vcpu->guest_fpu != NULL) {
+		free_pages((unsigned long)vcpu->guest_fpu,
+			   get_order(guest_fpu_size));
+	}
+}
+
+static void restore_fpu(struct xregs_state *fpu)
+{
+	u32 lo = (u32)host_xcr0;
+	u32 hi = (u32)(host_xcr0 >> 32);
+
+	if (use_xsave) {
+		asm volatile("xrstor64 %0" : : "m"(*fpu), "a"(lo), "d"(hi));
+	} else {
+		asm volatile("fxrstor64 %0" : : "m"(fpu->i387));
+	}
+}
+
+static void save_fpu(struct xregs_state *fpu)
+{
+	u32 lo = (u32)host_xcr0;
+	u32 hi = (u32)(host_xcr0 >> 32);
+
+	if (use_xsaveopt) {
+		// skips components unmodified since our XRSTOR
+		asm volatile("xsaveopt64 %0" : "+m"(*fpu) : "a"(lo), "d"(hi));
+	} else if (use_xsave) {
+		asm volatile("xsave64 %0" : "+m"(*fpu) : "a"(lo), "d"(hi));
+	} else {
+		asm volatile("fxsave64 %0" : "=m"(fpu->i387));
+	}
+}
+
+// Must be called with preemption off.
+void load_guest_fpu(vcpu_state_t *vcpu)
+{
+	kernel_fpu_begin();
+	restore_fpu(vcpu->guest_fpu);
+	vcpu->nr_guest_fpu_loads++;
+}
+
+void put_guest_fpu(vcpu_state_t *vcpu)
+{
+	save_fpu(vcpu->guest_fpu);
+	kernel_fpu_end();
+}
+
+// XCR0 has to be the guest's while it runs but the host's while we XSAVE,
+// so switch it right around the VM entry. Interrupts must be off.
+void load_guest_xcr0(vcpu_state_t *vcpu)
+{
+	if (use_xsave && vcpu->guest_xcr0 != host_xcr0) {
+		xsetbv(XCR_XFEATURE_ENABLED_MASK, vcpu->guest_xcr0);
+	}
+}
+
+void put_guest_xcr0(vcpu_state_t *vcpu)
+{
+	if (use_xsave && vcpu->guest_xcr0 != host_xcr0) {
+		xsetbv(XCR_XFEATURE_ENABLED_MASK, host_xcr0);
+	}
+}
+
+static int is_valid_xcr0(u64 xcr0)
+{
+	// anything the host has enabled, the x87 bit can never be cleared
+	if (!(xcr0 & XFEATURE_MASK_FP) || (xcr0 & ~host_xcr0)) {
+		return 0;
+	}
+	// AVX needs SSE
+	if ((xcr0 & XFEATURE_MASK_YMM) && !(xcr0 & XFEATURE_MASK_SSE)) {
+		return 0;
+	}
+	// MPX components go together
+	if (!(xcr0 & XFEATURE_MASK_BNDREGS) != !(xcr0 & XFEATURE_MASK_BNDCSR)) {
+		return 0;
+	}
+	// AVX-512 needs AVX and all three of its components
+	if (xcr0 & XFEATURE_MASK_AVX512) {
+		if ((xcr0 & XFEATURE_MASK_AVX512) != XFEATURE_MASK_AVX512 ||
+		    !(xcr0 & XFEATURE_MASK_YMM)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int handle_xsetbv(vcpu_state_t *vcpu)
+{
+	u32 index = (u32)vcpu->guest_regs.rcx;
+	u64 value = (vcpu->guest_regs.rdx << 32) | (u32)vcpu->guest_regs.rax;
+	u32 cpl = (vmcs_read32(GUEST_SS_AR_BYTES) >> 5) & 0x3;
+
+	if (!use_xsave || cpl != 0 || index != 0 || !is_valid_xcr0(value)) {
+		pr_debug("tvisor: invalid xsetbv[%u] %llx\n", index, value);
+		inject_gp(vcpu, 0);
+		return VMEXIT_RESUME;
+	}
+
+	vcpu->guest_xcr0 = value;
+	resume_to_next_instruction();
+	return VMEXIT_RESUME;
+}
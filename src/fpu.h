@@ -0,0 +1,14 @@
+#pragma once
+
+#include <linux/types.h>
+
+#include "vm.h"
+
+void setup_guest_fpu_support(void);
+int alloc_guest_fpu(vcpu_state_t *vcpu);
+void free_guest_fpu(vcpu_state_t *vcpu);
+void load_guest_fpu(vcpu_state_t *vcpu);
+void put_guest_fpu(vcpu_state_t *vcpu);
+void load_guest_xcr0(vcpu_state_t *vcpu);
+void put_guest_xcr0(vcpu_state_t *vcpu);
+int handle_xsetbv(vcpu_state_t *vcpu);
@@ -1,3 +1,6 @@
 #pragma once
 
-extern void vmexit_handler(void);
\ No newline at end of file
+#include "vm.h"
+
+extern void vmexit_handler(void);
+extern int vmx_run_guest(guest_regs_t *regs, int launched);
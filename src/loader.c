@@ -0,0 +1,164 @@
+#include <asm/pgtable_types.h> /* Needed for _PAGE_PRESENT */
+#include <linux/elf.h> /* Needed for Elf64_Ehdr */
+#include <linux/printk.h> /* Needed for pr_info */
+#include <linux/slab.h> /* Needed for kzalloc */
+#include <linux/string.h> /* Needed for memcmp */
+#include <linux/uaccess.h> /* Needed for copy_from_user */
+
+#include "loader.h"
+#include "mem.h"
+#include "vm.h"
+
+// Images are copied from the caller's buffer straight into the host pages
+// backing guest RAM, walking the EPT once per 2 MiB; see fill_guest_phys().
+
+#define LOADER_MAX_PHDRS 64
+
+static int load_flat(vm_state_t *vm, struct tvisor_load_image *args)
+{
+	return copy_to_guest_phys_user(vm, args->load_addr,
+				       u64_to_user_ptr(args->image),
+				       args->size);
+}
+
+static int load_elf64(vm_state_t *vm, struct tvisor_load_image *args)
+{
+	const u8 __user *image = u64_to_user_ptr(args->image);
+	Elf64_Ehdr ehdr;
+	int i, ret;
+
+	if (args->size < sizeof(ehdr) ||
+	    copy_from_user(&ehdr, image, sizeof(ehdr))) {
+		return -EINVAL;
+	}
+	if (memcmp(ehdr.e_ident, ELFMAG, SELFMAG) ||
+	    ehdr.e_ident[EI_CLASS] != ELFCLASS64 ||
+	    ehdr.e_ident[EI_DATA] != ELFDATA2LSB ||
+	    ehdr.e_machine != EM_X86_64 ||
+	    ehdr.e_phentsize != sizeof(Elf64_Phdr) ||
+	    ehdr.e_phnum == 0 || ehdr.e_phnum > LOADER_MAX_PHDRS ||
+	    ehdr.e_phoff > args->size ||
+	    ehdr.e_phnum * sizeof(Elf64_Phdr) > args->size - ehdr.e_phoff) {
+		return -ENOEXEC;
+	}
+
+	Elf64_Phdr *phdrs = kmalloc_array(ehdr.e_phnum, sizeof(Elf64_Phdr),
+					  GFP_KERNEL);
+	if (phdrs == NULL) {
+		return -ENOMEM;
+	}
+	if (copy_from_user(phdrs, image + ehdr.e_phoff,
+			   ehdr.e_phnum * sizeof(Elf64_Phdr))) {
+		ret = -EFAULT;
+		goto out;
+	}
+
+	for (i = 0; i < ehdr.e_phnum; i++) {
+		Elf64_Phdr *ph = &phdrs[i];
+		if (ph->p_type != PT_LOAD) {
+			continue;
+		}
+		if (ph->p_filesz > ph->p_memsz || ph->p_offset > args->size ||
+		    ph->p_filesz > args->size - ph->p_offset) {
+			ret = -ENOEXEC;
+			goto out;
+		}
+		ret = copy_to_guest_phys_user(vm, ph->p_paddr,
+					      image + ph->p_offset,
+					      ph->p_filesz);
+		if (ret == 0) {
+			ret = clear_guest_phys(vm, ph->p_paddr + ph->p_filesz,
+					       ph->p_memsz - ph->p_filesz);
+		}
+		if (ret) {
+			pr_info("tvisor: segment at %llx does not fit in guest RAM\n",
+				ph->p_paddr);
+			goto out;
+		}
+	}
+	args->entry = ehdr.e_entry;
+	ret = 0;
+out:
+	kfree(phdrs);
+	return ret;
+}
+
+// PML4, PDPT and one PD per GiB at `base`, identity-mapping the first
+// TVISOR_LOAD_PT_MAP_GIB GiB with 2 MiB pages
+int build_identity_page_tables(vm_state_t *vm, u64 base)
+{
+	const u64 flags = _PAGE_PRESENT | _PAGE_RW;
+	u64 *pt = kzalloc(TVISOR_LOAD_PT_PAGES * PAGE_SIZE, GFP_KERNEL);
+	int i, j;
+
+	if (pt == NULL) {
+		return -ENOMEM;
+	}
+
+	u64 *pml4 = pt;
+	u64 *pdpt = pt + 512;
+	pml4[0] = (base + PAGE_SIZE) | flags;
+	for (i = 0; i < TVISOR_LOAD_PT_MAP_GIB; i++) {
+		u64 *pd = pt + 512 * (2 + i);
+		pdpt[i] = (base + (2 + i) * PAGE_SIZE) | flags;
+		for (j = 0; j < 512; j++) {
+			pd[j] = (((u64)i << 30) + ((u64)j << 21)) | flags |
+				_PAGE_PSE;
+		}
+	}
+
+	int ret = write_guest_phys(vm, base, pt,
+				   TVISOR_LOAD_PT_PAGES * PAGE_SIZE);
+	kfree(pt);
+	return ret;
+}
+
+// Load `args` into `vm` and set vCPU 0 up to start at its entry. Only
+// before vCPU 0 first runs, its initial state comes from the VMCS setup.
+int load_guest_image(vm_state_t *vm, struct tvisor_load_image *args)
+{
+	vcpu_state_t *vcpu = vm->vcpus[0];
+	int ret;
+
+	if (READ_ONCE(vcpu->launched) || READ_ONCE(vcpu->task) != NULL) {
+		return -EBUSY;
+	}
+	if (args->page_tables & ~PAGE_MASK) {
+		return -EINVAL;
+	}
+
+	switch (args->format) {
+	case TVISOR_IMAGE_FLAT:
+		ret = load_flat(vm, args);
+		break;
+	case TVISOR_IMAGE_ELF64:
+		ret = load_elf64(vm, args);
+		break;
+	default:
+		return -EINVAL;
+	}
+	if (ret) {
+		return ret;
+	}
+
+	if (args->page_tables) {
+		ret = build_identity_page_tables(vm, args->page_tables);
+		if (ret) {
+			return ret;
+		}
+		vm->boot_cr3 = args->page_tables;
+	}
+
+	// picked up by complete_user_exit() on the first entry
+	struct tvisor_run *run = vcpu->run;
+	run->regs.rip = args->entry;
+	if (args->stack) {
+		run->regs.rsp = args->stack;
+	}
+	run->regs.rflags = X86_EFLAGS_FIXED;
+	run->regs_dirty = 1;
+
+	pr_info("tvisor: loaded %llu byte image, entry %llx\n", args->size,
+		args->entry);
+	return 0;
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include "tvisor.h"
+
+struct _vm_state;
+
+int build_identity_page_tables(struct _vm_state *vm, u64 base);
+int load_guest_image(struct _vm_state *vm, struct tvisor_load_image *args);
@@ -1,17 +1,36 @@
+#include <linux/anon_inodes.h> /* Needed for anon_inode_getfd */
 #include <linux/cdev.h> /* Needed by chardev */
 #include <linux/cpumask.h>/* Needed for on_each_cpu */
-#include <linux/device.h>
+#include <linux/device.h> /* Needed for device_create_with_groups, DEVICE_ATTR_RO */
 #include <linux/fs.h> /* Needed for alloc_chrdev_region */
 #include <linux/init.h> /* Needed for the macros */
 #include <linux/kernel.h> /* Needed for pr_info, snprintf */
+#include <linux/mm.h> /* Needed for vm_insert_page */
 #include <linux/module.h> /* Needed by all modules */
 #include <linux/smp.h> /* Needed for on_each_cpu */
-#include <linux/string.h> /* Needed for strncpy, etc */
+#include <linux/overflow.h> /* Needed for array_size */
+#include <linux/poll.h> /* Needed for poll_table */
+#include <linux/sizes.h> /* Needed for SZ_1M */
+#include <linux/slab.h> /* Needed for kmalloc, kfree */
+#include <linux/string.h> /* Needed for strncpy, memdup_user, etc */
 #include <linux/types.h> /* Needed for uint64_t, etc */
 #include <linux/uaccess.h> /* Needed for copy_from_user, copy_to_user */
 
+#include "bench.h"
+#include "blk.h"
 #include "cpu.h"
+#include "fpu.h"
+#include "loader.h"
+#include "mem.h"
+#include "pmu.h"
+#include "profile.h"
+#include "ring.h"
+#include "stats.h"
+#include "tsc.h"
+#include "tvisor.h"
+#include "uart.h"
 #include "vm.h"
+#include "vmx.h"
 
 MODULE_LICENSE("GPL v2");
 MODULE_AUTHOR("Totsugekitai");
@@ -19,12 +38,7 @@ MODULE_DESCRIPTION("Totsugekitai Hypervisor from scratch");
 
 #define SUCCESS 0
 #define DEVICE_NAME "tvisor"
-#define KBUF_SIZE 512
-
-enum {
-	CDEV_NOT_USED = 0,
-	CDEV_EXCLUSIVE_OPEN = 1,
-};
+#define DEFAULT_MEM_MIB 0x100 // genkai
 
 struct tvisor_state {
 	int is_virtualization_ready;
@@ -33,33 +47,57 @@ struct tvisor_state {
 
 static int major;
 static struct class *cls;
-static atomic_t already_open = ATOMIC_INIT(CDEV_NOT_USED);
+static vmxon_region_t *vmxon_region; // VMX is on for the host, not per VM
 struct tvisor_state TVISOR_STATE = {
 	.is_virtualization_ready = 0,
 	.is_vmx_enabled = 0,
 };
 
-vm_state_t *VM = NULL;
-
 static int tvisor_open(struct inode *, struct file *);
 static int tvisor_release(struct inode *, struct file *);
-static ssize_t tvisor_read(struct file *, char __user *, size_t, loff_t *);
-static ssize_t tvisor_write(struct file *, const char __user *, size_t,
-			    loff_t *);
+static long tvisor_ioctl(struct file *, unsigned int, unsigned long);
 
+// /dev/tvisor only creates VMs and switches VMX, see tvisor.h
 static struct file_operations tvisor_fops = {
 	.open = tvisor_open,
 	.release = tvisor_release,
-	.read = tvisor_read,
-	.write = tvisor_write,
+	.unlocked_ioctl = tvisor_ioctl,
+};
+
+static int tvisor_vm_release(struct inode *, struct file *);
+static ssize_t tvisor_vm_read(struct file *, char __user *, size_t,
+			      loff_t *);
+static __poll_t tvisor_vm_poll(struct file *, poll_table *);
+static long tvisor_vm_ioctl(struct file *, unsigned int, unsigned long);
+static int tvisor_vm_mmap(struct file *, struct vm_area_struct *);
+
+// fds from TVISOR_CREATE_VM, private_data is the VM
+static struct file_operations tvisor_vm_fops = {
+	.owner = THIS_MODULE,
+	.release = tvisor_vm_release,
+	.read = tvisor_vm_read,
+	.poll = tvisor_vm_poll,
+	.unlocked_ioctl = tvisor_vm_ioctl,
+	.mmap = tvisor_vm_mmap,
+	.llseek = noop_llseek,
+};
+
+static int tvisor_console_release(struct inode *, struct file *);
+static ssize_t tvisor_console_read(struct file *, char __user *, size_t,
+				   loff_t *);
+static __poll_t tvisor_console_poll(struct file *, poll_table *);
+
+// fds from TVISOR_GET_CONSOLE_FD, private_data is the VM
+static struct file_operations tvisor_console_fops = {
+	.owner = THIS_MODULE,
+	.release = tvisor_console_release,
+	.read = tvisor_console_read,
+	.poll = tvisor_console_poll,
+	.llseek = noop_llseek,
 };
 
 static int tvisor_open(struct inode *inode, struct file *file)
 {
-	if (atomic_cmpxchg(&already_open, CDEV_NOT_USED, CDEV_EXCLUSIVE_OPEN)) {
-		return -EBUSY;
-	}
-
 	pr_info("tvisor: open\n");
 	try_module_get(THIS_MODULE);
 
@@ -68,8 +106,6 @@ static int tvisor_open(struct inode *inode, struct file *file)
 
 static int tvisor_release(struct inode *inode, struct file *file)
 {
-	atomic_set(&already_open, CDEV_NOT_USED);
-
 	module_put(THIS_MODULE);
 
 	pr_info("tvisor: release\n");
@@ -77,119 +113,704 @@ static int tvisor_release(struct inode *inode, struct file *file)
 	return SUCCESS;
 }
 
-static ssize_t tvisor_read(struct file *filp, char __user *ubuf, size_t count,
-			   loff_t *offset)
+static int tvisor_vm_release(struct inode *inode, struct file *file)
+{
+	put_vm(file->private_data);
+	return SUCCESS;
+}
+
+// struct tvisor_event records, see read_events()
+static ssize_t tvisor_vm_read(struct file *filp, char __user *ubuf,
+			      size_t count, loff_t *offset)
+{
+	vm_state_t *vm = filp->private_data;
+	return read_events(&vm->events, ubuf, count,
+			   filp->f_flags & O_NONBLOCK);
+}
+
+static __poll_t tvisor_vm_poll(struct file *filp, poll_table *wait)
+{
+	vm_state_t *vm = filp->private_data;
+	return poll_events(&vm->events, filp, wait);
+}
+
+static int tvisor_console_release(struct inode *inode, struct file *file)
+{
+	put_vm(file->private_data);
+	return SUCCESS;
+}
+
+// Guest console output, see read_uart(). The status that used to be read
+// from /dev/tvisor is in /sys/class/tvisor/tvisor/status.
+static ssize_t tvisor_console_read(struct file *filp, char __user *ubuf,
+				   size_t count, loff_t *offset)
+{
+	vm_state_t *vm = filp->private_data;
+	return read_uart(&vm->uart, ubuf, count, filp->f_flags & O_NONBLOCK);
+}
+
+static __poll_t tvisor_console_poll(struct file *filp, poll_table *wait)
+{
+	vm_state_t *vm = filp->private_data;
+	return poll_uart(&vm->uart, filp, wait);
+}
+
+// `vm_list_lock` held. One page holds a handful of VMs; per-vCPU detail is
+// in debugfs, see stats.c.
+static int vm_status_show(vm_state_t *vm, char *buf, int nchar)
+{
+	nchar += sysfs_emit_at(buf, nchar, "vm%d: vcpus: %d\n", vm->id,
+			       smp_load_acquire(&vm->nr_vcpus));
+	ring_stats_t rs;
+	u32 ring_poll_ns;
+	if (get_ring_stats(vm, &rs, &ring_poll_ns) == 0) {
+		nchar += sysfs_emit_at(
+			buf, nchar,
+			"ring: requests: %lld in %lld batches, sleeps: %lld, kicks: %lld, poll ns: %u\n",
+			rs.requests, rs.batches, rs.sleeps, rs.kicks,
+			ring_poll_ns);
+	}
+	blk_stats_t bs;
+	if (get_blk_stats(vm, &bs) == 0) {
+		u64 done = bs.reads + bs.writes + bs.flushes;
+		nchar += sysfs_emit_at(
+			buf, nchar,
+			"blk: reads: %lld, writes: %lld, flushes: %lld, errors: %lld, "
+			"host requests: %lld, bytes: %lld, latency ns: avg %lld max %lld\n",
+			bs.reads, bs.writes, bs.flushes, bs.errors,
+			bs.submissions, bs.bytes,
+			done ? bs.latency_ns / done : 0, bs.max_latency_ns);
+	}
+	coalesced_stats_t *cs = &vm->coalesced.stats;
+	nchar += sysfs_emit_at(buf, nchar,
+			       "coalesced: entries: %lld, ring full: %lld\n",
+			       cs->entries, cs->full);
+	uart_stats_t us;
+	get_uart_stats(&vm->uart, &us);
+	nchar += sysfs_emit_at(
+		buf, nchar, "uart: bytes: %lld, dropped: %lld, outsb exits: %lld\n",
+		us.tx_bytes, us.dropped, us.string_exits);
+
+	return nchar;
+}
+
+static ssize_t status_show(struct device *dev, struct device_attribute *attr,
+			   char *buf)
 {
-	char kbuf[KBUF_SIZE] = { '\0' };
-	size_t len;
 	int nchar;
 
-	nchar = snprintf(
-		kbuf, KBUF_SIZE,
+	nchar = sysfs_emit(
+		buf,
 		"tvisor: virtualization ready: %d\nVMX is enabled: %d\n",
 		TVISOR_STATE.is_virtualization_ready,
 		TVISOR_STATE.is_vmx_enabled);
-	if (nchar >= KBUF_SIZE) {
-		pr_alert("tvisor: snprintf truncated!!!\n");
+
+	vm_state_t *vm;
+	mutex_lock(&vm_list_lock);
+	list_for_each_entry(vm, &vm_list, list) {
+		// sysfs_emit_at() stops one short of PAGE_SIZE
+		if (nchar >= PAGE_SIZE - 1) {
+			break;
+		}
+		nchar = vm_status_show(vm, buf, nchar);
+	}
+	mutex_unlock(&vm_list_lock);
+
+	return nchar;
+}
+static DEVICE_ATTR_RO(status);
+
+static long tvisor_ioctl_cpuid(vm_state_t *vm, unsigned int cmd,
+			       struct tvisor_cpuid __user *ucpuid)
+{
+	struct tvisor_cpuid header;
+	if (copy_from_user(&header, ucpuid, sizeof(header))) {
+		return -EFAULT;
+	}
+	if (header.nent > TVISOR_MAX_CPUID_ENTRIES) {
+		if (cmd == TVISOR_SET_CPUID) {
+			return -E2BIG;
+		}
+		header.nent = TVISOR_MAX_CPUID_ENTRIES;
 	}
 
-	len = strlen(kbuf);
-	if ((count - *offset) + len <= count) {
+	size_t size = array_size(header.nent, sizeof(struct tvisor_cpuid_entry));
+	long ret;
+
+	if (cmd == TVISOR_SET_CPUID) {
+		struct tvisor_cpuid_entry *entries =
+			memdup_user(ucpuid->entries, size);
+		if (IS_ERR(entries)) {
+			return PTR_ERR(entries);
+		}
+		ret = set_cpuid_entries(vm, entries, header.nent);
+		kfree(entries);
+		return ret;
+	}
+
+	struct tvisor_cpuid_entry *entries = kmalloc(size, GFP_KERNEL);
+	if (entries == NULL && size != 0) {
+		return -ENOMEM;
+	}
+	int n = get_cpuid_entries(vm, entries, header.nent);
+	if (put_user((u32)n, &ucpuid->nent)) {
+		ret = -EFAULT;
+	} else if ((u32)n > header.nent) {
+		ret = -E2BIG; // nent now tells userspace how many it needs
+	} else if (copy_to_user(ucpuid->entries, entries,
+				n * sizeof(struct tvisor_cpuid_entry))) {
+		ret = -EFAULT;
+	} else {
+		ret = 0;
+	}
+	kfree(entries);
+	return ret;
+}
+
+static vcpu_state_t *find_vcpu(vm_state_t *vm, u64 id)
+{
+	if (id >= (u64)smp_load_acquire(&vm->nr_vcpus)) {
+		return NULL;
+	}
+	return vm->vcpus[id];
+}
+
+static long tvisor_ioctl_regs(vm_state_t *vm, unsigned int cmd,
+			      struct tvisor_vcpu_regs __user *uregs)
+{
+	struct tvisor_vcpu_regs r;
+	if (copy_from_user(&r, uregs, sizeof(r))) {
+		return -EFAULT;
+	}
+	vcpu_state_t *vcpu = find_vcpu(vm, r.vcpu);
+	if (vcpu == NULL) {
+		return -EINVAL;
+	}
+	if (READ_ONCE(vcpu->task) != NULL) {
+		return -EBUSY;
+	}
+
+	// the run page holds them between runs, see complete_user_exit()
+	if (cmd == TVISOR_SET_REGS) {
+		vcpu->run->regs = r.regs;
+		vcpu->run->regs_dirty = 1;
 		return 0;
 	}
+	r.regs = vcpu->run->regs;
+	return copy_to_user(uregs, &r, sizeof(r)) ? -EFAULT : 0;
+}
+
+static long tvisor_ioctl_write_mem(vm_state_t *vm,
+				   struct tvisor_mem_region __user *uregion)
+{
+	struct tvisor_mem_region region;
+	if (copy_from_user(&region, uregion, sizeof(region))) {
+		return -EFAULT;
+	}
+	if (region.flags & ~TVISOR_MEM_ZERO) {
+		return -EINVAL;
+	}
+	if (region.flags & TVISOR_MEM_ZERO) {
+		return clear_guest_phys(vm, region.guest_phys, region.size);
+	}
+	return copy_to_guest_phys_user(vm, region.guest_phys,
+				       u64_to_user_ptr(region.addr),
+				       region.size);
+}
+
+static long tvisor_ioctl_bench(vm_state_t *vm,
+			       struct tvisor_vmcs_bench __user *ubench)
+{
+	struct tvisor_vmcs_bench args;
+	if (!TVISOR_STATE.is_vmx_enabled) {
+		return -ENODEV;
+	}
+	if (copy_from_user(&args, ubench, sizeof(args))) {
+		return -EFAULT;
+	}
+	vcpu_state_t *vcpu = find_vcpu(vm, args.vcpu);
+	if (vcpu == NULL) {
+		return -EINVAL;
+	}
+
+	vmcs_access_bench_t b = {
+		.iterations = args.iterations ?: 100000,
+	};
+	int ret = bench_vmcs_access(vcpu, &b);
+	if (ret) {
+		return ret;
+	}
+	args.read_cycles = b.read_cycles;
+	args.write_cycles = b.write_cycles;
+	args.checked_read_cycles = b.checked_read_cycles;
+	return copy_to_user(ubench, &args, sizeof(args)) ? -EFAULT : 0;
+}
+
+static long vm_ioctl(vm_state_t *vm, unsigned int cmd, unsigned long arg);
+
+static long tvisor_ioctl_batch(vm_state_t *vm,
+			       struct tvisor_batch __user *ubatch)
+{
+	struct tvisor_batch batch;
+	u32 i;
 
-	if (copy_to_user(ubuf, kbuf, len)) {
+	if (copy_from_user(&batch, ubatch, sizeof(batch))) {
 		return -EFAULT;
 	}
+	if (batch.nr > TVISOR_BATCH_MAX ||
+	    batch.flags & ~TVISOR_BATCH_CONTINUE) {
+		return -EINVAL;
+	}
 
-	pr_info("tvisor: read[%s]\n", kbuf);
+	struct tvisor_batch_op __user *uops = u64_to_user_ptr(batch.ops);
+	struct tvisor_batch_op *ops =
+		memdup_user(uops, array_size(batch.nr, sizeof(*ops)));
+	if (IS_ERR(ops)) {
+		return PTR_ERR(ops);
+	}
 
-	*offset += len;
+	for (i = 0; i < batch.nr;) {
+		struct tvisor_batch_op *op = &ops[i++];
+		if (op->cmd == TVISOR_RUN || op->cmd == TVISOR_BATCH ||
+		    op->cmd == TVISOR_BENCH_EXITS ||
+		    op->cmd == TVISOR_BENCH_BLK) {
+			op->result = -EINVAL;
+		} else {
+			op->result = vm_ioctl(vm, op->cmd, op->arg);
+		}
+		if (op->result < 0 && !(batch.flags & TVISOR_BATCH_CONTINUE)) {
+			break;
+		}
+	}
 
-	return len;
+	long ret = i;
+	if (copy_to_user(uops, ops, i * sizeof(*ops))) {
+		ret = -EFAULT;
+	}
+	kfree(ops);
+	return ret;
 }
 
-static ssize_t tvisor_write(struct file *filp, const char __user *ubuf,
-			    size_t count, loff_t *offset)
+// ioctls on one VM, see tvisor.h
+static long vm_ioctl(vm_state_t *vm, unsigned int cmd, unsigned long arg)
 {
-	const char *enable = "enable";
-	const char *disable = "disable";
-	const char *create = "create";
-	const char *destroy = "destroy";
-	const char *launch = "launch";
+	vcpu_state_t *vcpu;
+	long ret;
+
+	switch (cmd) {
+	case TVISOR_RUN:
+		if (!TVISOR_STATE.is_vmx_enabled) {
+			return -ENODEV;
+		}
+		vcpu = find_vcpu(vm, arg);
+		if (vcpu == NULL) {
+			return -EINVAL;
+		}
+		return run_vcpu(vcpu);
+	case TVISOR_CREATE_VCPU: {
+		mutex_lock(&vm->lock);
+		vcpu = create_vcpu(vm);
+		mutex_unlock(&vm->lock);
+		return vcpu != NULL ? vcpu->id : -ENOSPC;
+	}
+	case TVISOR_SET_CPUID:
+	case TVISOR_GET_CPUID:
+		return tvisor_ioctl_cpuid(vm, cmd,
+					  (struct tvisor_cpuid __user *)arg);
+	case TVISOR_SET_TSC_KHZ:
+		if (arg > U32_MAX) {
+			return -EINVAL;
+		}
+		return set_vm_tsc_khz(vm, (u32)arg);
+	case TVISOR_GET_TSC_KHZ:
+		return vm->tsc_khz;
+	case TVISOR_GET_TSC:
+		return put_user(read_guest_tsc(vm), (u64 __user *)arg);
+	case TVISOR_SET_TSC: {
+		u64 tsc;
+		if (get_user(tsc, (u64 __user *)arg)) {
+			return -EFAULT;
+		}
+		write_guest_tsc(vm, tsc);
+		return 0;
+	}
+	case TVISOR_SET_BLK_FILE:
+		if (arg > INT_MAX) {
+			return -EINVAL;
+		}
+		return set_blk_file(vm, (int)arg);
+	case TVISOR_REGISTER_COALESCED: {
+		struct tvisor_coalesced_zone zone;
+		if (copy_from_user(&zone, (void __user *)arg, sizeof(zone))) {
+			return -EFAULT;
+		}
+		return register_coalesced_zone(vm, &zone);
+	}
+	case TVISOR_LOAD_IMAGE: {
+		struct tvisor_load_image image;
+		if (copy_from_user(&image, (void __user *)arg, sizeof(image))) {
+			return -EFAULT;
+		}
+		mutex_lock(&vm->lock);
+		ret = load_guest_image(vm, &image);
+		mutex_unlock(&vm->lock);
+		if (ret) {
+			return ret;
+		}
+		if (copy_to_user((void __user *)arg, &image, sizeof(image))) {
+			return -EFAULT;
+		}
+		return 0;
+	}
+	case TVISOR_GET_REGS:
+	case TVISOR_SET_REGS:
+		return tvisor_ioctl_regs(vm, cmd,
+					 (struct tvisor_vcpu_regs __user *)arg);
+	case TVISOR_WRITE_MEM:
+		return tvisor_ioctl_write_mem(
+			vm, (struct tvisor_mem_region __user *)arg);
+	case TVISOR_KICK:
+		vcpu = find_vcpu(vm, arg);
+		if (vcpu == NULL) {
+			return -EINVAL;
+		}
+		kick_vcpu(vcpu);
+		return 0;
+	case TVISOR_BENCH_VMCS:
+		return tvisor_ioctl_bench(vm,
+					  (struct tvisor_vmcs_bench __user *)arg);
+	case TVISOR_GET_CONSOLE_FD:
+		get_vm(vm);
+		ret = anon_inode_getfd("tvisor-console", &tvisor_console_fops,
+				       vm, O_RDONLY | O_CLOEXEC);
+		if (ret < 0) {
+			put_vm(vm);
+		}
+		return ret;
+	case TVISOR_GET_STATS_FD:
+		return create_stats_fd(vm);
+	case TVISOR_SET_PROFILE: {
+		struct tvisor_profile profile;
+		if (copy_from_user(&profile, (void __user *)arg,
+				   sizeof(profile))) {
+			return -EFAULT;
+		}
+		return set_profile(vm, &profile);
+	}
+	case TVISOR_GET_PROFILE_FD:
+		return create_profile_fd(vm);
+	case TVISOR_BENCH_EXITS: {
+		struct tvisor_exit_bench bench;
+		if (!TVISOR_STATE.is_vmx_enabled) {
+			return -ENODEV;
+		}
+		if (copy_from_user(&bench, (void __user *)arg, sizeof(bench))) {
+			return -EFAULT;
+		}
+		ret = run_exit_bench(vm, &bench);
+		if (ret) {
+			return ret;
+		}
+		if (copy_to_user((void __user *)arg, &bench, sizeof(bench))) {
+			return -EFAULT;
+		}
+		return 0;
+	}
+	case TVISOR_BENCH_BLK: {
+		struct tvisor_blk_bench bench;
+		if (!TVISOR_STATE.is_vmx_enabled) {
+			return -ENODEV;
+		}
+		if (copy_from_user(&bench, (void __user *)arg, sizeof(bench))) {
+			return -EFAULT;
+		}
+		ret = run_blk_bench(vm, &bench);
+		if (ret) {
+			return ret;
+		}
+		if (copy_to_user((void __user *)arg, &bench, sizeof(bench))) {
+			return -EFAULT;
+		}
+		return 0;
+	}
+	case TVISOR_BATCH:
+		return tvisor_ioctl_batch(vm, (struct tvisor_batch __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
 
-	char kbuf[KBUF_SIZE] = { '\0' };
+static long create_vm_fd(struct tvisor_vm_config __user *uconfig)
+{
+	struct tvisor_vm_config config;
+	int i;
 
-	if (copy_from_user(kbuf, ubuf, count)) {
+	if (copy_from_user(&config, uconfig, sizeof(config))) {
 		return -EFAULT;
 	}
-	pr_info("tvisor: write[%s]\n", kbuf);
+	if (config.flags || config.mem_size % SZ_1M ||
+	    config.nr_vcpus > TVISOR_MAX_VCPUS) {
+		return -EINVAL;
+	}
 
-	if (!strncmp(kbuf, enable, strlen(enable))) {
-		if (VM == NULL) {
-			pr_info("tvisor: please create VM\n");
-		} else {
-			int err = enable_vmx_on_each_cpu_mask(0,
-							      VM->vmxon_region);
-			if (err) {
-				pr_alert("tvisor: failed to enable VMX[%d]\n",
-					 err);
-			} else {
-				TVISOR_STATE.is_vmx_enabled = 1;
-				pr_info("tvisor: enable VMX!\n");
-			}
-		}
-	} else if (!strncmp(kbuf, disable, strlen(disable))) {
-		if (TVISOR_STATE.is_vmx_enabled) {
-			int err = disable_vmx_on_each_cpu_mask(0);
-			if (err) {
-				pr_alert("tvisor: failed to disable VMX\n");
-			} else {
-				TVISOR_STATE.is_vmx_enabled = 0;
-				pr_info("tvisor: disable VMX!\n");
-			}
-		} else {
-			pr_info("tvisor: vmx is not enabled now\n");
+	vm_state_t *vm = create_vm(config.mem_size ? config.mem_size / SZ_1M :
+						     DEFAULT_MEM_MIB);
+	if (vm == NULL) {
+		pr_alert("tvisor: failed to create_vm\n");
+		return -ENOMEM;
+	}
+	for (i = 1; i < config.nr_vcpus; i++) {
+		if (create_vcpu(vm) == NULL) {
+			put_vm(vm);
+			return -ENOMEM;
 		}
-	} else if (!strncmp(kbuf, create, strlen(create))) {
-		VM = create_vm();
-		if (VM == NULL) {
-			pr_alert("tvisor: failed to create_vm\n");
-		} else {
-			pr_info("tvisor: create VM\n");
-		}
-	} else if (!strncmp(kbuf, destroy, strlen(destroy))) {
-		destroy_vm(VM);
-		pr_info("tvisor: destroy VM\n");
-	} else if (!strncmp(kbuf, launch, strlen(launch))) {
-		if (TVISOR_STATE.is_vmx_enabled) {
-			if (VM == NULL) {
-				pr_alert("tvisor: failed to create_vm\n");
-			} else {
-				launch_vm(0, VM); // Launch VM on CPU 0
-			}
-		} else {
-			pr_info("tvisor: VMX is not enabled\n");
+	}
+
+	int fd = anon_inode_getfd("tvisor-vm", &tvisor_vm_fops, vm,
+				  O_RDWR | O_CLOEXEC);
+	if (fd < 0) {
+		put_vm(vm);
+		return fd;
+	}
+	pr_info("tvisor: create VM%d\n", vm->id);
+	return fd;
+}
+
+static DEFINE_MUTEX(vmx_lock); // protects TVISOR_STATE.is_vmx_enabled
+
+static long set_vmx(int enable)
+{
+	int err = 0;
+
+	mutex_lock(&vmx_lock);
+	if (enable == TVISOR_STATE.is_vmx_enabled) {
+		goto out;
+	}
+	if (enable) {
+		err = enable_vmx_on_each_cpu_mask(0, vmxon_region);
+	} else {
+		// Not while any VM exists: its vCPUs may be running, or have
+		// a VMCS the CPU still caches; release_vm() VMCLEARs them
+		// before the VM leaves the list. So TVISOR_RUN, which holds a
+		// VM reference, never sees VMX go away under it.
+		mutex_lock(&vm_list_lock);
+		if (!list_empty(&vm_list)) {
+			mutex_unlock(&vm_list_lock);
+			err = -EBUSY;
+			goto out;
 		}
+		err = disable_vmx_on_each_cpu_mask(0);
+		mutex_unlock(&vm_list_lock);
+	}
+	if (err) {
+		pr_alert("tvisor: failed to %s VMX[%d]\n",
+			 enable ? "enable" : "disable", err);
+	} else {
+		TVISOR_STATE.is_vmx_enabled = enable;
+		pr_info("tvisor: %s VMX!\n", enable ? "enable" : "disable");
 	}
+out:
+	mutex_unlock(&vmx_lock);
+	return err;
+}
 
-	return count;
+static long tvisor_ioctl(struct file *filp, unsigned int cmd,
+			 unsigned long arg)
+{
+	switch (cmd) {
+	case TVISOR_GET_API_VERSION:
+		return TVISOR_API_VERSION;
+	case TVISOR_ENABLE_VMX:
+		return set_vmx(1);
+	case TVISOR_DISABLE_VMX:
+		return set_vmx(0);
+	case TVISOR_CREATE_VM:
+		return create_vm_fd((struct tvisor_vm_config __user *)arg);
+	default:
+		return -ENOTTY;
+	}
+}
+
+static long tvisor_vm_ioctl(struct file *filp, unsigned int cmd,
+			    unsigned long arg)
+{
+	return vm_ioctl(filp->private_data, cmd, arg);
+}
+
+// map the run page of vCPU `vm_pgoff`, or the coalesced ring
+static int tvisor_vm_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	vm_state_t *vm = filp->private_data;
+
+	if (vma->vm_end - vma->vm_start != TVISOR_RUN_MMAP_SIZE) {
+		return -EINVAL;
+	}
+
+	if (vma->vm_pgoff ==
+	    TVISOR_COALESCED_MMAP_OFFSET / TVISOR_RUN_MMAP_SIZE) {
+		return vm_insert_page(vma, vma->vm_start,
+				      virt_to_page(vm->coalesced.ring));
+	}
+	vcpu_state_t *vcpu = find_vcpu(vm, vma->vm_pgoff);
+	if (vcpu == NULL) {
+		return -EINVAL;
+	}
+	return vm_insert_page(vma, vma->vm_start, virt_to_page(vcpu->run));
+}
+
+// read-only view of VMX_CAP under /sys/class/tvisor/tvisor/caps/
+#define TVISOR_CAP_ATTR(_name, _field)                                      \
+	static ssize_t _name##_show(struct device *dev,                     \
+				    struct device_attribute *attr, char *buf) \
+	{                                                                   \
+		return sysfs_emit(buf, "0x%llx\n", (u64)VMX_CAP._field);    \
+	}                                                                   \
+	static DEVICE_ATTR_RO(_name)
+
+TVISOR_CAP_ATTR(basic, basic);
+TVISOR_CAP_ATTR(pinbased_ctls, pinbased_ctls);
+TVISOR_CAP_ATTR(procbased_ctls, procbased_ctls);
+TVISOR_CAP_ATTR(procbased_ctls2, procbased_ctls2);
+TVISOR_CAP_ATTR(exit_ctls, exit_ctls);
+TVISOR_CAP_ATTR(entry_ctls, entry_ctls);
+TVISOR_CAP_ATTR(true_pinbased_ctls, true_pinbased_ctls);
+TVISOR_CAP_ATTR(true_procbased_ctls, true_procbased_ctls);
+TVISOR_CAP_ATTR(true_exit_ctls, true_exit_ctls);
+TVISOR_CAP_ATTR(true_entry_ctls, true_entry_ctls);
+TVISOR_CAP_ATTR(misc, misc);
+TVISOR_CAP_ATTR(cr0_fixed0, cr0_fixed0);
+TVISOR_CAP_ATTR(cr0_fixed1, cr0_fixed1);
+TVISOR_CAP_ATTR(cr4_fixed0, cr4_fixed0);
+TVISOR_CAP_ATTR(cr4_fixed1, cr4_fixed1);
+TVISOR_CAP_ATTR(vmcs_enum, vmcs_enum);
+TVISOR_CAP_ATTR(ept_vpid_cap, ept_vpid_cap);
+TVISOR_CAP_ATTR(vmfunc, vmfunc);
+
+static ssize_t max_phys_addr_bits_show(struct device *dev,
+				       struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", VMX_CAP.max_phys_addr_bits);
+}
+static DEVICE_ATTR_RO(max_phys_addr_bits);
+
+static ssize_t features_show(struct device *dev, struct device_attribute *attr,
+			     char *buf)
+{
+	int len = 0;
+	if (VMX_CAP.vmx_supported) {
+		len += sysfs_emit_at(buf, len, "vmx ");
+	}
+	if (VMX_CAP.vmxon_allowed) {
+		len += sysfs_emit_at(buf, len, "vmxon ");
+	}
+	if (vmx_has_ept_2mb_pages()) {
+		len += sysfs_emit_at(buf, len, "ept_2mb ");
+	}
+	if (vmx_has_ept_1gb_pages()) {
+		len += sysfs_emit_at(buf, len, "ept_1gb ");
+	}
+	if (vmx_has_vpid()) {
+		len += sysfs_emit_at(buf, len, "vpid ");
+	}
+	if (vmx_has_pml()) {
+		len += sysfs_emit_at(buf, len, "pml ");
+	}
+	if (vmx_has_preemption_timer()) {
+		len += sysfs_emit_at(buf, len, "preemption_timer ");
+	}
+	if (vmx_has_ple()) {
+		len += sysfs_emit_at(buf, len, "ple ");
+	}
+	if (vmx_has_vmfunc()) {
+		len += sysfs_emit_at(buf, len, "vmfunc ");
+	}
+	len += sysfs_emit_at(buf, len, "\n");
+	return len;
 }
+static DEVICE_ATTR_RO(features);
+
+static struct attribute *tvisor_cap_attrs[] = {
+	&dev_attr_basic.attr,
+	&dev_attr_pinbased_ctls.attr,
+	&dev_attr_procbased_ctls.attr,
+	&dev_attr_procbased_ctls2.attr,
+	&dev_attr_exit_ctls.attr,
+	&dev_attr_entry_ctls.attr,
+	&dev_attr_true_pinbased_ctls.attr,
+	&dev_attr_true_procbased_ctls.attr,
+	&dev_attr_true_exit_ctls.attr,
+	&dev_attr_true_entry_ctls.attr,
+	&dev_attr_misc.attr,
+	&dev_attr_cr0_fixed0.attr,
+	&dev_attr_cr0_fixed1.attr,
+	&dev_attr_cr4_fixed0.attr,
+	&dev_attr_cr4_fixed1.attr,
+	&dev_attr_vmcs_enum.attr,
+	&dev_attr_ept_vpid_cap.attr,
+	&dev_attr_vmfunc.attr,
+	&dev_attr_max_phys_addr_bits.attr,
+	&dev_attr_features.attr,
+	NULL,
+};
+
+static const struct attribute_group tvisor_cap_group = {
+	.name = "caps",
+	.attrs = tvisor_cap_attrs,
+};
+
+static struct attribute *tvisor_attrs[] = {
+	&dev_attr_status.attr,
+	NULL,
+};
+
+static const struct attribute_group tvisor_group = {
+	.attrs = tvisor_attrs,
+};
+
+static const struct attribute_group *tvisor_groups[] = {
+	&tvisor_group,
+	&tvisor_cap_group,
+	NULL,
+};
 
 static int __init init_tvisor(void)
 {
 	pr_info("tvisor: hello!\n");
 
+	read_vmx_capability(&VMX_CAP);
+	if (!VMX_CAP.vmx_supported) {
+		pr_alert("tvisor: VMX is not supported on this CPU\n");
+		return -ENODEV;
+	}
+	if (!VMX_CAP.vmxon_allowed) {
+		pr_alert("tvisor: VMXON is disabled by IA32_FEATURE_CONTROL\n");
+		return -ENODEV;
+	}
+	setup_guest_fpu_support();
+	setup_guest_pmu_support();
+
+	init_tvisor_stats();
+
+	vmxon_region = alloc_vmxon_region();
+	if (vmxon_region == NULL) {
+		pr_alert("tvisor: failed to alloc vmxon_region\n");
+		exit_tvisor_stats();
+		return -ENOMEM;
+	}
+
 	major = register_chrdev(0, DEVICE_NAME, &tvisor_fops);
 	if (major < 0) {
 		pr_alert("Registering character device failed[%d]\n", major);
+		free_vmxon_region(vmxon_region);
+		exit_tvisor_stats();
 		return major;
 	}
 
 	pr_debug("tvisor: assigned major number[%d]\n", major);
 
 	cls = class_create(THIS_MODULE, DEVICE_NAME);
-	device_create(cls, NULL, MKDEV(major, 0), NULL, DEVICE_NAME);
+	device_create_with_groups(cls, NULL, MKDEV(major, 0), NULL,
+				  tvisor_groups, DEVICE_NAME);
 
 	pr_debug("tvisor: Device created on /dev/%s\n", DEVICE_NAME);
 
@@ -198,22 +819,15 @@ static int __init init_tvisor(void)
 
 static void __exit exit_tvisor(void)
 {
-	if (TVISOR_STATE.is_vmx_enabled) {
-		int err = disable_vmx_on_each_cpu_mask(0);
-		if (err) {
-			pr_alert("tvisor: failed to disable VMX\n");
-		} else {
-			pr_info("tvisor: disable VMX!\n");
-		}
-	}
-	if (VM != NULL) {
-		destroy_vm(VM);
-	}
+	set_vmx(0);
+	// every VM holds a module reference through its fd, none are left
+	free_vmxon_region(vmxon_region);
 
 	device_destroy(cls, MKDEV(major, 0));
 	class_destroy(cls);
 
 	unregister_chrdev(major, DEVICE_NAME);
+	exit_tvisor_stats();
 
 	pr_info("tvisor: bye!\n");
 }
@@ -0,0 +1,139 @@
+#include <asm/pgtable_types.h> /* Needed for _PAGE_PRESENT, _PAGE_PSE */
+#include <linux/minmax.h> /* Needed for min_t */
+#include <linux/mm.h> /* Needed for page_address */
+#include <linux/sched.h> /* Needed for cond_resched */
+#include <linux/string.h> /* Needed for memcpy */
+#include <linux/uaccess.h> /* Needed for copy_from_user */
+
+#include "ept.h"
+#include "mem.h"
+#include "vm.h"
+#include "vmx.h"
+
+// Access to guest memory. Only copies from userspace sleep, everything else
+// works with interrupts off in the exit handlers.
+
+// bits 51:12 of CR3 and of paging structure entries
+#define GUEST_PADDR_MASK 0x000ffffffffff000ull
+
+int read_guest_phys(vm_state_t *vm, u64 gphys, void *buf, size_t len)
+{
+	while (len) {
+		size_t off = offset_in_page(gphys);
+		size_t chunk = min_t(size_t, len, PAGE_SIZE - off);
+		struct page *page = gphys_to_page(gphys - off, vm->ept_pointer);
+		if (page == NULL) {
+			return -EFAULT;
+		}
+		memcpy(buf, (u8 *)page_address(page) + off, chunk);
+		gphys += chunk;
+		buf = (u8 *)buf + chunk;
+		len -= chunk;
+	}
+	return 0;
+}
+
+// Fill guest-physical [gphys, gphys + len) from `src`, a user pointer if
+// `user`, or with zeroes if `src` is NULL. The EPT is walked once per 2 MiB
+// and the copy goes straight into the host pages, so large copies run at
+// memory speed. May sleep if `user`.
+static int fill_guest_phys(vm_state_t *vm, u64 gphys, const void *src,
+			   int user, size_t len)
+{
+	while (len) {
+		ept_pte_t *pte = gphys_to_ept_pte(gphys, vm->ept_pointer);
+		if (pte == NULL) {
+			return -EFAULT;
+		}
+		// the rest of this page table
+		int left = 512 - ((gphys >> 12) & 0x1ff);
+		for (; left && len; left--, pte++) {
+			if (!pte->fields.ignored1) {
+				return -EFAULT;
+			}
+			size_t off = offset_in_page(gphys);
+			size_t chunk = min_t(size_t, len, PAGE_SIZE - off);
+			u8 *dst = (u8 *)page_address(
+					  pfn_to_page(pte->fields.page_address)) +
+				  off;
+			if (src == NULL) {
+				memset(dst, 0, chunk);
+			} else if (!user) {
+				memcpy(dst, src, chunk);
+			} else if (copy_from_user(dst, (const void __user *)src,
+						  chunk)) {
+				return -EFAULT;
+			}
+			if (src != NULL) {
+				src = (const u8 *)src + chunk;
+			}
+			gphys += chunk;
+			len -= chunk;
+		}
+		if (user) {
+			cond_resched();
+		}
+	}
+	return 0;
+}
+
+int write_guest_phys(vm_state_t *vm, u64 gphys, const void *buf, size_t len)
+{
+	return fill_guest_phys(vm, gphys, buf, 0, len);
+}
+
+int copy_to_guest_phys_user(vm_state_t *vm, u64 gphys, const void __user *buf,
+			    size_t len)
+{
+	return fill_guest_phys(vm, gphys, (const void __force *)buf, 1, len);
+}
+
+int clear_guest_phys(vm_state_t *vm, u64 gphys, size_t len)
+{
+	return fill_guest_phys(vm, gphys, NULL, 0, len);
+}
+
+// Walk the guest's 4-level page tables from GUEST_CR3. Access rights are
+// not checked. VMCS of `vcpu` must be current.
+int gva_to_gphys(vcpu_state_t *vcpu, u64 gva, u64 *gphys)
+{
+	u64 table = vmcs_readl(GUEST_CR3) & GUEST_PADDR_MASK;
+	int level;
+
+	for (level = 3; level >= 0; level--) {
+		u64 index = (gva >> (12 + 9 * level)) & 0x1ff;
+		u64 entry;
+		if (read_guest_phys(vcpu->vm, table + index * 8, &entry,
+				    sizeof(entry))) {
+			return -EFAULT;
+		}
+		if (!(entry & _PAGE_PRESENT)) {
+			return -EFAULT;
+		}
+		// 1GiB pages in the PDPT, 2MiB pages in the PD
+		if (level == 0 || (level <= 2 && (entry & _PAGE_PSE))) {
+			u64 page_mask = (1ull << (12 + 9 * level)) - 1;
+			*gphys = (entry & GUEST_PADDR_MASK & ~page_mask) |
+				 (gva & page_mask);
+			return 0;
+		}
+		table = entry & GUEST_PADDR_MASK;
+	}
+	return -EFAULT; // not reached
+}
+
+int read_guest_virt(vcpu_state_t *vcpu, u64 gva, void *buf, size_t len)
+{
+	while (len) {
+		size_t chunk = min_t(size_t, len, PAGE_SIZE - offset_in_page(gva));
+		u64 gphys;
+		if (gva_to_gphys(vcpu, gva, &gphys) ||
+		    read_guest_phys(vcpu->vm, gphys, buf, chunk)) {
+			return -EFAULT;
+		}
+		gva += chunk;
+		buf = (u8 *)buf + chunk;
+		len -= chunk;
+	}
+	return 0;
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include <linux/types.h>
+
+struct _vm_state;
+struct _vcpu_state;
+
+int read_guest_phys(struct _vm_state *vm, u64 gphys, void *buf, size_t len);
+int write_guest_phys(struct _vm_state *vm, u64 gphys, const void *buf,
+		     size_t len);
+int copy_to_guest_phys_user(struct _vm_state *vm, u64 gphys,
+			    const void __user *buf, size_t len);
+int clear_guest_phys(struct _vm_state *vm, u64 gphys, size_t len);
+int gva_to_gphys(struct _vcpu_state *vcpu, u64 gva, u64 *gphys);
+int read_guest_virt(struct _vcpu_state *vcpu, u64 gva, void *buf, size_t len);
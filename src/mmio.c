@@ -0,0 +1,367 @@
+#include <linux/bitops.h> /* Needed for sign_extend64 */
+#include <linux/build_bug.h> /* Needed for BUILD_BUG_ON */
+#include <linux/hash.h> /* Needed for hash_64 */
+#include <linux/moduleparam.h> /* Needed for module_param */
+#include <linux/printk.h> /* Needed for pr_debug */
+#include <linux/string.h> /* Needed for memset */
+
+#include "mem.h"
+#include "mmio.h"
+#include "vm.h"
+#include "vmx.h"
+
+// Guest-physical addresses outside guest RAM have no EPT mapping, so an
+// access to them is an EPT violation (or a misconfiguration, for entries
+// set up to trap). The faulting instruction is decoded, the access goes to
+// an in-kernel device if one covers the address and to userspace
+// otherwise.
+//
+// Decoding needs a page walk and a fetch of the instruction, so decoded
+// instructions are cached per vCPU by RIP and CR3: a driver polling a
+// register from the same loop decodes once. A guest that rewrites the code
+// at an address it already did MMIO from must not reuse the same CR3, or
+// the cache has to be turned off.
+static bool mmio_decode_cache = true;
+module_param(mmio_decode_cache, bool, 0644);
+MODULE_PARM_DESC(mmio_decode_cache,
+		 "cache decoded MMIO instructions by guest RIP and CR3");
+
+#define EPT_VIOLATION_FETCH (1 << 2)
+
+#define REX_W 0x8
+#define REX_R 0x4
+
+void init_mmio_bus(mmio_bus_t *bus)
+{
+	mutex_init(&bus->lock);
+	bus->nr_devs = 0;
+}
+
+// `dev` must stay valid for the lifetime of the VM
+int register_mmio_dev(vm_state_t *vm, mmio_dev_t *dev)
+{
+	mmio_bus_t *bus = &vm->mmio;
+	int i, ret = 0;
+
+	if (dev->len == 0 || dev->base + dev->len < dev->base) {
+		return -EINVAL;
+	}
+
+	mutex_lock(&bus->lock);
+	for (i = 0; i < bus->nr_devs; i++) {
+		mmio_dev_t *d = bus->devs[i];
+		if (dev->base < d->base + d->len && d->base < dev->base + dev->len) {
+			ret = -EEXIST;
+			goto out;
+		}
+	}
+	if (bus->nr_devs == MMIO_MAX_DEVS) {
+		ret = -ENOSPC;
+		goto out;
+	}
+	bus->devs[bus->nr_devs] = dev;
+	smp_store_release(&bus->nr_devs, bus->nr_devs + 1); // after devs[]
+out:
+	mutex_unlock(&bus->lock);
+	return ret;
+}
+
+static mmio_dev_t *find_mmio_dev(mmio_bus_t *bus, u64 gphys, int size)
+{
+	int nr = smp_load_acquire(&bus->nr_devs);
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		mmio_dev_t *d = bus->devs[i];
+		if (gphys >= d->base && gphys + size <= d->base + d->len) {
+			return d;
+		}
+	}
+	return NULL;
+}
+
+static u64 size_mask(int size)
+{
+	return size == 8 ? ~0ull : (1ull << (size * 8)) - 1;
+}
+
+// registers in encoding order; RSP lives in the VMCS
+static u64 get_reg(vcpu_state_t *vcpu, int reg)
+{
+	BUILD_BUG_ON(sizeof(guest_regs_t) != 16 * sizeof(u64));
+	if (reg == 4) {
+		return vmcs_readl(GUEST_RSP);
+	}
+	return ((u64 *)&vcpu->guest_regs)[reg];
+}
+
+static void set_reg(vcpu_state_t *vcpu, int reg, u64 value)
+{
+	if (reg == 4) {
+		vmcs_writel(GUEST_RSP, value);
+		return;
+	}
+	((u64 *)&vcpu->guest_regs)[reg] = value;
+}
+
+// Decode the MOV forms compilers emit for MMIO: MOV r/m,r (88/89), MOV
+// r,r/m (8A/8B), MOV r/m,imm (C6/C7), MOV with a moffs (A0-A3), MOVZX and
+// MOVSX (0F B6/B7/BE/BF), 64-bit mode only. The address itself comes from
+// the VMCS, so ModRM/SIB/displacement are only skipped. `code` has room
+// for the longest instruction even if only `avail` bytes were fetched.
+static int decode_mov(const u8 *code, int avail, mmio_insn_t *insn)
+{
+	int i = 0, opsize = 4, addr32 = 0, rex = 0, modrm = 1, imm = 0;
+	int byte_reg = 0; // the register operand is 8 bits wide
+
+	memset(insn, 0, sizeof(*insn));
+
+	for (; i < avail; i++) {
+		u8 b = code[i];
+		if (b == 0x66) {
+			opsize = 2;
+		} else if (b == 0x67) {
+			addr32 = 1;
+		} else if (b == 0x26 || b == 0x2e || b == 0x36 || b == 0x3e ||
+			   b == 0x64 || b == 0x65) {
+			continue; // segment overrides do not change the GPA
+		} else {
+			break;
+		}
+	}
+	if (i < avail && (code[i] & 0xf0) == 0x40) {
+		rex = code[i++];
+	}
+	if (rex & REX_W) {
+		opsize = 8;
+	}
+
+	u8 op = code[i++];
+	switch (op) {
+	case 0x88: // MOV r/m8, r8
+	case 0x8a: // MOV r8, r/m8
+		insn->size = 1;
+		byte_reg = 1;
+		insn->write = op == 0x88;
+		break;
+	case 0x89: // MOV r/m, r
+	case 0x8b: // MOV r, r/m
+		insn->size = opsize;
+		insn->write = op == 0x89;
+		break;
+	case 0xc6: // MOV r/m8, imm8
+		insn->size = 1;
+		insn->write = 1;
+		imm = 1;
+		break;
+	case 0xc7: // MOV r/m, imm16/32, sign-extended to 64 bits
+		insn->size = opsize;
+		insn->write = 1;
+		imm = opsize == 2 ? 2 : 4;
+		break;
+	case 0xa0: // MOV AL, moffs8
+	case 0xa1: // MOV rAX, moffs
+	case 0xa2: // MOV moffs8, AL
+	case 0xa3: // MOV moffs, rAX
+		insn->size = op & 1 ? opsize : 1;
+		byte_reg = !(op & 1);
+		insn->write = op >= 0xa2;
+		modrm = 0;
+		i += addr32 ? 4 : 8;
+		break;
+	case 0x0f: {
+		u8 op2 = code[i++];
+		if (op2 != 0xb6 && op2 != 0xb7 && op2 != 0xbe && op2 != 0xbf) {
+			return -EINVAL;
+		}
+		insn->size = op2 & 1 ? 2 : 1;
+		insn->sign_extend = op2 >= 0xbe;
+		break;
+	}
+	default:
+		return -EINVAL;
+	}
+	insn->reg_size = byte_reg ? 1 : opsize;
+
+	if (modrm) {
+		u8 m = code[i++];
+		u8 mod = m >> 6;
+		u8 rm = m & 7;
+		if (mod == 3) {
+			return -EINVAL; // register operand, cannot fault
+		}
+		insn->reg = ((m >> 3) & 7) | (rex & REX_R ? 8 : 0);
+		if (imm && (m & 0x38)) {
+			return -EINVAL; // C6/C7 with reg != 0 is not a MOV
+		}
+		if (rm == 4 && mod == 0 && (code[i] & 7) == 5) {
+			i += 4; // SIB without base, disp32
+		}
+		if (rm == 4) {
+			i++; // SIB
+		}
+		if (mod == 0 && rm == 5) {
+			i += 4; // RIP-relative
+		} else if (mod == 1) {
+			i += 1;
+		} else if (mod == 2) {
+			i += 4;
+		}
+	}
+
+	if (imm) {
+		u64 value = 0;
+		int k;
+		for (k = 0; k < imm; k++) {
+			value |= (u64)code[i + k] << (8 * k);
+		}
+		insn->imm = imm == 4 ? (u64)(s64)(s32)value : value;
+		insn->has_imm = 1;
+		i += imm;
+	}
+
+	// AH, CH, DH and BH need a byte register without REX
+	if (byte_reg && !rex && insn->reg >= 4) {
+		insn->high_byte = 1;
+		insn->reg -= 4;
+	}
+
+	if (i > avail) {
+		return -EINVAL;
+	}
+	insn->len = i;
+	return 0;
+}
+
+// Decoded instruction at GUEST_RIP, from the cache if possible
+static int get_mmio_insn(vcpu_state_t *vcpu, mmio_insn_t *insn)
+{
+	u64 rip = vmcs_readl(GUEST_RIP);
+	u64 cr3 = vmcs_readl(GUEST_CR3);
+	mmio_decode_entry_t *e =
+		&vcpu->mmio.cache[hash_64(rip ^ cr3, MMIO_DECODE_CACHE_BITS)];
+
+	if (READ_ONCE(mmio_decode_cache) && e->insn.len && e->rip == rip &&
+	    e->cr3 == cr3) {
+		*insn = e->insn;
+		vcpu->mmio.stats.cache_hits++;
+		return 0;
+	}
+
+	// 15 bytes is the longest instruction, 32 covers the decoder
+	// running past a bogus one
+	u8 code[32] = { 0 };
+	int avail = 15;
+	if (read_guest_virt(vcpu, rip, code, avail)) {
+		// the instruction may end right before an unmapped page
+		avail = PAGE_SIZE - offset_in_page(rip);
+		if (avail >= 15 || read_guest_virt(vcpu, rip, code, avail)) {
+			return -EFAULT;
+		}
+	}
+	if (decode_mov(code, avail, insn)) {
+		pr_debug("tvisor: cannot decode MMIO instruction at %llx: %*ph\n",
+			 rip, avail, code);
+		return -EINVAL;
+	}
+
+	e->rip = rip;
+	e->cr3 = cr3;
+	e->insn = *insn;
+	return 0;
+}
+
+static void complete_mmio_read(vcpu_state_t *vcpu, const mmio_insn_t *insn,
+			       u64 value)
+{
+	u64 old = get_reg(vcpu, insn->reg);
+	u64 mask = size_mask(insn->reg_size);
+
+	value &= size_mask(insn->size);
+	if (insn->sign_extend) {
+		value = sign_extend64(value, insn->size * 8 - 1);
+	}
+
+	if (insn->high_byte) {
+		value = (old & ~0xff00ull) | ((value & 0xff) << 8);
+	} else if (insn->reg_size >= 4) {
+		value &= mask; // 32-bit results zero-extend into the register
+	} else {
+		value = (old & ~mask) | (value & mask);
+	}
+	set_reg(vcpu, insn->reg, value);
+}
+
+// VM_EXIT_INSTRUCTION_LEN is not valid for EPT exits
+static void skip_instruction(const mmio_insn_t *insn)
+{
+	vmcs_writel(GUEST_RIP, vmcs_readl(GUEST_RIP) + insn->len);
+}
+
+// EPT violation or misconfiguration, interrupts off
+int handle_mmio(vcpu_state_t *vcpu)
+{
+	struct tvisor_run *run = vcpu->run;
+	u64 gphys = vmcs_read64(GUEST_PHYSICAL_ADDRESS);
+	mmio_insn_t insn;
+	u64 value = 0;
+
+	vcpu->mmio.stats.exits++;
+	if (vcpu->exit_reason == EXIT_REASON_EPT_VIOLATION &&
+	    (vcpu->exit_qualification & EPT_VIOLATION_FETCH)) {
+		// guest-triggered, with interrupts off
+		pr_info_ratelimited(
+			"tvisor: instruction fetch from %llx outside guest RAM\n",
+			gphys);
+		run->exit_reason = TVISOR_EXIT_UNKNOWN;
+		return VMEXIT_STOP;
+	}
+	if (get_mmio_insn(vcpu, &insn)) {
+		run->exit_reason = TVISOR_EXIT_UNKNOWN;
+		return VMEXIT_STOP;
+	}
+
+	if (insn.write) {
+		value = insn.has_imm ? insn.imm : get_reg(vcpu, insn.reg);
+		if (insn.high_byte) {
+			value >>= 8;
+		}
+		value &= size_mask(insn.size);
+	}
+
+	mmio_dev_t *dev = find_mmio_dev(&vcpu->vm->mmio, gphys, insn.size);
+	if (dev != NULL) {
+		u64 offset = gphys - dev->base;
+		int ret = insn.write ?
+				  dev->ops->write(dev, offset, insn.size, value) :
+				  dev->ops->read(dev, offset, insn.size, &value);
+		if (ret == 0) {
+			if (!insn.write) {
+				complete_mmio_read(vcpu, &insn, value);
+			}
+			skip_instruction(&insn);
+			return VMEXIT_RESUME;
+		}
+	}
+
+	run->exit_reason = TVISOR_EXIT_MMIO;
+	run->mmio.phys_addr = gphys;
+	run->mmio.data = value;
+	run->mmio.len = insn.size;
+	run->mmio.is_write = insn.write;
+	vcpu->mmio.pending = insn;
+	vcpu->mmio.stats.user_exits++;
+	vcpu->user_exit_pending = 1;
+	return VMEXIT_USER;
+}
+
+// Userspace is done with a TVISOR_EXIT_MMIO. VMCS must be current.
+void complete_mmio_user_exit(vcpu_state_t *vcpu)
+{
+	mmio_insn_t *insn = &vcpu->mmio.pending;
+
+	if (!insn->write) {
+		complete_mmio_read(vcpu, insn, READ_ONCE(vcpu->run->mmio.data));
+	}
+	skip_instruction(insn);
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <linux/mutex.h>
+#include <linux/types.h>
+
+struct _vm_state;
+struct _vcpu_state;
+
+typedef struct _mmio_dev mmio_dev_t;
+
+// Callbacks of an in-kernel MMIO device, called by the exit handler with
+// interrupts off. `offset` is relative to the device's base. A non-zero
+// return hands the access to userspace instead.
+typedef struct _mmio_ops {
+	int (*read)(mmio_dev_t *dev, u64 offset, int size, u64 *value);
+	int (*write)(mmio_dev_t *dev, u64 offset, int size, u64 value);
+} mmio_ops_t;
+
+struct _mmio_dev {
+	u64 base; // guest-physical
+	u64 len;
+	const mmio_ops_t *ops;
+	void *opaque;
+};
+
+#define MMIO_MAX_DEVS 16
+
+// devices are only ever added, the exit handler reads the array locklessly
+typedef struct _mmio_bus {
+	struct mutex lock; // serializes registration
+	int nr_devs;
+	mmio_dev_t *devs[MMIO_MAX_DEVS];
+} mmio_bus_t;
+
+// a decoded MOV-family instruction that accesses memory
+typedef struct _mmio_insn {
+	u8 len; // instruction length, 0 for an empty cache entry
+	u8 size; // bytes accessed in memory
+	u8 write; // memory is the destination
+	u8 reg; // register operand, 0-15 in encoding order
+	u8 high_byte; // `reg` is AH, CH, DH or BH
+	u8 reg_size; // bytes written to `reg` by a read
+	u8 sign_extend; // MOVSX
+	u8 has_imm; // written value is `imm`, not `reg`
+	u64 imm;
+} mmio_insn_t;
+
+#define MMIO_DECODE_CACHE_BITS 6
+
+typedef struct _mmio_decode_entry {
+	u64 rip;
+	u64 cr3;
+	mmio_insn_t insn;
+} mmio_decode_entry_t;
+
+typedef struct _mmio_stats {
+	u64 exits;
+	u64 cache_hits; // instruction fetch and decode skipped
+	u64 user_exits; // no in-kernel device took the access
+} mmio_stats_t;
+
+typedef struct _mmio_vcpu {
+	mmio_decode_entry_t cache[1 << MMIO_DECODE_CACHE_BITS];
+	mmio_insn_t pending; // access handed to userspace
+	mmio_stats_t stats;
+} mmio_vcpu_t;
+
+void init_mmio_bus(mmio_bus_t *bus);
+int register_mmio_dev(struct _vm_state *vm, mmio_dev_t *dev);
+int handle_mmio(struct _vcpu_state *vcpu);
+void complete_mmio_user_exit(struct _vcpu_state *vcpu);
@@ -0,0 +1,276 @@
+#include <asm/cpufeature.h> /* Needed for boot_cpu_has */
+#include <asm/msr.h> /* Needed for rdmsrl */
+#include <asm/msr-index.h> /* Needed for MSR_CORE_PERF_GLOBAL_CTRL */
+#include <asm/page.h> /* Needed for __pa */
+#include <asm/perf_event.h> /* Needed for ARCH_PERFMON_EVENTSEL_INT */
+#include <linux/gfp.h> /* Needed for get_zeroed_page */
+#include <linux/minmax.h> /* Needed for min_t */
+#include <linux/moduleparam.h> /* Needed for module_param */
+#include <linux/printk.h> /* Needed for pr_info */
+
+#include "pmu.h"
+#include "vmx.h"
+
+// The guest gets the first few general-purpose and fixed counters of the
+// CPU it runs on. Their MSRs are switched by the CPU itself: the VM-entry
+// MSR-load area loads the guest's values, the VM-exit MSR-store area saves
+// them back to the same array and the VM-exit MSR-load area puts the host's
+// values back. Guest RDMSR/WRMSR of these MSRs still exit and go to the
+// array, and so does RDPMC: left to run, it would read counters of the host
+// beyond the ones we switch.
+// The host's values are taken in load_guest_pmu() right before each entry,
+// with interrupts off, in enter_vcpu() and on the fast exit path alike, so
+// the exit puts back exactly what host perf had.
+// No PMIs are delivered to the guest, it can count but not sample.
+
+static bool vpmu;
+module_param(vpmu, bool, 0444);
+MODULE_PARM_DESC(vpmu, "Pass performance counters through to guests");
+
+#define VPMU_MAX_GP 4
+#define VPMU_MAX_FIXED 3
+#define VPMU_MAX_MSRS (2 * VPMU_MAX_GP + VPMU_MAX_FIXED + 2)
+
+#define PMU_CAP_FW_WRITES (1ull << 13) // full-width writes via MSR_IA32_PMC0
+
+static u32 pmu_version; // 0 = no vPMU
+static u32 nr_gp;
+static u32 gp_width;
+static u32 nr_fixed;
+static u32 fixed_width;
+static u32 host_pmu_ebx; // architectural events that are not available
+
+void setup_guest_pmu_support(void)
+{
+	if (!vpmu) {
+		return;
+	}
+
+	cpuid_t c = get_cpuid(0xa);
+	u64 caps = 0;
+	if (boot_cpu_has(X86_FEATURE_PDCM)) {
+		rdmsrl(MSR_IA32_PERF_CAPABILITIES, caps);
+	}
+	// global control needs v2; without full-width writes, loading a
+	// counter from the MSR area would truncate it to 32 bits
+	if ((c.eax & 0xff) < 2 || !(caps & PMU_CAP_FW_WRITES)) {
+		pr_info("tvisor: no vPMU, architectural PMU v%u, caps %llx\n",
+			c.eax & 0xff, caps);
+		return;
+	}
+
+	pmu_version = 2;
+	nr_gp = min_t(u32, (c.eax >> 8) & 0xff, VPMU_MAX_GP);
+	gp_width = (c.eax >> 16) & 0xff;
+	nr_fixed = min_t(u32, c.edx & 0x1f, VPMU_MAX_FIXED);
+	fixed_width = (c.edx >> 5) & 0xff;
+	host_pmu_ebx = c.ebx;
+
+	pr_info("tvisor: vPMU with %u general-purpose and %u fixed counters\n",
+		nr_gp, nr_fixed);
+}
+
+// CPUID leaf 0xa as the guest sees it, all zero without a vPMU
+cpuid_t guest_pmu_cpuid(void)
+{
+	cpuid_t c = { 0, 0, 0, 0 };
+
+	if (pmu_version) {
+		u32 ebx_len = (get_cpuid(0xa).eax >> 24) & 0xff;
+		c.eax = pmu_version | nr_gp << 8 | gp_width << 16 |
+			ebx_len << 24;
+		c.ebx = host_pmu_ebx;
+		c.edx = nr_fixed | fixed_width << 5;
+	}
+	return c;
+}
+
+static void add_pmu_msr(vcpu_state_t *vcpu, u32 index)
+{
+	vmx_msr_entry_t *guest = vcpu->pmu_msrs;
+	vmx_msr_entry_t *host = guest + VPMU_MAX_MSRS;
+	u32 n = vcpu->nr_pmu_msrs++;
+
+	guest[n].index = index;
+	guest[n].value = 0;
+	host[n].index = index;
+}
+
+// The guest's MSRs followed by the host's, in one page: the MSR areas want
+// 16 byte alignment and physical addresses.
+int alloc_guest_pmu(vcpu_state_t *vcpu)
+{
+	u32 i;
+
+	vcpu->nr_pmu_msrs = 0;
+	if (!pmu_version) {
+		return 0;
+	}
+
+	BUILD_BUG_ON(2 * VPMU_MAX_MSRS * sizeof(vmx_msr_entry_t) > PAGE_SIZE);
+	vcpu->pmu_msrs =
+		(vmx_msr_entry_t *)get_zeroed_page(GFP_KERNEL_ACCOUNT);
+	if (vcpu->pmu_msrs == NULL) {
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr_gp; i++) {
+		add_pmu_msr(vcpu, MSR_IA32_PMC0 + i);
+		add_pmu_msr(vcpu, MSR_ARCH_PERFMON_EVENTSEL0 + i);
+	}
+	for (i = 0; i < nr_fixed; i++) {
+		add_pmu_msr(vcpu, MSR_CORE_PERF_FIXED_CTR0 + i);
+	}
+	add_pmu_msr(vcpu, MSR_CORE_PERF_FIXED_CTR_CTRL);
+	add_pmu_msr(vcpu, MSR_CORE_PERF_GLOBAL_CTRL);
+	return 0;
+}
+
+void free_guest_pmu(vcpu_state_t *vcpu)
+{
+	if (vcpu->pmu_msrs != NULL) {
+		free_page((unsigned long)vcpu->pmu_msrs);
+	}
+}
+
+void set_guest_pmu_config(vcpu_state_t *vcpu, vmcs_config_t *config)
+{
+	if (vcpu->nr_pmu_msrs) {
+		config->nr_pmu_msrs = vcpu->nr_pmu_msrs;
+		config->guest_pmu_msrs = __pa(vcpu->pmu_msrs);
+		config->host_pmu_msrs = __pa(vcpu->pmu_msrs + VPMU_MAX_MSRS);
+	}
+}
+
+// Take the host's values for the VM-exit MSR-load area. Interrupts off,
+// right before the entry; a leaf, also called from vmexit_fast_path().
+void load_guest_pmu(vcpu_state_t *vcpu)
+{
+	vmx_msr_entry_t *host = vcpu->pmu_msrs + VPMU_MAX_MSRS;
+	u32 i;
+
+	for (i = 0; i < vcpu->nr_pmu_msrs; i++) {
+		rdmsrl(host[i].index, host[i].value);
+	}
+}
+
+static vmx_msr_entry_t *find_pmu_msr(vcpu_state_t *vcpu, u32 msr)
+{
+	u32 i;
+
+	// the legacy counter MSRs alias the full-width ones
+	if (msr >= MSR_ARCH_PERFMON_PERFCTR0 &&
+	    msr < MSR_ARCH_PERFMON_PERFCTR0 + nr_gp) {
+		msr += MSR_IA32_PMC0 - MSR_ARCH_PERFMON_PERFCTR0;
+	}
+	for (i = 0; i < vcpu->nr_pmu_msrs; i++) {
+		if (vcpu->pmu_msrs[i].index == msr) {
+			return &vcpu->pmu_msrs[i];
+		}
+	}
+	return NULL;
+}
+
+// Returns 0 with `value` set, or -ENOENT if `msr` is not a PMU MSR we
+// emulate.
+int handle_pmu_rdmsr(vcpu_state_t *vcpu, u32 msr, u64 *value)
+{
+	switch (msr) {
+	case MSR_IA32_PERF_CAPABILITIES:
+		*value = pmu_version ? PMU_CAP_FW_WRITES : 0;
+		return 0;
+	case MSR_CORE_PERF_GLOBAL_STATUS: // no overflows without PMIs
+	case MSR_CORE_PERF_GLOBAL_OVF_CTRL:
+		if (!pmu_version) {
+			return -ENOENT;
+		}
+		*value = 0;
+		return 0;
+	}
+
+	vmx_msr_entry_t *e = find_pmu_msr(vcpu, msr);
+	if (e == NULL) {
+		return -ENOENT;
+	}
+	*value = e->value; // stored on the exit
+	return 0;
+}
+
+// RDPMC: bit 30 of `ecx` picks the fixed counters. Returns 0 with `value`
+// set, or -EINVAL for a counter the guest does not have.
+int handle_pmu_rdpmc(vcpu_state_t *vcpu, u32 ecx, u64 *value)
+{
+	u32 index = ecx & ~(1u << 30);
+	vmx_msr_entry_t *e = NULL;
+
+	if (ecx & (1u << 30)) {
+		if (index < nr_fixed) {
+			e = find_pmu_msr(vcpu, MSR_CORE_PERF_FIXED_CTR0 + index);
+		}
+	} else if (index < nr_gp) {
+		e = find_pmu_msr(vcpu, MSR_IA32_PMC0 + index);
+	}
+	if (e == NULL) {
+		return -EINVAL;
+	}
+	*value = e->value; // stored on the exit
+	return 0;
+}
+
+static u64 pmu_valid_bits(u32 msr)
+{
+	if (msr >= MSR_IA32_PMC0 && msr < MSR_IA32_PMC0 + nr_gp) {
+		return (1ull << gp_width) - 1;
+	}
+	// no PMIs, and the other hyperthread's events are not the guest's:
+	// the INT and AnyThread bits are reserved
+	if (msr >= MSR_ARCH_PERFMON_EVENTSEL0 &&
+	    msr < MSR_ARCH_PERFMON_EVENTSEL0 + nr_gp) {
+		return 0xffffffff & ~(ARCH_PERFMON_EVENTSEL_INT |
+				      ARCH_PERFMON_EVENTSEL_ANY);
+	}
+	if (msr >= MSR_CORE_PERF_FIXED_CTR0 &&
+	    msr < MSR_CORE_PERF_FIXED_CTR0 + nr_fixed) {
+		return (1ull << fixed_width) - 1;
+	}
+	if (msr == MSR_CORE_PERF_FIXED_CTR_CTRL) {
+		u64 valid = 0;
+		u32 i;
+		for (i = 0; i < nr_fixed; i++) {
+			valid |= 0x3ull << (4 * i); // enable, without Any and PMI
+		}
+		return valid;
+	}
+	// MSR_CORE_PERF_GLOBAL_CTRL
+	return ((1ull << nr_gp) - 1) | (((1ull << nr_fixed) - 1) << 32);
+}
+
+// Returns 0 if the write took, -ENOENT if `msr` is not a PMU MSR we
+// emulate, -EINVAL if the guest deserves a #GP. Loaded on the next entry.
+int handle_pmu_wrmsr(vcpu_state_t *vcpu, u32 msr, u64 value)
+{
+	if (msr == MSR_CORE_PERF_GLOBAL_OVF_CTRL && pmu_version) {
+		return 0;
+	}
+
+	vmx_msr_entry_t *e = find_pmu_msr(vcpu, msr);
+	if (e == NULL) {
+		return -ENOENT;
+	}
+	if (msr >= MSR_ARCH_PERFMON_PERFCTR0 &&
+	    msr < MSR_ARCH_PERFMON_PERFCTR0 + nr_gp) {
+		value = (s64)(s32)value; // legacy writes sign-extend bit 31
+	}
+
+	u64 valid = pmu_valid_bits(e->index);
+	if (e->index >= MSR_IA32_PMC0 && e->index < MSR_IA32_PMC0 + nr_gp) {
+		value &= valid;
+	} else if (e->index >= MSR_CORE_PERF_FIXED_CTR0 &&
+		   e->index < MSR_CORE_PERF_FIXED_CTR0 + nr_fixed) {
+		value &= valid;
+	} else if (value & ~valid) {
+		return -EINVAL; // reserved bits would fail the VM entry
+	}
+	e->value = value;
+	return 0;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <linux/types.h>
+
+#include "cpu.h"
+#include "vm.h"
+
+void setup_guest_pmu_support(void);
+cpuid_t guest_pmu_cpuid(void);
+int alloc_guest_pmu(vcpu_state_t *vcpu);
+void free_guest_pmu(vcpu_state_t *vcpu);
+void set_guest_pmu_config(vcpu_state_t *vcpu, vmcs_config_t *config);
+void load_guest_pmu(vcpu_state_t *vcpu);
+int handle_pmu_rdmsr(vcpu_state_t *vcpu, u32 msr, u64 *value);
+int handle_pmu_wrmsr(vcpu_state_t *vcpu, u32 msr, u64 value);
+int handle_pmu_rdpmc(vcpu_state_t *vcpu, u32 ecx, u64 *value);
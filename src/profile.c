@@ -0,0 +1,399 @@
+#include <linux/anon_inodes.h> /* Needed for anon_inode_getfile */
+#include <linux/file.h> /* Needed for fd_install */
+#include <linux/fs.h> /* Needed for simple_read_from_buffer */
+#include <linux/hash.h> /* Needed for hash_64 */
+#include <linux/list.h> /* Needed for hlist_add_head */
+#include <linux/minmax.h> /* Needed for min_t */
+#include <linux/slab.h> /* Needed for kvzalloc */
+#include <linux/time64.h> /* Needed for USEC_PER_SEC */
+
+#include "profile.h"
+#include "vm.h"
+#include "vmx.h"
+
+// Guest RIP and CR3 are sampled from the exit handler whenever the VMX
+// preemption timer expires. With profiling on, the timer runs at the
+// sampling period (or the scheduling quantum, if that is shorter) and
+// profile_tick() decides which expiries take a sample and which give the
+// CPU back. Each vCPU has its own ring, so sampling takes no lock; the rings
+// are drained into the VM's histogram by the vCPU thread once half full and
+// by every read of the profile fd.
+
+#define PROFILE_HASH_BITS 12
+#define PROFILE_MAX_ENTRIES 65536 // distinct addresses per VM
+#define PROFILE_LINE_MAX 96 // "vcpu<id>;cr3_<cr3>;0x<rip> <count>\n" and more
+
+typedef struct _profile_entry {
+	struct hlist_node node;
+	u64 rip;
+	u64 cr3;
+	u32 vcpu;
+	u64 count;
+} profile_entry_t;
+
+void init_profile(profile_state_t *ps)
+{
+	mutex_init(&ps->lock);
+}
+
+static void clear_profile_hist(profile_state_t *ps)
+{
+	profile_entry_t *e;
+	struct hlist_node *tmp;
+	int i;
+
+	for (i = 0; i < (1 << PROFILE_HASH_BITS); i++) {
+		hlist_for_each_entry_safe(e, tmp, &ps->hist[i], node) {
+			kfree(e);
+		}
+		INIT_HLIST_HEAD(&ps->hist[i]);
+	}
+	ps->nr_entries = 0;
+	ps->dropped = 0;
+}
+
+// the vCPUs must be gone
+void free_profile(profile_state_t *ps)
+{
+	if (ps->hist != NULL) {
+		clear_profile_hist(ps);
+		kvfree(ps->hist);
+	}
+}
+
+// Once allocated, a vCPU keeps its ring until it goes away, so the exit
+// handler never races with a free. Under vm->lock.
+int alloc_vcpu_profile(vcpu_state_t *vcpu)
+{
+	if (vcpu->profile != NULL) {
+		return 0;
+	}
+	vcpu_profile_t *p = kvzalloc(sizeof(vcpu_profile_t), GFP_KERNEL);
+	if (p == NULL) {
+		return -ENOMEM;
+	}
+	smp_store_release(&vcpu->profile, p); // before vm->profile.generation
+	return 0;
+}
+
+void free_vcpu_profile(vcpu_state_t *vcpu)
+{
+	kvfree(vcpu->profile);
+}
+
+static void add_profile_sample(profile_state_t *ps, u32 vcpu,
+			       const profile_sample_t *s)
+{
+	struct hlist_head *head =
+		&ps->hist[hash_64(s->rip ^ (s->cr3 << 4) ^ vcpu,
+				  PROFILE_HASH_BITS)];
+	profile_entry_t *e;
+
+	hlist_for_each_entry(e, head, node) {
+		if (e->rip == s->rip && e->cr3 == s->cr3 && e->vcpu == vcpu) {
+			e->count++;
+			return;
+		}
+	}
+
+	if (ps->nr_entries == PROFILE_MAX_ENTRIES) {
+		ps->dropped++;
+		return;
+	}
+	e = kmalloc(sizeof(*e), GFP_KERNEL);
+	if (e == NULL) {
+		ps->dropped++;
+		return;
+	}
+	e->rip = s->rip;
+	e->cr3 = s->cr3;
+	e->vcpu = vcpu;
+	e->count = 1;
+	hlist_add_head(&e->node, head);
+	ps->nr_entries++;
+}
+
+// move the samples in `vcpu`'s ring to the histogram, profile lock held
+static void drain_profile_ring(vm_state_t *vm, vcpu_state_t *vcpu)
+{
+	vcpu_profile_t *p = smp_load_acquire(&vcpu->profile);
+	if (p == NULL) {
+		return;
+	}
+
+	u32 tail = p->tail;
+	u32 head = smp_load_acquire(&p->head); // samples before it are written
+	for (; tail != head; tail++) {
+		add_profile_sample(&vm->profile, vcpu->id,
+				   &p->samples[tail % PROFILE_RING_SIZE]);
+	}
+	smp_store_release(&p->tail, tail); // the vCPU may reuse the slots
+}
+
+static void drain_profile(vm_state_t *vm)
+{
+	int nr_vcpus = smp_load_acquire(&vm->nr_vcpus);
+	int i;
+
+	for (i = 0; i < nr_vcpus; i++) {
+		drain_profile_ring(vm, vm->vcpus[i]);
+	}
+}
+
+// From run_vcpu() between two trips into the guest, so readers that come
+// rarely do not lose samples.
+void drain_vcpu_profile(vcpu_state_t *vcpu)
+{
+	vcpu_profile_t *p = vcpu->profile;
+	vm_state_t *vm = vcpu->vm;
+
+	if (p == NULL ||
+	    READ_ONCE(p->head) - READ_ONCE(p->tail) < PROFILE_RING_SIZE / 2) {
+		return;
+	}
+	mutex_lock(&vm->profile.lock);
+	drain_profile_ring(vm, vcpu);
+	mutex_unlock(&vm->profile.lock);
+}
+
+// TVISOR_SET_PROFILE. The vCPUs pick the new frequency up on their next
+// entry, see profile_timer_value().
+int set_profile(vm_state_t *vm, const struct tvisor_profile *args)
+{
+	profile_state_t *ps = &vm->profile;
+	int i, ret = 0;
+
+	if (args->frequency > TVISOR_PROFILE_MAX_FREQUENCY ||
+	    args->flags & ~TVISOR_PROFILE_RESET) {
+		return -EINVAL;
+	}
+	if (args->frequency && !vmx_has_preemption_timer()) {
+		return -EOPNOTSUPP;
+	}
+
+	mutex_lock(&vm->lock); // no new vCPUs without a ring
+	mutex_lock(&ps->lock);
+	if (args->frequency) {
+		if (ps->hist == NULL) {
+			ps->hist = kvcalloc(1 << PROFILE_HASH_BITS,
+					    sizeof(struct hlist_head),
+					    GFP_KERNEL);
+			if (ps->hist == NULL) {
+				ret = -ENOMEM;
+				goto out;
+			}
+		}
+		for (i = 0; i < vm->nr_vcpus; i++) {
+			ret = alloc_vcpu_profile(vm->vcpus[i]);
+			if (ret) {
+				goto out;
+			}
+		}
+	}
+
+	if (args->flags & TVISOR_PROFILE_RESET && ps->hist != NULL) {
+		drain_profile(vm);
+		clear_profile_hist(ps);
+		for (i = 0; i < vm->nr_vcpus; i++) {
+			vcpu_profile_t *p = vm->vcpus[i]->profile;
+			if (p != NULL) {
+				p->lost_reported = READ_ONCE(p->lost);
+			}
+		}
+	}
+
+	WRITE_ONCE(ps->frequency, args->frequency);
+	smp_store_release(&ps->generation, ps->generation + 1);
+out:
+	mutex_unlock(&ps->lock);
+	mutex_unlock(&vm->lock);
+	return ret;
+}
+
+// The preemption timer value for `vcpu` given the scheduling quantum
+// `quantum` (ticks, 0 = none), set up for profile_tick(). On vcpu->cpu
+// with interrupts off.
+u32 profile_timer_value(vcpu_state_t *vcpu, u32 quantum)
+{
+	vm_state_t *vm = vcpu->vm;
+
+	vcpu->profile_generation = smp_load_acquire(&vm->profile.generation);
+	u32 frequency = READ_ONCE(vm->profile.frequency);
+	vcpu_profile_t *p = vcpu->profile;
+	if (p == NULL) {
+		return quantum;
+	}
+	if (frequency == 0) {
+		p->active = 0;
+		return quantum;
+	}
+
+	u32 period = vmx_preemption_timer_ticks(USEC_PER_SEC / frequency) ?: 1;
+	u32 value = quantum ? min_t(u32, quantum, period) : period;
+	p->sample_every = max_t(u32, period / value, 1);
+	p->yield_every = quantum ? max_t(u32, quantum / value, 1) : 0;
+	p->until_sample = p->sample_every;
+	p->until_yield = p->yield_every;
+	p->active = 1;
+	return value;
+}
+
+// The preemption timer expired: take a sample if it is time to, and say
+// whether the quantum is used up.
+int profile_tick(vcpu_state_t *vcpu)
+{
+	vcpu_profile_t *p = vcpu->profile;
+
+	if (p == NULL || !p->active) {
+		return VMEXIT_YIELD;
+	}
+
+	if (--p->until_sample == 0) {
+		p->until_sample = p->sample_every;
+		u32 head = p->head;
+		if (head - smp_load_acquire(&p->tail) == PROFILE_RING_SIZE) {
+			p->lost++;
+		} else {
+			profile_sample_t *s =
+				&p->samples[head % PROFILE_RING_SIZE];
+			s->rip = vmcs_readl(GUEST_RIP);
+			s->cr3 = vmcs_readl(GUEST_CR3);
+			smp_store_release(&p->head, head + 1);
+		}
+	}
+
+	if (p->yield_every && --p->until_yield == 0) {
+		p->until_yield = p->yield_every;
+		return VMEXIT_YIELD;
+	}
+	return VMEXIT_RESUME;
+}
+
+// the histogram as folded stacks, kvfree() the result
+static char *format_profile(vm_state_t *vm, size_t *len)
+{
+	profile_state_t *ps = &vm->profile;
+	profile_entry_t *e;
+	int i;
+
+	mutex_lock(&ps->lock);
+	if (ps->hist == NULL) {
+		mutex_unlock(&ps->lock);
+		*len = 0;
+		return NULL;
+	}
+	drain_profile(vm);
+
+	int nr_vcpus = smp_load_acquire(&vm->nr_vcpus);
+	size_t size = (ps->nr_entries + nr_vcpus + 1) * PROFILE_LINE_MAX;
+	char *buf = kvmalloc(size, GFP_KERNEL);
+	if (buf == NULL) {
+		mutex_unlock(&ps->lock);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	size_t n = 0;
+	for (i = 0; i < (1 << PROFILE_HASH_BITS); i++) {
+		hlist_for_each_entry(e, &ps->hist[i], node) {
+			n += scnprintf(buf + n, size - n,
+				       "vcpu%u;cr3_%llx;0x%llx %llu\n", e->vcpu,
+				       e->cr3, e->rip, e->count);
+		}
+	}
+	for (i = 0; i < nr_vcpus; i++) {
+		vcpu_profile_t *p = smp_load_acquire(&vm->vcpus[i]->profile);
+		if (p == NULL) {
+			continue;
+		}
+		u64 lost = READ_ONCE(p->lost) - p->lost_reported;
+		if (lost) {
+			n += scnprintf(buf + n, size - n, "vcpu%d;[lost] %llu\n",
+				       i, lost);
+		}
+	}
+	if (ps->dropped) {
+		n += scnprintf(buf + n, size - n, "[dropped] %llu\n",
+			       ps->dropped);
+	}
+	mutex_unlock(&ps->lock);
+
+	*len = n;
+	return buf;
+}
+
+typedef struct _profile_reader {
+	vm_state_t *vm;
+	struct mutex lock; // protects the snapshot
+	char *buf;
+	size_t len;
+} profile_reader_t;
+
+// A fresh snapshot at offset 0, read on from there to the end.
+static ssize_t profile_fd_read(struct file *filp, char __user *ubuf,
+			       size_t count, loff_t *offset)
+{
+	profile_reader_t *r = filp->private_data;
+	ssize_t ret;
+
+	mutex_lock(&r->lock);
+	if (*offset == 0) {
+		kvfree(r->buf);
+		r->buf = format_profile(r->vm, &r->len);
+		if (IS_ERR(r->buf)) {
+			ret = PTR_ERR(r->buf);
+			r->buf = NULL;
+			r->len = 0;
+			goto out;
+		}
+	}
+	ret = simple_read_from_buffer(ubuf, count, offset, r->buf, r->len);
+out:
+	mutex_unlock(&r->lock);
+	return ret;
+}
+
+static int profile_fd_release(struct inode *inode, struct file *filp)
+{
+	profile_reader_t *r = filp->private_data;
+
+	put_vm(r->vm);
+	kvfree(r->buf);
+	kfree(r);
+	return 0;
+}
+
+static const struct file_operations profile_fd_fops = {
+	.owner = THIS_MODULE,
+	.read = profile_fd_read,
+	.release = profile_fd_release,
+	.llseek = noop_llseek,
+};
+
+// TVISOR_GET_PROFILE_FD
+int create_profile_fd(vm_state_t *vm)
+{
+	profile_reader_t *r = kzalloc(sizeof(profile_reader_t), GFP_KERNEL);
+	if (r == NULL) {
+		return -ENOMEM;
+	}
+	r->vm = vm;
+	mutex_init(&r->lock);
+
+	int fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		kfree(r);
+		return fd;
+	}
+
+	struct file *file = anon_inode_getfile("tvisor-profile",
+					       &profile_fd_fops, r, O_RDONLY);
+	if (IS_ERR(file)) {
+		put_unused_fd(fd);
+		kfree(r);
+		return PTR_ERR(file);
+	}
+	file->f_mode |= FMODE_PREAD; // pread at 0 takes a fresh snapshot
+	get_vm(vm);
+	fd_install(fd, file);
+	return fd;
+}
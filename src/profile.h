@@ -0,0 +1,51 @@
+#pragma once
+
+#include <linux/mutex.h>
+#include <linux/types.h>
+
+#include "tvisor.h"
+
+struct _vm_state;
+struct _vcpu_state;
+
+#define PROFILE_RING_SIZE 4096 // samples per vCPU, a power of 2
+
+typedef struct _profile_sample {
+	u64 rip;
+	u64 cr3;
+} profile_sample_t;
+
+// Samples of one vCPU on their way to the VM's histogram: the vCPU writes
+// `head` from its exit handler, whoever holds the profile lock drains up to
+// it and moves `tail`.
+typedef struct _vcpu_profile {
+	u32 head;
+	u32 tail;
+	u64 lost; // ring was full, bumped by the vCPU
+	u64 lost_reported; // `lost` at the last reset, the reader's
+	int active; // sample on preemption timer expiry, the vCPU's
+	u32 sample_every; // expiries per sample and per scheduling quantum
+	u32 yield_every; // 0 = no quantum
+	u32 until_sample;
+	u32 until_yield;
+	profile_sample_t samples[PROFILE_RING_SIZE];
+} vcpu_profile_t;
+
+typedef struct _profile_state {
+	struct mutex lock; // serializes settings and draining the rings
+	u32 frequency; // TVISOR_SET_PROFILE, 0 = off
+	u32 generation; // bumped on every change of `frequency`
+	struct hlist_head *hist; // (vcpu, cr3, rip) -> count, from first use
+	u32 nr_entries;
+	u64 dropped; // samples of new addresses once `hist` was full
+} profile_state_t;
+
+void init_profile(profile_state_t *ps);
+void free_profile(profile_state_t *ps);
+int alloc_vcpu_profile(struct _vcpu_state *vcpu);
+void free_vcpu_profile(struct _vcpu_state *vcpu);
+int set_profile(struct _vm_state *vm, const struct tvisor_profile *args);
+u32 profile_timer_value(struct _vcpu_state *vcpu, u32 quantum);
+int profile_tick(struct _vcpu_state *vcpu);
+void drain_vcpu_profile(struct _vcpu_state *vcpu);
+int create_profile_fd(struct _vm_state *vm);
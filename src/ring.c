@@ -0,0 +1,279 @@
+#include <linux/kthread.h> /* Needed for kthread_run */
+#include <linux/ktime.h> /* Needed for ktime_get_ns */
+#include <linux/log2.h> /* Needed for is_power_of_2 */
+#include <linux/moduleparam.h> /* Needed for module_param */
+#include <linux/mutex.h> /* Needed for DEFINE_MUTEX */
+#include <linux/overflow.h> /* Needed for struct_size */
+#include <linux/printk.h> /* Needed for pr_info */
+#include <linux/sched.h> /* Needed for cond_resched */
+#include <linux/slab.h> /* Needed for kzalloc */
+#include <linux/vmalloc.h> /* Needed for vmap */
+#include <linux/wait_bit.h> /* Needed for wait_var_event */
+
+#include "blk.h"
+#include "ept.h"
+#include "ring.h"
+#include "vm.h"
+
+static uint ring_poll_ns = 200000;
+module_param(ring_poll_ns, uint, 0644);
+MODULE_PARM_DESC(ring_poll_ns,
+		 "maximum time the ring thread polls an idle ring before it "
+		 "sleeps and asks the guest for a kick");
+
+static uint ring_poll_ns_start = 10000;
+module_param(ring_poll_ns_start, uint, 0644);
+MODULE_PARM_DESC(ring_poll_ns_start, "initial ring polling window");
+
+static DEFINE_MUTEX(ring_mutex); // serializes (un)registration
+
+// Finish descriptor `slot` with `status` and move `tail` past every
+// completed descriptor. Any context.
+void complete_ring_desc(ring_state_t *rs, u32 slot, int status)
+{
+	unsigned long flags;
+
+	WRITE_ONCE(rs->ring->desc[slot].status, status);
+
+	spin_lock_irqsave(&rs->lock, flags);
+	rs->done[slot] = 1;
+	u32 tail = rs->tail;
+	while (rs->done[tail & (rs->size - 1)]) {
+		rs->done[tail & (rs->size - 1)] = 0;
+		tail++;
+	}
+	if (tail != rs->tail) {
+		rs->tail = tail;
+		smp_store_release(&rs->ring->tail, tail); // statuses before tail
+	}
+	spin_unlock_irqrestore(&rs->lock, flags);
+
+	if (atomic_dec_and_test(&rs->inflight)) {
+		wake_up_var(&rs->inflight);
+	}
+}
+
+// Start everything the guest has published so far, in order. Block requests
+// complete later. Returns the number of descriptors started.
+static u32 process_ring(ring_state_t *rs)
+{
+	struct tvisor_ring *ring = rs->ring;
+	u32 head = smp_load_acquire(&ring->head);
+	u32 n = head - rs->next;
+	blk_batch_t batch;
+	u32 i;
+
+	if (n == 0) {
+		return 0;
+	}
+	if (head - READ_ONCE(rs->tail) > rs->size) {
+		pr_info("tvisor: ring head[%u] tail[%u] out of range, giving up\n",
+			head, READ_ONCE(rs->tail));
+		rs->broken = 1;
+		return 0;
+	}
+
+	atomic_add(n, &rs->inflight);
+	blk_batch_init(&batch, rs);
+	for (i = 0; i < n; i++) {
+		u32 slot = (rs->next + i) & (rs->size - 1);
+		struct tvisor_ring_desc *desc = &ring->desc[slot];
+
+		switch (READ_ONCE(desc->op)) {
+		case TVISOR_RING_OP_NOP:
+			complete_ring_desc(rs, slot, 0);
+			break;
+		case TVISOR_RING_OP_BLK_READ:
+		case TVISOR_RING_OP_BLK_WRITE:
+		case TVISOR_RING_OP_BLK_FLUSH:
+			blk_queue(&batch, slot, desc);
+			break;
+		default:
+			complete_ring_desc(rs, slot, -ENOSYS);
+			break;
+		}
+	}
+	blk_submit(&batch);
+
+	rs->next = head;
+	rs->stats.requests += n;
+	rs->stats.batches++;
+	return n;
+}
+
+static int has_work(ring_state_t *rs)
+{
+	return !rs->broken && READ_ONCE(rs->ring->head) != rs->next;
+}
+
+// Poll the ring while it is busy. After `poll_ns` without a request ask the
+// guest for a kick and sleep. The window grows when a kick arrives soon
+// after we gave up (polling longer would have caught it) and shrinks when
+// we slept for long.
+static int ring_thread(void *data)
+{
+	ring_state_t *rs = data;
+	u64 idle_since = ktime_get_ns();
+
+	while (!kthread_should_stop()) {
+		if (!rs->broken && process_ring(rs)) {
+			idle_since = ktime_get_ns();
+			cond_resched();
+			continue;
+		}
+		if (ktime_get_ns() - idle_since < rs->poll_ns) {
+			cpu_relax();
+			cond_resched();
+			continue;
+		}
+
+		WRITE_ONCE(rs->ring->need_kick, 1);
+		smp_mb(); // need_kick before head, pairs with the guest's barrier
+		if (has_work(rs)) {
+			WRITE_ONCE(rs->ring->need_kick, 0);
+			continue;
+		}
+
+		rs->stats.sleeps++;
+		u64 start = ktime_get_ns();
+		wait_event_interruptible(rs->wq, READ_ONCE(rs->kicked) ||
+							 kthread_should_stop());
+		WRITE_ONCE(rs->kicked, 0);
+		WRITE_ONCE(rs->ring->need_kick, 0);
+
+		u32 max = READ_ONCE(ring_poll_ns);
+		if (ktime_get_ns() - start < max) {
+			u32 grown = rs->poll_ns * 2;
+			if (grown < ring_poll_ns_start) {
+				grown = ring_poll_ns_start;
+			}
+			rs->poll_ns = grown < max ? grown : max;
+		} else {
+			rs->poll_ns /= 2;
+		}
+		idle_since = ktime_get_ns();
+	}
+
+	return 0;
+}
+
+int register_ring(vm_state_t *vm, u64 gphys, u64 nr_pages)
+{
+	struct page *pages[TVISOR_RING_MAX_PAGES];
+	int i, ret = 0;
+
+	if ((gphys & 0xfff) || nr_pages == 0 ||
+	    nr_pages > TVISOR_RING_MAX_PAGES) {
+		return -EINVAL;
+	}
+	for (i = 0; i < nr_pages; i++) {
+		pages[i] = gphys_to_page(gphys + i * PAGE_SIZE, vm->ept_pointer);
+		if (pages[i] == NULL) {
+			return -EFAULT;
+		}
+	}
+
+	ring_state_t *rs = kzalloc(sizeof(ring_state_t), GFP_KERNEL);
+	if (rs == NULL) {
+		return -ENOMEM;
+	}
+
+	// the guest pages live until the EPT is freed in destroy_vm()
+	rs->ring = vmap(pages, nr_pages, VM_MAP, PAGE_KERNEL);
+	if (rs->ring == NULL) {
+		kfree(rs);
+		return -ENOMEM;
+	}
+	rs->vm = vm;
+	rs->nr_pages = nr_pages;
+	rs->size = READ_ONCE(rs->ring->size);
+	if (!is_power_of_2(rs->size) ||
+	    struct_size(rs->ring, desc, rs->size) > nr_pages * PAGE_SIZE) {
+		ret = -EINVAL;
+		goto err;
+	}
+	rs->done = kcalloc(rs->size, sizeof(u8), GFP_KERNEL);
+	if (rs->done == NULL) {
+		ret = -ENOMEM;
+		goto err;
+	}
+	rs->next = READ_ONCE(rs->ring->head);
+	rs->tail = rs->next;
+	WRITE_ONCE(rs->ring->tail, rs->tail);
+	spin_lock_init(&rs->lock);
+	atomic_set(&rs->inflight, 0);
+	WRITE_ONCE(rs->ring->need_kick, 0);
+	rs->poll_ns = ring_poll_ns_start;
+	init_waitqueue_head(&rs->wq);
+
+	mutex_lock(&ring_mutex);
+	if (vm->ring != NULL) {
+		mutex_unlock(&ring_mutex);
+		ret = -EBUSY;
+		goto err;
+	}
+	rs->thread = kthread_run(ring_thread, rs, "tvisor-ring");
+	if (IS_ERR(rs->thread)) {
+		mutex_unlock(&ring_mutex);
+		ret = PTR_ERR(rs->thread);
+		goto err;
+	}
+	WRITE_ONCE(vm->ring, rs);
+	mutex_unlock(&ring_mutex);
+
+	pr_debug("tvisor: ring at %llx, %u descriptors\n", gphys, rs->size);
+	return 0;
+
+err:
+	kfree(rs->done);
+	vunmap(rs->ring);
+	kfree(rs);
+	return ret;
+}
+
+int unregister_ring(vm_state_t *vm)
+{
+	mutex_lock(&ring_mutex);
+	ring_state_t *rs = vm->ring;
+	if (rs == NULL) {
+		mutex_unlock(&ring_mutex);
+		return -ENOENT;
+	}
+	WRITE_ONCE(vm->ring, NULL);
+	mutex_unlock(&ring_mutex);
+
+	// kick_ring() runs with interrupts off
+	synchronize_rcu();
+	kthread_stop(rs->thread);
+	wait_var_event(&rs->inflight, atomic_read(&rs->inflight) == 0);
+	kfree(rs->done);
+	vunmap(rs->ring);
+	kfree(rs);
+	return 0;
+}
+
+// copy of the ring's counters, -ENOENT if the VM has no ring
+int get_ring_stats(vm_state_t *vm, ring_stats_t *stats, u32 *poll_ns)
+{
+	mutex_lock(&ring_mutex);
+	ring_state_t *rs = vm->ring;
+	if (rs != NULL) {
+		*stats = rs->stats;
+		*poll_ns = READ_ONCE(rs->poll_ns);
+	}
+	mutex_unlock(&ring_mutex);
+	return rs != NULL ? 0 : -ENOENT;
+}
+
+// TVISOR_HC_RING_KICK, interrupts are off
+void kick_ring(vm_state_t *vm)
+{
+	ring_state_t *rs = READ_ONCE(vm->ring);
+	if (rs == NULL) {
+		return;
+	}
+
+	rs->stats.kicks++;
+	WRITE_ONCE(rs->kicked, 1);
+	wake_up_interruptible(&rs->wq);
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <linux/atomic.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <linux/wait.h>
+
+#include "tvisor.h"
+
+struct _vm_state;
+struct task_struct;
+
+typedef struct _ring_stats {
+	u64 requests; // descriptors handled
+	u64 batches; // polls that found work
+	u64 sleeps; // times the thread gave up polling
+	u64 kicks; // TVISOR_HC_RING_KICK hypercalls
+} ring_stats_t;
+
+// host side of a guest's struct tvisor_ring
+typedef struct _ring_state {
+	struct _vm_state *vm;
+	struct tvisor_ring *ring; // vmap of the guest pages
+	int nr_pages;
+	u32 size; // copied at registration, the guest's copy is not trusted
+	u32 next; // next descriptor to start, only used by `thread`
+	spinlock_t lock; // protects tail and done, completions come from any context
+	u32 tail; // first descriptor that has not completed
+	u8 *done; // per slot: completed, but `tail` has not passed it yet
+	atomic_t inflight; // descriptors started but not completed
+	int broken; // the guest corrupted `head`, stop looking at it
+	struct task_struct *thread;
+	wait_queue_head_t wq;
+	int kicked;
+	u32 poll_ns; // current polling window
+	ring_stats_t stats;
+} ring_state_t;
+
+int register_ring(struct _vm_state *vm, u64 gphys, u64 nr_pages);
+int unregister_ring(struct _vm_state *vm);
+void kick_ring(struct _vm_state *vm);
+void complete_ring_desc(ring_state_t *rs, u32 slot, int status);
+int get_ring_stats(struct _vm_state *vm, ring_stats_t *stats, u32 *poll_ns);
@@ -0,0 +1,219 @@
+#include <asm/tsc.h> /* Needed for tsc_khz */
+#include <linux/anon_inodes.h> /* Needed for anon_inode_getfile */
+#include <linux/debugfs.h> /* Needed for debugfs_create_file */
+#include <linux/file.h> /* Needed for fd_install */
+#include <linux/fs.h> /* Needed for simple_read_from_buffer */
+#include <linux/percpu.h> /* Needed for per_cpu_ptr */
+#include <linux/seq_file.h> /* Needed for seq_printf */
+#include <linux/slab.h> /* Needed for kmalloc */
+
+#include "stats.h"
+#include "vm.h"
+
+// Counters are bumped without atomics: per vCPU by the one thread running
+// it, host-wide per CPU. Both views below add them up when read, as text
+// in debugfs (tvisor/vm<id>) and as binary records from the stats fd.
+
+DEFINE_PER_CPU(host_stats_t, host_stats);
+
+static struct dentry *debugfs_dir;
+
+static void sum_host_stats(host_stats_t *sum)
+{
+	int cpu;
+
+	sum->pages_allocated = 0;
+	sum->pages_freed = 0;
+	for_each_possible_cpu(cpu) {
+		host_stats_t *s = per_cpu_ptr(&host_stats, cpu);
+		sum->pages_allocated += READ_ONCE(s->pages_allocated);
+		sum->pages_freed += READ_ONCE(s->pages_freed);
+	}
+}
+
+static void get_vcpu_stats(vcpu_state_t *vcpu, struct tvisor_vcpu_stats *out)
+{
+	vcpu_stats_t *s = &vcpu->stats;
+	int r;
+
+	BUILD_BUG_ON(TVISOR_STATS_NR_EXIT_REASONS != VMX_NR_EXIT_REASONS);
+
+	memset(out, 0, sizeof(*out));
+	for (r = 0; r < VMX_NR_EXIT_REASONS; r++) {
+		out->exits_by_reason[r] = READ_ONCE(s->exits[r]);
+		out->exits += out->exits_by_reason[r];
+		out->fast_exits += READ_ONCE(vcpu->exit_stats.fast_exits[r]);
+	}
+	out->user_exits = READ_ONCE(s->user_exits);
+	out->run_cycles = READ_ONCE(s->run_cycles);
+	out->guest_cycles = READ_ONCE(s->guest_cycles);
+	out->ept_violations = READ_ONCE(s->ept_violations);
+	out->injected_events = READ_ONCE(s->injected_events);
+	out->halt_exits = READ_ONCE(vcpu->halt_stats.halt_exits);
+}
+
+static u64 avg(u64 sum, u64 n)
+{
+	return n ? sum / n : 0;
+}
+
+// halt polling, PLE, VMCS, FPU, MMIO and per-exit-reason timings of vCPU `i`
+static void show_vcpu_detail(struct seq_file *m, vcpu_state_t *vcpu, int i,
+			     const struct tvisor_vcpu_stats *s)
+{
+	halt_poll_stats_t *hs = &vcpu->halt_stats;
+	ple_stats_t *ps = &vcpu->ple_stats;
+	mmio_stats_t *ms = &vcpu->mmio.stats;
+	exit_stats_t *es = &vcpu->exit_stats;
+	int r;
+
+	seq_printf(m,
+		   "vcpu%d: halt poll: %lld/%lld successful, wakeups: %lld, "
+		   "poll ns: %u (success %lld, fail %lld)\n"
+		   "vcpu%d: ple exits: %lld, directed yield: %lld/%lld successful\n"
+		   "vcpu%d: vmcs setups: %lld, last took %lld cycles\n"
+		   "vcpu%d: guest fpu loads: %lld, xcr0: %llx\n"
+		   "vcpu%d: mmio exits: %lld, decode cache hits: %lld, to userspace: %lld\n",
+		   i, hs->successful_poll, hs->attempted_poll, hs->wakeups,
+		   vcpu->halt_poll_ns, hs->poll_success_ns, hs->poll_fail_ns, i,
+		   ps->ple_exits, ps->directed_yield_successful,
+		   ps->directed_yield_attempted, i, vcpu->nr_vmcs_setups,
+		   vcpu->vmcs_setup_cycles, i, vcpu->nr_guest_fpu_loads,
+		   vcpu->guest_xcr0, i, ms->exits, ms->cache_hits,
+		   ms->user_exits);
+	for (r = 0; r < VMX_NR_EXIT_REASONS; r++) {
+		if (s->exits_by_reason[r]) {
+			seq_printf(m,
+				   "vcpu%d: exit %d: %llu, fast %lld (%lld cycles), slow %lld (%lld cycles)\n",
+				   i, r, s->exits_by_reason[r],
+				   es->fast_exits[r],
+				   avg(es->fast_cycles[r], es->fast_exits[r]),
+				   es->slow_exits[r],
+				   avg(es->slow_cycles[r], es->slow_exits[r]));
+		}
+	}
+}
+
+static int vm_stats_show(struct seq_file *m, void *v)
+{
+	vm_state_t *vm = m->private;
+	int nr_vcpus = smp_load_acquire(&vm->nr_vcpus);
+	struct tvisor_vcpu_stats s;
+	host_stats_t hs;
+	int i;
+
+	sum_host_stats(&hs);
+	seq_printf(m, "tsc khz: %u\npages allocated: %llu, freed: %llu\n",
+		   tsc_khz, hs.pages_allocated, hs.pages_freed);
+	for (i = 0; i < nr_vcpus; i++) {
+		get_vcpu_stats(vm->vcpus[i], &s);
+		seq_printf(m,
+			   "vcpu%d: exits: %llu (fast %llu, to userspace %llu)\n"
+			   "vcpu%d: cycles: run %llu, guest %llu, host %llu\n"
+			   "vcpu%d: ept violations: %llu, injected: %llu, halts: %llu\n",
+			   i, s.exits, s.fast_exits, s.user_exits, i,
+			   s.run_cycles, s.guest_cycles,
+			   s.run_cycles > s.guest_cycles ?
+				   s.run_cycles - s.guest_cycles :
+				   0,
+			   i, s.ept_violations, s.injected_events,
+			   s.halt_exits);
+		show_vcpu_detail(m, vm->vcpus[i], i, &s);
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(vm_stats);
+
+void init_tvisor_stats(void)
+{
+	debugfs_dir = debugfs_create_dir("tvisor", NULL);
+}
+
+void exit_tvisor_stats(void)
+{
+	debugfs_remove(debugfs_dir);
+}
+
+void add_vm_stats(vm_state_t *vm)
+{
+	char name[16];
+
+	snprintf(name, sizeof(name), "vm%d", vm->id);
+	vm->debugfs =
+		debugfs_create_file(name, 0444, debugfs_dir, vm, &vm_stats_fops);
+}
+
+// waits for readers still in vm_stats_show()
+void remove_vm_stats(vm_state_t *vm)
+{
+	debugfs_remove(vm->debugfs);
+}
+
+// A fresh snapshot for every read at offset 0, so a scraper just preads
+// the whole thing each time.
+static ssize_t stats_fd_read(struct file *filp, char __user *ubuf,
+			     size_t count, loff_t *offset)
+{
+	vm_state_t *vm = filp->private_data;
+	struct tvisor_stats_header *header;
+	host_stats_t hs;
+	int i;
+
+	int nr_vcpus = smp_load_acquire(&vm->nr_vcpus);
+	size_t size = sizeof(*header) +
+		      nr_vcpus * sizeof(struct tvisor_vcpu_stats);
+	if (*offset >= size) {
+		return 0;
+	}
+	header = kmalloc(size, GFP_KERNEL);
+	if (header == NULL) {
+		return -ENOMEM;
+	}
+
+	sum_host_stats(&hs);
+	header->nr_vcpus = nr_vcpus;
+	header->tsc_khz = tsc_khz;
+	header->pages_allocated = hs.pages_allocated;
+	header->pages_freed = hs.pages_freed;
+	struct tvisor_vcpu_stats *vcpus = (void *)(header + 1);
+	for (i = 0; i < nr_vcpus; i++) {
+		get_vcpu_stats(vm->vcpus[i], &vcpus[i]);
+	}
+
+	ssize_t ret = simple_read_from_buffer(ubuf, count, offset, header, size);
+	kfree(header);
+	return ret;
+}
+
+static int stats_fd_release(struct inode *inode, struct file *filp)
+{
+	put_vm(filp->private_data);
+	return 0;
+}
+
+static const struct file_operations stats_fd_fops = {
+	.owner = THIS_MODULE,
+	.read = stats_fd_read,
+	.release = stats_fd_release,
+	.llseek = noop_llseek,
+};
+
+// TVISOR_GET_STATS_FD
+int create_stats_fd(vm_state_t *vm)
+{
+	int fd = get_unused_fd_flags(O_CLOEXEC);
+	if (fd < 0) {
+		return fd;
+	}
+
+	struct file *file = anon_inode_getfile("tvisor-stats", &stats_fd_fops,
+					       vm, O_RDONLY);
+	if (IS_ERR(file)) {
+		put_unused_fd(fd);
+		return PTR_ERR(file);
+	}
+	file->f_mode |= FMODE_PREAD;
+	get_vm(vm);
+	fd_install(fd, file);
+	return fd;
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <linux/percpu-defs.h>
+#include <linux/types.h>
+
+struct _vm_state;
+
+// host-wide counters, bumped with this_cpu_inc() and summed on read
+typedef struct _host_stats {
+	u64 pages_allocated; // guest RAM and EPT tables
+	u64 pages_freed;
+} host_stats_t;
+
+DECLARE_PER_CPU(host_stats_t, host_stats);
+
+void init_tvisor_stats(void);
+void exit_tvisor_stats(void);
+void add_vm_stats(struct _vm_state *vm);
+void remove_vm_stats(struct _vm_state *vm);
+int create_stats_fd(struct _vm_state *vm);
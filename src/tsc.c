@@ -0,0 +1,133 @@
+#include <asm/msr.h> /* Needed for rdtsc */
+#include <asm/tsc.h> /* Needed for tsc_khz */
+#include <linux/math64.h> /* Needed for mul_u64_u64_shr */
+#include <linux/spinlock.h> /* Needed for spin_lock */
+
+#include "tsc.h"
+#include "vm.h"
+#include "vmx.h"
+
+// All vCPUs of a VM share one TSC offset and multiplier:
+//   guest TSC = (host TSC * multiplier >> 48) + offset
+// so the guest reads a consistent TSC with plain RDTSC/RDTSCP. Userspace can
+// read and set the guest TSC and its frequency (to carry them across a
+// migration), vCPUs pick the new values up on their next VM entry.
+
+static u64 scale_tsc(u64 host_tsc, u64 multiplier)
+{
+	if (multiplier == VMX_TSC_MULTIPLIER_ONE) {
+		return host_tsc;
+	}
+	return mul_u64_u64_shr(host_tsc, multiplier, VMX_TSC_MULTIPLIER_SHIFT);
+}
+
+// the guest TSC starts at 0 and ticks at the host's rate
+void init_vm_tsc(vm_state_t *vm)
+{
+	spin_lock_init(&vm->tsc_lock);
+	vm->tsc_khz = tsc_khz;
+	vm->tsc_multiplier = VMX_TSC_MULTIPLIER_ONE;
+	vm->tsc_offset = -rdtsc();
+	vm->tsc_generation = 1;
+}
+
+// Change the guest TSC frequency without a jump in its value. Anything but
+// the host's frequency needs TSC scaling. `khz` 0 means the host's.
+int set_vm_tsc_khz(vm_state_t *vm, u32 khz)
+{
+	u64 multiplier = VMX_TSC_MULTIPLIER_ONE;
+
+	if (khz == 0) {
+		khz = tsc_khz;
+	}
+	if (khz != tsc_khz) {
+		if (!vmx_has_tsc_scaling()) {
+			return -EOPNOTSUPP;
+		}
+		multiplier = mul_u64_u32_div(VMX_TSC_MULTIPLIER_ONE, khz,
+					     tsc_khz);
+	}
+
+	spin_lock(&vm->tsc_lock);
+	u64 host_tsc = rdtsc();
+	u64 now = scale_tsc(host_tsc, vm->tsc_multiplier) + vm->tsc_offset;
+	vm->tsc_khz = khz;
+	vm->tsc_multiplier = multiplier;
+	vm->tsc_offset = now - scale_tsc(host_tsc, multiplier);
+	vm->tsc_generation++;
+	spin_unlock(&vm->tsc_lock);
+
+	return 0;
+}
+
+u64 read_guest_tsc(vm_state_t *vm)
+{
+	spin_lock(&vm->tsc_lock);
+	u64 tsc = scale_tsc(rdtsc(), vm->tsc_multiplier) + vm->tsc_offset;
+	spin_unlock(&vm->tsc_lock);
+	return tsc;
+}
+
+void write_guest_tsc(vm_state_t *vm, u64 tsc)
+{
+	spin_lock(&vm->tsc_lock);
+	vm->tsc_offset = tsc - scale_tsc(rdtsc(), vm->tsc_multiplier);
+	vm->tsc_generation++;
+	spin_unlock(&vm->tsc_lock);
+}
+
+// what the guest would read on `vcpu` at `host_tsc`
+u64 guest_tsc(vcpu_state_t *vcpu, u64 host_tsc)
+{
+	return scale_tsc(host_tsc, vcpu->tsc_multiplier) + vcpu->tsc_offset;
+}
+
+// Bring the VMCS up to date with the VM's TSC settings. Interrupts off,
+// VMCS of `vcpu` loaded.
+void refresh_vcpu_tsc(vcpu_state_t *vcpu)
+{
+	vm_state_t *vm = vcpu->vm;
+
+	if (READ_ONCE(vm->tsc_generation) == vcpu->tsc_generation) {
+		return;
+	}
+
+	spin_lock(&vm->tsc_lock);
+	u64 offset = vm->tsc_offset;
+	u64 multiplier = vm->tsc_multiplier;
+	vcpu->tsc_generation = vm->tsc_generation;
+	spin_unlock(&vm->tsc_lock);
+
+	if (offset != vcpu->tsc_offset) {
+		vmcs_write64(TSC_OFFSET, offset);
+		vcpu->tsc_offset = offset;
+	}
+	if (multiplier != vcpu->tsc_multiplier && vmx_has_tsc_scaling()) {
+		u32 secondary = vmcs_read32(SECONDARY_VM_EXEC_CONTROL);
+		if (multiplier == VMX_TSC_MULTIPLIER_ONE) {
+			secondary &= ~CPU_BASED_CTL2_TSC_SCALING;
+		} else {
+			secondary |= CPU_BASED_CTL2_TSC_SCALING;
+			vmcs_write64(TSC_MULTIPLIER, multiplier);
+		}
+		vmcs_write32(SECONDARY_VM_EXEC_CONTROL, secondary);
+		vcpu->tsc_multiplier = multiplier;
+	}
+}
+
+// RDTSC/RDTSCP exits, only taken in rdtsc_exiting mode
+int handle_rdtsc(vcpu_state_t *vcpu, int rdtscp)
+{
+	guest_regs_t *regs = &vcpu->guest_regs;
+	u64 tsc = guest_tsc(vcpu, rdtsc());
+
+	regs->rax = (u32)tsc;
+	regs->rdx = tsc >> 32;
+	if (rdtscp) {
+		u64 aux;
+		rdmsrl(MSR_TSC_AUX, aux); // not virtualized, as for native RDTSCP
+		regs->rcx = (u32)aux;
+	}
+	resume_to_next_instruction();
+	return 1;
+}
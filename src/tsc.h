@@ -0,0 +1,13 @@
+#pragma once
+
+#include <linux/types.h>
+
+#include "vm.h"
+
+void init_vm_tsc(vm_state_t *vm);
+int set_vm_tsc_khz(vm_state_t *vm, u32 khz);
+u64 read_guest_tsc(vm_state_t *vm);
+void write_guest_tsc(vm_state_t *vm, u64 tsc);
+u64 guest_tsc(vcpu_state_t *vcpu, u64 host_tsc);
+void refresh_vcpu_tsc(vcpu_state_t *vcpu);
+int handle_rdtsc(vcpu_state_t *vcpu, int rdtscp);
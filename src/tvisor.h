@@ -0,0 +1,467 @@
+#pragma once
+
+// ioctl interface of /dev/tvisor, shared with userspace
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define TVISOR_IOCTL_TYPE 0xAF
+
+// Bumped on incompatible changes to anything in this file.
+#define TVISOR_API_VERSION 1
+
+// ioctls on /dev/tvisor itself
+
+// returns TVISOR_API_VERSION
+#define TVISOR_GET_API_VERSION _IO(TVISOR_IOCTL_TYPE, 0x0c)
+// turn VMX operation on or off for the host; off fails with -EBUSY while
+// any VM exists
+#define TVISOR_ENABLE_VMX _IO(TVISOR_IOCTL_TYPE, 0x0d)
+#define TVISOR_DISABLE_VMX _IO(TVISOR_IOCTL_TYPE, 0x0e)
+// Create a VM as described by struct tvisor_vm_config and return an fd for
+// it. Every VM fd takes the VM ioctls below and mmap; read and poll give
+// its events as struct tvisor_event records. The VM goes away when the
+// last fd to it is closed.
+#define TVISOR_CREATE_VM _IOW(TVISOR_IOCTL_TYPE, 0x0a, struct tvisor_vm_config)
+
+// ioctls on a VM fd
+
+// add a vCPU to the VM, returns its id
+#define TVISOR_CREATE_VCPU _IO(TVISOR_IOCTL_TYPE, 0x0b)
+
+// Run vCPU `arg` on the calling thread until the guest needs userspace.
+// Returns 0 with the details in the vCPU's struct tvisor_run, or -EINTR if
+// a signal is pending.
+#define TVISOR_RUN _IO(TVISOR_IOCTL_TYPE, 0x00)
+
+// Replace or add entries of the VM's CPUID table; entries not mentioned
+// keep their values. An entry whose TVISOR_CPUID_FLAG_INDEXED differs from
+// the leaf's current entries replaces all of them. The table starts out as the host's CPUID with VMX
+// hidden, the hypervisor bit set and a flat topology of TVISOR_MAX_VCPUS.
+#define TVISOR_SET_CPUID _IOW(TVISOR_IOCTL_TYPE, 0x01, struct tvisor_cpuid)
+// Copy the VM's CPUID table out. Fails with -E2BIG and `nent` set to the
+// number of entries if `nent` is too small.
+#define TVISOR_GET_CPUID _IOWR(TVISOR_IOCTL_TYPE, 0x02, struct tvisor_cpuid)
+
+// Guest TSC frequency in kHz, `arg` 0 means the host's. Other frequencies
+// need TSC scaling, -EOPNOTSUPP without it. The guest TSC does not jump.
+#define TVISOR_SET_TSC_KHZ _IO(TVISOR_IOCTL_TYPE, 0x03)
+// returns the guest TSC frequency in kHz
+#define TVISOR_GET_TSC_KHZ _IO(TVISOR_IOCTL_TYPE, 0x04)
+// read or set the guest TSC, shared by all vCPUs
+#define TVISOR_GET_TSC _IOR(TVISOR_IOCTL_TYPE, 0x05, __u64)
+#define TVISOR_SET_TSC _IOW(TVISOR_IOCTL_TYPE, 0x06, __u64)
+
+// Back the VM's paravirtual block device with the host file `arg` (an fd),
+// once per VM. Writes fail with -EROFS unless the file is open for writing;
+// open it O_DIRECT for I/O that does not go through the host page cache.
+#define TVISOR_SET_BLK_FILE _IO(TVISOR_IOCTL_TYPE, 0x07)
+
+// Posted writes: guest writes to a registered MMIO range or OUTs to a
+// registered port range are appended to the coalesced ring and the guest
+// continues without an exit to userspace. Reads still exit as usual.
+#define TVISOR_REGISTER_COALESCED \
+	_IOW(TVISOR_IOCTL_TYPE, 0x08, struct tvisor_coalesced_zone)
+
+// Copy a flat binary or ELF64 image into guest RAM and point vCPU 0 at its
+// entry, before the vCPU first runs. See struct tvisor_load_image.
+#define TVISOR_LOAD_IMAGE \
+	_IOWR(TVISOR_IOCTL_TYPE, 0x09, struct tvisor_load_image)
+
+// Registers of a vCPU that is not running: as of its last exit, or as last
+// set. Set registers are loaded on the next TVISOR_RUN, through the run
+// page's `regs_dirty`. -EBUSY while the vCPU runs.
+#define TVISOR_GET_REGS _IOWR(TVISOR_IOCTL_TYPE, 0x0f, struct tvisor_vcpu_regs)
+#define TVISOR_SET_REGS _IOW(TVISOR_IOCTL_TYPE, 0x10, struct tvisor_vcpu_regs)
+// copy a userspace buffer into guest RAM, or zero a range of it
+#define TVISOR_WRITE_MEM _IOW(TVISOR_IOCTL_TYPE, 0x11, struct tvisor_mem_region)
+// post an event to vCPU `arg`, waking it up if it sits in HLT
+#define TVISOR_KICK _IO(TVISOR_IOCTL_TYPE, 0x12)
+// time VMREAD/VMWRITE on a vCPU that is not running
+#define TVISOR_BENCH_VMCS \
+	_IOWR(TVISOR_IOCTL_TYPE, 0x13, struct tvisor_vmcs_bench)
+// Return an fd that reads the guest's COM1 output, with poll.
+#define TVISOR_GET_CONSOLE_FD _IO(TVISOR_IOCTL_TYPE, 0x15)
+// Return an fd for scraping the VM's counters: every read at offset 0 takes
+// a fresh snapshot, struct tvisor_stats_header followed by `nr_vcpus`
+// struct tvisor_vcpu_stats. pread() it whole at offset 0.
+#define TVISOR_GET_STATS_FD _IO(TVISOR_IOCTL_TYPE, 0x16)
+// Run a vector of VM ioctls in one call, see struct tvisor_batch. Returns
+// how many ran; each one's return value is in its `result`.
+#define TVISOR_BATCH _IOWR(TVISOR_IOCTL_TYPE, 0x14, struct tvisor_batch)
+// Sample guest RIP and CR3 of every vCPU, see struct tvisor_profile.
+// -EOPNOTSUPP without the VMX preemption timer.
+#define TVISOR_SET_PROFILE _IOW(TVISOR_IOCTL_TYPE, 0x17, struct tvisor_profile)
+// Return an fd that reads the samples so far as folded stacks, one
+// "vcpu<id>;cr3_<cr3>;0x<rip> <count>" line per address, ready for
+// flamegraph.pl; "vcpu<id>;[lost]" counts samples dropped on a full buffer.
+// Every read at offset 0 takes a fresh snapshot, pread() works as well.
+#define TVISOR_GET_PROFILE_FD _IO(TVISOR_IOCTL_TYPE, 0x18)
+// Time VM exit round trips with built-in guest payloads on vCPU 0, see
+// struct tvisor_exit_bench. Takes over guest RAM below 2 MiB and vCPU 0,
+// which must not have run yet: use a fresh VM.
+#define TVISOR_BENCH_EXITS \
+	_IOWR(TVISOR_IOCTL_TYPE, 0x19, struct tvisor_exit_bench)
+// Drive the block device through the ring from a built-in guest payload on
+// vCPU 0, see struct tvisor_blk_bench. Needs TVISOR_SET_BLK_FILE and no
+// ring registered; takes over guest RAM below 8 MiB and vCPU 0, which must
+// not have run yet: use a fresh VM.
+#define TVISOR_BENCH_BLK _IOWR(TVISOR_IOCTL_TYPE, 0x1a, struct tvisor_blk_bench)
+
+// Each vCPU has a `struct tvisor_run` page, mmap it from the VM fd at
+// offset `vcpu id * TVISOR_RUN_MMAP_SIZE`. The kernel fills it in before
+// TVISOR_RUN returns, userspace fills in the emulation result before the
+// next TVISOR_RUN.
+#define TVISOR_RUN_MMAP_SIZE 4096
+// the coalesced ring (struct tvisor_coalesced_ring) is one page at this
+// offset
+#define TVISOR_COALESCED_MMAP_OFFSET (64 * TVISOR_RUN_MMAP_SIZE)
+
+// tvisor_run.exit_reason
+#define TVISOR_EXIT_UNKNOWN 0 // see vmx_exit_reason/exit_qualification
+#define TVISOR_EXIT_IO 1 // port I/O, complete it through `io`
+#define TVISOR_EXIT_SHUTDOWN 2 // triple fault
+#define TVISOR_EXIT_FAIL_ENTRY 3 // VM entry failed
+#define TVISOR_EXIT_INTR 4 // interrupted by a signal or immediate_exit
+#define TVISOR_EXIT_MMIO 5 // access outside guest RAM, complete it through `mmio`
+
+#define TVISOR_EXIT_IO_IN 0
+#define TVISOR_EXIT_IO_OUT 1
+
+// Hypercalls: the guest puts the number in RAX and arguments in RBX, RCX,
+// RDX, RSI, executes VMCALL, and gets the result back in RAX.
+#define TVISOR_HC_NOP 0 // returns 0
+// RBX = guest-physical address of a page aligned struct tvisor_ring,
+// RCX = number of pages it spans (at most TVISOR_RING_MAX_PAGES). Returns 0
+// or a negative errno. One ring per VM.
+#define TVISOR_HC_RING_REGISTER 1
+#define TVISOR_HC_RING_UNREGISTER 2
+// wake the host side of the ring up after it set `need_kick`
+#define TVISOR_HC_RING_KICK 3
+// size of the block device in bytes, or -ENODEV without one
+#define TVISOR_HC_BLK_CAPACITY 4
+// post a wakeup to the calling vCPU, its next HLT returns at once
+#define TVISOR_HC_WAKE_SELF 5
+
+#define TVISOR_HC_ENOSYS ((__u64)-1000) // unknown hypercall number
+
+#define TVISOR_MAX_CPUID_ENTRIES 256
+
+#define TVISOR_CPUID_FLAG_INDEXED 1 // `index` (ECX) selects the entry
+
+struct tvisor_cpuid_entry {
+	__u32 function; // EAX
+	__u32 index; // ECX, 0 unless TVISOR_CPUID_FLAG_INDEXED
+	__u32 flags;
+	__u32 eax;
+	__u32 ebx;
+	__u32 ecx;
+	__u32 edx;
+	__u32 padding;
+};
+
+struct tvisor_cpuid {
+	__u32 nent;
+	__u32 padding;
+	struct tvisor_cpuid_entry entries[];
+};
+
+// Exitless guest->host ring in guest RAM. The guest fills desc[head % size]
+// and then bumps `head`; a host thread polls `head`, starts the requests in
+// order, sets their `status` as they complete and moves `tail` past every
+// completed descriptor. A descriptor may be reused once `tail` passed it.
+// When the host has been idle for a while it sets `need_kick` and sleeps; a
+// guest that sees `need_kick` after publishing `head` (with a full barrier
+// in between) issues TVISOR_HC_RING_KICK.
+#define TVISOR_RING_MAX_PAGES 16
+
+#define TVISOR_RING_OP_NOP 0
+// Block device: `len` bytes at byte `offset` of the device from/to the
+// guest-physical buffer at `addr`. `offset` and `len` are multiples of
+// TVISOR_BLK_SECTOR_SIZE, `len` at most TVISOR_BLK_MAX_LEN. Requests
+// complete out of order, `tail` only passes a descriptor once it completed.
+// FLUSH makes the writes completed so far durable.
+#define TVISOR_RING_OP_BLK_READ 1
+#define TVISOR_RING_OP_BLK_WRITE 2
+#define TVISOR_RING_OP_BLK_FLUSH 3
+
+#define TVISOR_BLK_SECTOR_SIZE 512
+#define TVISOR_BLK_MAX_LEN (1 << 20)
+
+struct tvisor_ring_desc {
+	__u64 addr; // guest-physical buffer, depends on `op`
+	__u32 len;
+	__u16 op; // TVISOR_RING_OP_*
+	__s16 status; // set by the host: 0 or a negative errno
+	__u64 user_data; // not touched by the host
+	__u64 offset; // depends on `op`
+};
+
+struct tvisor_ring {
+	__u32 size; // number of descriptors, a power of two, fixed at registration
+	__u32 padding1[15];
+	__u32 head; // written by the guest
+	__u32 padding2[15];
+	__u32 tail; // written by the host
+	__u32 need_kick; // written by the host
+	__u32 padding3[14];
+	struct tvisor_ring_desc desc[];
+};
+
+#define TVISOR_IMAGE_FLAT 0
+#define TVISOR_IMAGE_ELF64 1 // PT_LOAD segments go to their p_paddr
+
+// identity-mapped page tables for the first TVISOR_LOAD_PT_MAP_GIB GiB with
+// 2 MiB pages take TVISOR_LOAD_PT_PAGES pages
+#define TVISOR_LOAD_PT_MAP_GIB 4
+#define TVISOR_LOAD_PT_PAGES (2 + TVISOR_LOAD_PT_MAP_GIB)
+
+struct tvisor_load_image {
+	__u64 image; // userspace address of the whole image, e.g. an mmap
+	__u64 size;
+	__u32 format; // TVISOR_IMAGE_*
+	__u32 padding;
+	__u64 load_addr; // FLAT: guest-physical address to load at
+	__u64 entry; // FLAT: entry RIP; ELF64: set to e_entry
+	__u64 stack; // initial RSP, 0 keeps it
+	// guest-physical address of TVISOR_LOAD_PT_PAGES pages for page
+	// tables, 0 keeps the built-in ones, written over 0x1000-0x4fff at
+	// first entry
+	__u64 page_tables;
+};
+
+#define TVISOR_COALESCED_MAX_ZONES 16
+
+struct tvisor_coalesced_zone {
+	__u64 addr; // guest-physical address or port
+	__u32 size;
+	__u32 pio; // 1 for a port range
+};
+
+struct tvisor_coalesced_entry {
+	__u64 addr;
+	__u32 len;
+	__u32 pio;
+	__u64 data;
+};
+
+// The kernel appends at `last`, userspace consumes from `first`, both
+// modulo TVISOR_COALESCED_MAX. When the ring is full writes exit to
+// userspace as usual, so userspace must drain the ring before it handles
+// any exit to keep the device writes in order.
+struct tvisor_coalesced_ring {
+	__u32 first; // written by userspace
+	__u32 last; // written by the kernel
+	__u32 padding[4];
+	struct tvisor_coalesced_entry entries[];
+};
+
+#define TVISOR_COALESCED_MAX                                  \
+	((4096 - sizeof(struct tvisor_coalesced_ring)) / \
+	 sizeof(struct tvisor_coalesced_entry))
+
+// same layout as the kernel's guest_regs_t, followed by RIP and RFLAGS
+struct tvisor_regs {
+	__u64 rax;
+	__u64 rcx;
+	__u64 rdx;
+	__u64 rbx;
+	__u64 rsp;
+	__u64 rbp;
+	__u64 rsi;
+	__u64 rdi;
+	__u64 r8;
+	__u64 r9;
+	__u64 r10;
+	__u64 r11;
+	__u64 r12;
+	__u64 r13;
+	__u64 r14;
+	__u64 r15;
+	__u64 rip;
+	__u64 rflags;
+};
+
+struct tvisor_vm_config {
+	__u64 mem_size; // guest RAM from address 0, whole MiB, 0 = 256 MiB
+	__u32 nr_vcpus; // 0 = 1
+	__u32 flags; // must be 0
+};
+
+struct tvisor_vcpu_regs {
+	__u32 vcpu;
+	__u32 padding;
+	struct tvisor_regs regs;
+};
+
+#define TVISOR_MEM_ZERO (1 << 0) // zero the range, `addr` is unused
+
+struct tvisor_mem_region {
+	__u64 guest_phys;
+	__u64 size;
+	__u64 addr; // userspace buffer
+	__u32 flags; // TVISOR_MEM_*
+	__u32 padding;
+};
+
+struct tvisor_vmcs_bench {
+	__u32 vcpu;
+	__u32 iterations; // 0 = 100000
+	__u64 read_cycles; // out, per access
+	__u64 write_cycles;
+	__u64 checked_read_cycles;
+};
+
+// exit types of TVISOR_BENCH_EXITS, the guest loops on
+#define TVISOR_BENCH_CPUID 0 // CPUID leaf 0
+#define TVISOR_BENCH_VMCALL 1 // TVISOR_HC_NOP
+#define TVISOR_BENCH_HLT 2 // after TVISOR_HC_WAKE_SELF, untimed
+#define TVISOR_BENCH_PIO 3 // OUT to the COM1 scratch register
+#define TVISOR_BENCH_MSR 4 // RDMSR of IA32_MISC_ENABLE
+// EPT violation, MOV from an in-kernel device on the page right above RAM;
+// -ENOSPC unless RAM ends below 4 GiB
+#define TVISOR_BENCH_MMIO 5
+#define TVISOR_BENCH_NR_EXITS 6
+
+#define TVISOR_BENCH_MAX_ITERATIONS 65536
+
+// Round trips are timed by the guest with RDTSC around the exiting
+// instruction, in guest TSC cycles. `host_cycles` is what the host spent
+// per exit between the exit and the next entry, by its own TSC; for
+// TVISOR_BENCH_HLT that includes the TVISOR_HC_WAKE_SELF exit.
+struct tvisor_exit_bench_result {
+	__u64 min;
+	__u64 median;
+	__u64 p99;
+	__u64 host_cycles; // average
+};
+
+struct tvisor_exit_bench {
+	__u32 iterations; // per exit type, 0 = 10000
+	__u32 types; // 1 << TVISOR_BENCH_*, 0 = all
+	struct tvisor_exit_bench_result results[TVISOR_BENCH_NR_EXITS]; // out
+};
+
+#define TVISOR_BENCH_BLK_MAX_DEPTH 64
+#define TVISOR_BENCH_BLK_MAX_SIZE (64 << 10)
+
+// The guest publishes `depth` requests of `block_size` bytes at a time,
+// reading or writing the device front to back and wrapping around, and
+// spins on `tail` until all of them completed; adjacent requests may be
+// merged. Latency is per batch, timed by the guest with RDTSC from the
+// `head` update to `tail` passing it, in guest TSC cycles.
+struct tvisor_blk_bench {
+	__u32 iterations; // batches, 0 = 10000
+	__u32 depth; // requests per batch, 0 = 1
+	__u32 block_size; // whole sectors, 0 = 4096
+	__u32 op; // TVISOR_RING_OP_BLK_READ or TVISOR_RING_OP_BLK_WRITE
+	__u64 iops; // out, requests per second by the host clock
+	__u64 min; // out
+	__u64 median; // out
+	__u64 p99; // out
+	__u64 host_latency_ns; // out, average per request as the device saw it
+};
+
+// One VM ioctl: `cmd` and `arg` as they would be passed to ioctl(2).
+// TVISOR_RUN, TVISOR_BENCH_EXITS, TVISOR_BENCH_BLK and TVISOR_BATCH itself
+// are refused with -EINVAL.
+struct tvisor_batch_op {
+	__u32 cmd;
+	__s32 result; // out, what the ioctl returned
+	__u64 arg;
+};
+
+#define TVISOR_BATCH_MAX 256
+#define TVISOR_BATCH_CONTINUE (1 << 0) // keep going after a failed op
+
+// Ops run in order and stop at the first failure unless
+// TVISOR_BATCH_CONTINUE is set.
+struct tvisor_batch {
+	__u32 nr; // at most TVISOR_BATCH_MAX
+	__u32 flags; // TVISOR_BATCH_*
+	__u64 ops; // userspace address of struct tvisor_batch_op[nr]
+};
+
+#define TVISOR_PROFILE_MAX_FREQUENCY 10000
+#define TVISOR_PROFILE_RESET (1 << 0) // drop the samples so far
+
+// Samples are taken while the guest runs, not while it sits in HLT or
+// waits for userspace.
+struct tvisor_profile {
+	__u32 frequency; // samples per second of guest time, 0 stops
+	__u32 flags; // TVISOR_PROFILE_*
+};
+
+#define TVISOR_EVENT_LOST 0 // `data` events were dropped, the queue was full
+#define TVISOR_EVENT_HALT 1 // vCPU went to sleep in HLT
+#define TVISOR_EVENT_SHUTDOWN 2 // triple fault, `data` is the guest RIP
+// new console output, `data` bytes buffered; no more of these until this
+// one is read
+#define TVISOR_EVENT_CONSOLE 3
+
+struct tvisor_event {
+	__u32 type; // TVISOR_EVENT_*
+	__u32 vcpu;
+	__u64 data;
+	__u64 timestamp_ns; // CLOCK_MONOTONIC
+};
+
+#define TVISOR_STATS_NR_EXIT_REASONS 66 // basic VMX exit reasons
+
+struct tvisor_stats_header {
+	__u32 nr_vcpus;
+	__u32 tsc_khz; // host TSC, all cycles below count it
+	__u64 pages_allocated; // guest RAM and EPT pages, by all VMs
+	__u64 pages_freed;
+};
+
+struct tvisor_vcpu_stats {
+	__u64 exits;
+	__u64 fast_exits; // resumed without leaving the exit handler
+	__u64 user_exits; // returned to userspace
+	__u64 run_cycles; // inside TVISOR_RUN
+	__u64 guest_cycles; // in guest mode; the rest of run_cycles is host
+	__u64 ept_violations;
+	__u64 injected_events; // exceptions and interrupts injected
+	__u64 halt_exits;
+	__u64 exits_by_reason[TVISOR_STATS_NR_EXIT_REASONS];
+};
+
+struct tvisor_run {
+	// in
+	__u8 immediate_exit; // return -EINTR instead of entering the guest
+	__u8 regs_dirty; // load `regs` into the vCPU on the next run
+	__u8 padding1[6];
+
+	// out
+	__u32 exit_reason; // TVISOR_EXIT_*
+	__u32 vmx_exit_reason; // basic VMX exit reason
+	__u64 exit_qualification;
+	struct tvisor_regs regs; // guest registers at the exit
+
+	union {
+		// TVISOR_EXIT_IO: for IN, userspace stores the value read in
+		// `data` and the kernel moves it to the guest on the next run
+		struct {
+			__u8 direction; // TVISOR_EXIT_IO_*
+			__u8 size; // 1, 2 or 4
+			__u16 port;
+			__u32 padding;
+			__u64 data;
+		} io;
+		// TVISOR_EXIT_MMIO: for reads, userspace stores the value read
+		// in `data` and the kernel moves it to the guest on the next run
+		struct {
+			__u64 phys_addr;
+			__u64 data;
+			__u8 len; // 1, 2, 4 or 8
+			__u8 is_write;
+			__u8 padding[6];
+		} mmio;
+		// TVISOR_EXIT_FAIL_ENTRY
+		struct {
+			__u64 vm_instruction_error;
+		} fail_entry;
+		char padding2[256];
+	};
+};
@@ -0,0 +1,256 @@
+#include <asm/processor-flags.h> /* Needed for X86_EFLAGS_DF */
+#include <linux/minmax.h> /* Needed for min_t */
+#include <linux/printk.h> /* Needed for pr_debug */
+#include <linux/serial_reg.h> /* Needed for UART_LSR etc */
+
+#include "mem.h"
+#include "uart.h"
+#include "vm.h"
+#include "vmx.h"
+
+// Console output is buffered in the kernel. A byte written by OUT, or a
+// whole REP OUTSB, costs one exit that never leaves the run loop, and
+// userspace reads the console in large chunks whenever it likes.
+
+#define UART_BUF_SIZE (64 * 1024)
+#define UART_MAX_OUTS 16384 // bytes per OUTSB exit, the rest re-executes
+
+int init_uart(uart_state_t *uart)
+{
+	spin_lock_init(&uart->lock);
+	mutex_init(&uart->read_lock);
+	init_waitqueue_head(&uart->wq);
+	uart->lcr = UART_LCR_WLEN8;
+	uart->dll = 0x0c; // 9600 baud
+	return kfifo_alloc(&uart->out, UART_BUF_SIZE, GFP_KERNEL);
+}
+
+void free_uart(uart_state_t *uart)
+{
+	kfifo_free(&uart->out);
+}
+
+// `uart->lock` held
+static void uart_tx(uart_state_t *uart, const u8 *buf, u32 len)
+{
+	u32 n = kfifo_in(&uart->out, buf, len);
+	uart->stats.tx_bytes += len;
+	uart->stats.dropped += len - n;
+}
+
+static void wake_uart_readers(vcpu_state_t *vcpu, uart_state_t *uart)
+{
+	if (wq_has_sleeper(&uart->wq)) {
+		wake_up_interruptible(&uart->wq);
+	}
+	post_event(&vcpu->vm->events, TVISOR_EVENT_CONSOLE, vcpu->id,
+		   kfifo_len(&uart->out));
+}
+
+// `uart->lock` held
+static u8 uart_read_reg(uart_state_t *uart, u16 offset)
+{
+	int dlab = uart->lcr & UART_LCR_DLAB;
+
+	switch (offset) {
+	case UART_RX:
+		return dlab ? uart->dll : 0; // nothing to receive
+	case UART_IER:
+		return dlab ? uart->dlm : uart->ier;
+	case UART_IIR: {
+		u8 iir = uart->ier & UART_IER_THRI ? UART_IIR_THRI :
+						     UART_IIR_NO_INT;
+		if (uart->fcr & UART_FCR_ENABLE_FIFO) {
+			iir |= 0xc0; // FIFOs enabled
+		}
+		return iir;
+	}
+	case UART_LCR:
+		return uart->lcr;
+	case UART_MCR:
+		return uart->mcr;
+	case UART_LSR:
+		return UART_LSR_THRE | UART_LSR_TEMT; // always ready to send
+	case UART_MSR:
+		if (uart->mcr & UART_MCR_LOOP) {
+			u8 msr = 0;
+			msr |= uart->mcr & UART_MCR_DTR ? UART_MSR_DSR : 0;
+			msr |= uart->mcr & UART_MCR_RTS ? UART_MSR_CTS : 0;
+			msr |= uart->mcr & UART_MCR_OUT1 ? UART_MSR_RI : 0;
+			msr |= uart->mcr & UART_MCR_OUT2 ? UART_MSR_DCD : 0;
+			return msr;
+		}
+		return UART_MSR_DCD | UART_MSR_DSR | UART_MSR_CTS;
+	case UART_SCR:
+		return uart->scr;
+	}
+	return 0xff;
+}
+
+// `uart->lock` held
+static void uart_write_reg(uart_state_t *uart, u16 offset, u8 value)
+{
+	int dlab = uart->lcr & UART_LCR_DLAB;
+
+	switch (offset) {
+	case UART_TX:
+		if (dlab) {
+			uart->dll = value;
+		} else {
+			uart_tx(uart, &value, 1);
+		}
+		break;
+	case UART_IER:
+		if (dlab) {
+			uart->dlm = value;
+		} else {
+			uart->ier = value & 0x0f;
+		}
+		break;
+	case UART_FCR:
+		uart->fcr = value & UART_FCR_ENABLE_FIFO;
+		break;
+	case UART_LCR:
+		uart->lcr = value;
+		break;
+	case UART_MCR:
+		uart->mcr = value & 0x1f;
+		break;
+	case UART_SCR:
+		uart->scr = value;
+		break;
+	default: // LSR and MSR are read-only
+		break;
+	}
+}
+
+// (REP) OUTSB to THR. Assumes a 64-bit address size and a zero DS base,
+// which is what a 64-bit guest has. Returns 0, or -EFAULT if guest memory
+// could not be read.
+static int uart_outs(vcpu_state_t *vcpu, uart_state_t *uart, int rep)
+{
+	guest_regs_t *regs = &vcpu->guest_regs;
+	u64 count = rep ? regs->rcx : 1;
+	int down = vmcs_readl(GUEST_RFLAGS) & X86_EFLAGS_DF;
+	u8 buf[256];
+	u64 done = 0;
+	int ret = 0;
+
+	spin_lock(&uart->lock);
+	while (done < count && done < UART_MAX_OUTS) {
+		// backwards is pointless for a console, just go byte by byte
+		u32 n = down ? 1 : min_t(u64, count - done, sizeof(buf));
+		if (read_guest_virt(vcpu, regs->rsi, buf, n)) {
+			ret = -EFAULT;
+			break;
+		}
+		uart_tx(uart, buf, n);
+		regs->rsi += down ? -(u64)n : n;
+		done += n;
+	}
+	uart->stats.string_exits++;
+	spin_unlock(&uart->lock);
+
+	if (rep) {
+		regs->rcx -= done;
+	}
+	if (ret == 0 && (!rep || regs->rcx == 0)) {
+		resume_to_next_instruction();
+	}
+	return ret;
+}
+
+// Port I/O exit on COM1, interrupts off. Returns VMEXIT_STOP for what the
+// UART does not support.
+int handle_uart_io(vcpu_state_t *vcpu, u64 qualification)
+{
+	uart_state_t *uart = &vcpu->vm->uart;
+	u8 size = (qualification & 0x7) + 1;
+	int in = qualification & 0x8;
+	u16 offset = (u16)(qualification >> 16) - UART_BASE;
+
+	if (qualification & 0x10) {
+		if (in || size != 1 || offset != UART_TX ||
+		    (uart->lcr & UART_LCR_DLAB)) {
+			vcpu->run->exit_reason = TVISOR_EXIT_UNKNOWN;
+			return VMEXIT_STOP;
+		}
+		if (uart_outs(vcpu, uart, qualification & 0x20)) {
+			pr_debug("tvisor: outsb from unmapped memory\n");
+			vcpu->run->exit_reason = TVISOR_EXIT_UNKNOWN;
+			return VMEXIT_STOP;
+		}
+		wake_uart_readers(vcpu, uart);
+		return VMEXIT_RESUME;
+	}
+
+	// wider accesses only touch the register they name
+	spin_lock(&uart->lock);
+	if (in) {
+		u64 mask = size == 1 ? 0xff : size == 2 ? 0xffff : 0xffffffff;
+		u64 value = uart_read_reg(uart, offset);
+		if (size == 4) {
+			vcpu->guest_regs.rax = value; // zero-extends into RAX
+		} else {
+			vcpu->guest_regs.rax = (vcpu->guest_regs.rax & ~mask) |
+					       value;
+		}
+	} else {
+		uart_write_reg(uart, offset, (u8)vcpu->guest_regs.rax);
+	}
+	spin_unlock(&uart->lock);
+
+	if (!in && offset == UART_TX) {
+		wake_uart_readers(vcpu, uart);
+	}
+	resume_to_next_instruction();
+	return VMEXIT_RESUME;
+}
+
+// Copy buffered console output to userspace. Blocks until there is some
+// unless `nonblock`.
+ssize_t read_uart(uart_state_t *uart, char __user *buf, size_t count,
+		  int nonblock)
+{
+	unsigned int copied;
+	int ret;
+
+	if (count == 0) {
+		return 0;
+	}
+	for (;;) {
+		if (mutex_lock_interruptible(&uart->read_lock)) {
+			return -ERESTARTSYS;
+		}
+		if (!kfifo_is_empty(&uart->out)) {
+			break;
+		}
+		mutex_unlock(&uart->read_lock);
+		if (nonblock) {
+			return -EAGAIN;
+		}
+		if (wait_event_interruptible(uart->wq,
+					     !kfifo_is_empty(&uart->out))) {
+			return -ERESTARTSYS;
+		}
+	}
+
+	// the only reader, so no lock against the vCPUs writing
+	ret = kfifo_to_user(&uart->out, buf, count, &copied);
+	mutex_unlock(&uart->read_lock);
+	return ret ? ret : copied;
+}
+
+__poll_t poll_uart(uart_state_t *uart, struct file *filp, poll_table *wait)
+{
+	poll_wait(filp, &uart->wq, wait);
+	return kfifo_is_empty(&uart->out) ? 0 : EPOLLIN | EPOLLRDNORM;
+}
+
+void get_uart_stats(uart_state_t *uart, uart_stats_t *stats)
+{
+	unsigned long flags;
+	spin_lock_irqsave(&uart->lock, flags);
+	*stats = uart->stats;
+	spin_unlock_irqrestore(&uart->lock, flags);
+}
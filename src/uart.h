@@ -0,0 +1,49 @@
+#pragma once
+
+#include <linux/kfifo.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <linux/wait.h>
+
+struct _vcpu_state;
+struct file;
+
+#define UART_BASE 0x3f8 // COM1
+#define UART_NR_PORTS 8
+
+typedef struct _uart_stats {
+	u64 tx_bytes; // written by the guest
+	u64 dropped; // lost because userspace did not keep up
+	u64 string_exits; // OUTSB exits, each moving many bytes
+} uart_stats_t;
+
+// 16550 on COM1. Output goes to `out` and is read from the console fd;
+// there is no input and no interrupt, the guest polls LSR.
+typedef struct _uart_state {
+	spinlock_t lock; // protects the registers, stats and writes to `out`
+	u8 ier;
+	u8 fcr;
+	u8 lcr;
+	u8 mcr;
+	u8 scr;
+	u8 dll;
+	u8 dlm;
+	uart_stats_t stats;
+	DECLARE_KFIFO_PTR(out, u8);
+	struct mutex read_lock; // one reader drains `out` at a time
+	wait_queue_head_t wq;
+} uart_state_t;
+
+int init_uart(uart_state_t *uart);
+void free_uart(uart_state_t *uart);
+static inline int is_uart_port(u16 port)
+{
+	return port >= UART_BASE && port < UART_BASE + UART_NR_PORTS;
+}
+int handle_uart_io(struct _vcpu_state *vcpu, u64 qualification);
+ssize_t read_uart(uart_state_t *uart, char __user *buf, size_t count,
+		  int nonblock);
+__poll_t poll_uart(uart_state_t *uart, struct file *filp, poll_table *wait);
+void get_uart_stats(uart_state_t *uart, uart_stats_t *stats);
@@ -1,132 +1,691 @@
-#include <linux/cpumask.h> /* Needed for cpumask_* */
+#include <asm/msr.h> /* Needed for rdtsc_ordered */
+#include <linux/cpumask.h> /* Needed for cpumask_of, alloc_cpumask_var */
+#include <linux/interrupt.h> /* Needed for local_softirq_pending */
+#include <linux/ktime.h> /* Needed for ktime_get */
 #include <linux/mm.h> /* Needed for page_address */
+#include <linux/moduleparam.h> /* Needed for module_param */
+#include <linux/preempt.h> /* Needed for preempt_disable */
 #include <linux/printk.h> /* Needed for printk */
+#include <linux/rcupdate.h> /* Needed for rcu_read_lock */
+#include <linux/sched.h> /* Needed for cond_resched, yield_to */
+#include <linux/sched/signal.h> /* Needed for signal_pending */
+#include <linux/sched/task.h> /* Needed for get_task_struct */
+#include <linux/sizes.h> /* Needed for SZ_1M */
 #include <linux/slab.h> /* Needed for kmalloc */
-#include <linux/smp.h> /* Needed for on_each_cpu_mask */
-
+#include <linux/smp.h> /* Needed for smp_processor_id */
+
+#include "fpu.h"
+#include "pmu.h"
+#include "profile.h"
+#include "handler.h"
+#include "ring.h"
+#include "stats.h"
+#include "tsc.h"
 #include "vm.h"
 
-struct tvisor_state {
-	int is_virtualization_ready;
-	int is_vmx_enabled;
-};
+static uint preemption_timer_quantum_us = 1000;
+module_param(preemption_timer_quantum_us, uint, 0644);
+MODULE_PARM_DESC(preemption_timer_quantum_us,
+		 "guest time slice in microseconds before the CPU is given "
+		 "back to the host scheduler (0 = never)");
+
+static bool rdtsc_exiting;
+module_param(rdtsc_exiting, bool, 0644);
+MODULE_PARM_DESC(rdtsc_exiting,
+		 "trap and emulate RDTSC/RDTSCP in vCPUs set up from now on, "
+		 "for debugging");
+
+static uint halt_poll_ns = 200000;
+module_param(halt_poll_ns, uint, 0644);
+MODULE_PARM_DESC(halt_poll_ns, "maximum time to poll on HLT before sleeping");
+
+static uint halt_poll_ns_grow = 2;
+module_param(halt_poll_ns_grow, uint, 0644);
+MODULE_PARM_DESC(halt_poll_ns_grow, "factor to grow the polling window by");
+
+static uint halt_poll_ns_grow_start = 10000;
+module_param(halt_poll_ns_grow_start, uint, 0644);
+MODULE_PARM_DESC(halt_poll_ns_grow_start, "first non-zero polling window");
+
+static uint halt_poll_ns_shrink;
+module_param(halt_poll_ns_shrink, uint, 0644);
+MODULE_PARM_DESC(halt_poll_ns_shrink,
+		 "factor to shrink the polling window by (0 = reset)");
+
+static uint ple_gap = 128;
+module_param(ple_gap, uint, 0444);
+MODULE_PARM_DESC(ple_gap, "max TSC cycles between two PAUSEs of one spin loop "
+			  "(0 = disable PAUSE-loop exiting)");
+
+static uint ple_window = 4096;
+module_param(ple_window, uint, 0444);
+MODULE_PARM_DESC(ple_window, "TSC cycles a guest may spin before it exits");
+
+static void grow_halt_poll_ns(vcpu_state_t *vcpu)
+{
+	u64 val = (u64)vcpu->halt_poll_ns * halt_poll_ns_grow;
+	if (val < halt_poll_ns_grow_start) {
+		val = halt_poll_ns_grow_start;
+	}
+	if (val > halt_poll_ns) {
+		val = halt_poll_ns;
+	}
+	vcpu->halt_poll_ns = (u32)val;
+}
+
+static void shrink_halt_poll_ns(vcpu_state_t *vcpu)
+{
+	u32 val = 0;
+	if (halt_poll_ns_shrink) {
+		val = vcpu->halt_poll_ns / halt_poll_ns_shrink;
+	}
+	if (val < halt_poll_ns_grow_start) {
+		val = 0;
+	}
+	vcpu->halt_poll_ns = val;
+}
+
+static int has_pending_event(vcpu_state_t *vcpu)
+{
+	return atomic_read(&vcpu->pending_events) != 0;
+}
+
+// Block a halted vCPU until kick_vcpu() posts an event. Poll for a while
+// first; the window grows while short halts end inside it and shrinks
+// when we end up sleeping past the maximum anyway.
+// Returns 0 when an event arrived, -EINTR if a signal cut the wait short.
+static int halt_vcpu(vcpu_state_t *vcpu)
+{
+	ktime_t start = ktime_get();
+	ktime_t cur = start;
+	int polled = 0;
+	int err = 0;
+
+	vcpu->halt_stats.halt_exits++;
+
+	if (vcpu->halt_poll_ns) {
+		ktime_t stop = ktime_add_ns(start, vcpu->halt_poll_ns);
+
+		vcpu->halt_stats.attempted_poll++;
+		do {
+			if (has_pending_event(vcpu)) {
+				polled = 1;
+				break;
+			}
+			cpu_relax();
+			cur = ktime_get();
+		} while (!need_resched() && ktime_before(cur, stop));
+
+		cur = ktime_get();
+		if (polled) {
+			vcpu->halt_stats.successful_poll++;
+			vcpu->halt_stats.poll_success_ns +=
+				ktime_to_ns(ktime_sub(cur, start));
+		} else {
+			vcpu->halt_stats.poll_fail_ns +=
+				ktime_to_ns(ktime_sub(cur, start));
+		}
+	}
+
+	if (!polled) {
+		post_event(&vcpu->vm->events, TVISOR_EVENT_HALT, vcpu->id, 0);
+		err = wait_event_interruptible(vcpu->halt_wq,
+					       has_pending_event(vcpu));
+		if (err) {
+			return -EINTR;
+		}
+		vcpu->halt_stats.wakeups++;
+		cur = ktime_get();
+	}
+
+	atomic_set(&vcpu->pending_events, 0);
+
+	u64 block_ns = ktime_to_ns(ktime_sub(cur, start));
+	if (!halt_poll_ns) {
+		vcpu->halt_poll_ns = 0;
+	} else if (block_ns <= vcpu->halt_poll_ns) {
+		// the window was big enough
+	} else if (vcpu->halt_poll_ns && block_ns > halt_poll_ns) {
+		// long halt, polling only burned the CPU
+		shrink_halt_poll_ns(vcpu);
+	} else if (vcpu->halt_poll_ns < halt_poll_ns &&
+		   block_ns < halt_poll_ns) {
+		// short halt we missed, poll a bit longer next time
+		grow_halt_poll_ns(vcpu);
+	}
+
+	return 0;
+}
+
+// Post an event to the vCPU, waking it up if it sits in HLT.
+void kick_vcpu(vcpu_state_t *vcpu)
+{
+	atomic_set(&vcpu->pending_events, 1);
+	WRITE_ONCE(vcpu->ready, 1);
+	wake_up_interruptible(&vcpu->halt_wq);
+}
+
+typedef struct _vmcs_bench_args {
+	vcpu_state_t *vcpu;
+	vmcs_access_bench_t *bench;
+} vmcs_bench_args_t;
 
-extern struct tvisor_state TVISOR_STATE;
+static void bench_vmcs_access_on_cpu(void *data)
+{
+	vmcs_bench_args_t *args = data;
+	vmx_bench_vmcs_access(args->vcpu->vmcs_region, args->bench);
+}
 
-static void __launch_vm(void *info)
+// Measure VMREAD/VMWRITE cost on `vcpu`'s VMCS, on the CPU it runs on.
+int bench_vmcs_access(vcpu_state_t *vcpu, vmcs_access_bench_t *bench)
 {
-	vm_state_t *vm = (vm_state_t *)info;
+	vmcs_bench_args_t args = { .vcpu = vcpu, .bench = bench };
 
-	if (clear_vmcs_state(vm->vmcs_region)) {
-		pr_info("tvisor: failed to clear vmcs state\n");
+	if (READ_ONCE(vcpu->task) != NULL) {
+		return -EBUSY;
+	}
+	return smp_call_function_single(vcpu->cpu, bench_vmcs_access_on_cpu,
+					&args, 1);
+}
+
+// `vcpu` spun on a PAUSE loop long enough to exit, so it is probably waiting
+// for a lock held by a sibling that is not running. Hand our time slice to
+// the next sibling that wants the CPU, round-robin from the last one boosted.
+static void vcpu_on_spin(vcpu_state_t *vcpu)
+{
+	vm_state_t *vm = vcpu->vm;
+	int start = READ_ONCE(vm->last_boosted_vcpu);
+	int nr_vcpus = smp_load_acquire(&vm->nr_vcpus);
+	int i;
+
+	vcpu->ple_stats.ple_exits++;
+
+	for (i = 1; i <= nr_vcpus; i++) {
+		int idx = (start + i) % nr_vcpus;
+		vcpu_state_t *sibling = READ_ONCE(vm->vcpus[idx]);
+		struct task_struct *task;
+
+		if (sibling == NULL || sibling == vcpu) {
+			continue;
+		}
+		if (!READ_ONCE(sibling->ready)) {
+			continue;
+		}
+
+		// task_struct is freed after a grace period, so it can be
+		// pinned here even if the thread is leaving run_vcpu()
+		rcu_read_lock();
+		task = READ_ONCE(sibling->task);
+		if (task) {
+			get_task_struct(task);
+		}
+		rcu_read_unlock();
+		if (task == NULL) {
+			continue;
+		}
+
+		vcpu->ple_stats.directed_yield_attempted++;
+		int yielded = yield_to(task, 1);
+		put_task_struct(task);
+		if (yielded > 0) {
+			vcpu->ple_stats.directed_yield_successful++;
+			WRITE_ONCE(vm->last_boosted_vcpu, idx);
+			break;
+		}
+		if (yielded < 0) {
+			// we are the only runnable task here, nothing to do
+			break;
+		}
+	}
+}
+
+// Pick up a TVISOR_SET_PROFILE since the last entry. VMCS must be current.
+static void refresh_vcpu_profile(vcpu_state_t *vcpu)
+{
+	if (READ_ONCE(vcpu->vm->profile.generation) ==
+	    vcpu->profile_generation) {
 		return;
 	}
+	vcpu->preemption_timer_value = profile_timer_value(
+		vcpu, vmx_preemption_timer_ticks(preemption_timer_quantum_us));
+	set_preemption_timer(vcpu->preemption_timer_value);
+}
 
-	if (load_vmcs(vm->vmcs_region)) {
+// Enter the guest once and handle the exit. Called with interrupts off on
+// vcpu->cpu, so the VMCS and the host state in it stay valid.
+static int enter_vcpu(vcpu_state_t *vcpu)
+{
+	vm_state_t *vm = vcpu->vm;
+
+	if (!vcpu->launched) {
+		u64 start = rdtsc_ordered();
+
+		if (clear_vmcs_state(vcpu->vmcs_region)) {
+			pr_info("tvisor: failed to clear vmcs state\n");
+			return VMEXIT_STOP;
+		}
+
+		vcpu->vmcs_active = 1;
+		if (load_vmcs(vcpu->vmcs_region)) {
+			pr_info("tvisor: failed to load vmcs\n");
+			return VMEXIT_STOP;
+		}
+
+		vcpu->preemption_timer_value = profile_timer_value(
+			vcpu,
+			vmx_preemption_timer_ticks(preemption_timer_quantum_us));
+
+		spin_lock(&vm->tsc_lock);
+		vcpu->tsc_offset = vm->tsc_offset;
+		vcpu->tsc_multiplier = vm->tsc_multiplier;
+		vcpu->tsc_generation = vm->tsc_generation;
+		spin_unlock(&vm->tsc_lock);
+
+		vmcs_config_t config = {
+			.eptp = vm->ept_pointer,
+			.preemption_timer_value = vcpu->preemption_timer_value,
+			.ple_gap = ple_gap,
+			.ple_window = ple_window,
+			.tsc_offset = vcpu->tsc_offset,
+			.tsc_multiplier = vcpu->tsc_multiplier,
+			.rdtsc_exiting = READ_ONCE(rdtsc_exiting),
+			.guest_cr3 = vm->boot_cr3,
+		};
+		set_guest_pmu_config(vcpu, &config);
+		setup_vmcs(vcpu->vmcs_region, &config);
+		vcpu->host_cr3 = 0;
+		vcpu->host_fs_base = 0;
+		refresh_host_state(vcpu);
+
+		vcpu->vmcs_setup_cycles = rdtsc_ordered() - start;
+		vcpu->nr_vmcs_setups++;
+	} else if (load_vmcs(vcpu->vmcs_region)) {
 		pr_info("tvisor: failed to load vmcs\n");
-		return;
+		return VMEXIT_STOP;
+	} else {
+		refresh_host_state(vcpu);
+		refresh_vcpu_tsc(vcpu);
+		refresh_vcpu_profile(vcpu);
 	}
 
-	setup_vmcs(vm->vmcs_region, vm->ept_pointer, vm->vmm_stack);
+	complete_user_exit(vcpu);
+
+	WRITE_ONCE(vcpu->ready, 0);
 
-	save_vmxoff_state(&(vm->rsp), &(vm->rbp));
-	pr_debug("tvisor: rsp=%llx, rbp=%llx\n", vm->rsp, vm->rbp);
+	if (vcpu->slow_exit_tsc) {
+		u32 reason = vcpu->exit_reason;
+		vcpu->exit_stats.slow_exits[reason]++;
+		vcpu->exit_stats.slow_cycles[reason] +=
+			rdtsc() - vcpu->slow_exit_tsc;
+		vcpu->slow_exit_tsc = 0;
+	}
+
+	load_guest_xcr0(vcpu);
+	load_guest_pmu(vcpu);
+	vcpu->entry_tsc = rdtsc();
+	int failed = vmx_run_guest(&vcpu->guest_regs, vcpu->launched);
+	put_guest_xcr0(vcpu);
+
+	if (failed) {
+		u64 err = vmcs_read32(VM_INSTRUCTION_ERROR);
+		pr_info("tvisor: vmlaunch is failed\n");
+		pr_debug("tvisor: vm instruction error[%lld]\n", err);
+		vcpu->run->exit_reason = TVISOR_EXIT_FAIL_ENTRY;
+		vcpu->run->fail_entry.vm_instruction_error = err;
+		return VMEXIT_STOP;
+	}
+	vcpu->launched = 1;
 
-	vmlaunch();
+	int action = vmexit_handler_main(vcpu);
+	if (action == VMEXIT_RESUME && vcpu->exit_reason < VMX_NR_EXIT_REASONS) {
+		vcpu->slow_exit_tsc = vcpu->exit_tsc;
+	}
+	if (action == VMEXIT_USER || action == VMEXIT_STOP) {
+		vcpu->stats.user_exits++;
+		save_user_exit(vcpu);
+	}
 
-	u64 err = vmread(VM_INSTRUCTION_ERROR);
-	pr_info("tvisor: vmlaunch is failed\n");
-	pr_debug("tvisor: vm instruction error[%lld]\n", err);
-	vmxoff();
-	TVISOR_STATE.is_vmx_enabled = 0;
+	return action;
 }
 
-void launch_vm(int cpu, vm_state_t *vm)
+// Hypercalls handle_vmcall() cannot finish with interrupts off. The guest's
+// registers still hold the number and the arguments.
+static void run_hypercall(vcpu_state_t *vcpu)
 {
-	struct cpumask mask;
-	cpumask_clear(&mask);
-	cpumask_set_cpu(cpu, &mask);
-	on_each_cpu_mask(&mask, __launch_vm, vm, 1);
+	guest_regs_t *regs = &vcpu->guest_regs;
+
+	switch (regs->rax) {
+	case TVISOR_HC_RING_REGISTER:
+		regs->rax = register_ring(vcpu->vm, regs->rbx, regs->rcx);
+		break;
+	case TVISOR_HC_RING_UNREGISTER:
+		regs->rax = unregister_ring(vcpu->vm);
+		break;
+	default:
+		regs->rax = TVISOR_HC_ENOSYS;
+		break;
+	}
 }
 
-vm_state_t *create_vm(void)
+// Run `vcpu` on the calling thread until an exit needs userspace. Exits the
+// kernel can handle loop straight back into the guest; between two entries
+// interrupts are on and the thread is preemptible, so the scheduler, pending
+// host interrupts and signals all get their turn.
+// VMX is only on for vcpu->cpu, so the calling thread gets bound to it
+// for the call and gets its own affinity back on return.
+// Returns 0 once vcpu->run describes an exit for userspace, or a negative
+// errno.
+int run_vcpu(vcpu_state_t *vcpu)
 {
-	vm_state_t *vm = kmalloc(sizeof(vm_state_t), GFP_KERNEL);
-	if (vm == NULL) {
+	cpumask_var_t saved_mask;
+	int ret = 0;
+
+	if (!alloc_cpumask_var(&saved_mask, GFP_KERNEL)) {
+		return -ENOMEM;
+	}
+	if (cmpxchg(&vcpu->task, NULL, current) != NULL) {
+		free_cpumask_var(saved_mask);
+		return -EBUSY; // one thread per vCPU
+	}
+	u64 start = rdtsc();
+
+	cpumask_copy(saved_mask, current->cpus_ptr);
+	ret = set_cpus_allowed_ptr(current, cpumask_of(vcpu->cpu));
+	if (ret) {
+		goto out;
+	}
+
+	if (READ_ONCE(vcpu->run->immediate_exit)) {
+		vcpu->run->exit_reason = TVISOR_EXIT_INTR;
+		ret = -EINTR;
+		goto out;
+	}
+
+	for (;;) {
+		if (signal_pending(current)) {
+			vcpu->run->exit_reason = TVISOR_EXIT_INTR;
+			ret = -EINTR;
+			break;
+		}
+		cond_resched();
+
+		preempt_disable();
+		if (smp_processor_id() != vcpu->cpu) {
+			// raced with a migration before the affinity took hold
+			preempt_enable();
+			continue;
+		}
+
+		// Keep the guest FPU state in the registers for as long as
+		// exits are handled right here; only the scheduler, a signal,
+		// a softirq or an exit handled outside this loop pays for the
+		// XSAVE. kernel_fpu_begin() keeps bottom halves off, so host
+		// interrupts taken in the guest leave their softirqs pending
+		// until put_guest_fpu(): leave as soon as there are some.
+		// The preemption timer bounds how long we stay.
+		load_guest_fpu(vcpu);
+		do {
+			local_irq_disable();
+			vcpu->exit_action = enter_vcpu(vcpu);
+			local_irq_enable();
+		} while (vcpu->exit_action == VMEXIT_RESUME && !need_resched() &&
+			 !signal_pending(current) && !local_softirq_pending());
+		put_guest_fpu(vcpu);
+		preempt_enable();
+		vcpu->slow_exit_tsc = 0; // only count time inside the loop above
+
+		if (vcpu->exit_action == VMEXIT_RESUME) {
+			continue;
+		} else if (vcpu->exit_action == VMEXIT_YIELD) {
+			WRITE_ONCE(vcpu->ready, 1);
+			drain_vcpu_profile(vcpu);
+		} else if (vcpu->exit_action == VMEXIT_HALT) {
+			ret = halt_vcpu(vcpu);
+			if (ret) {
+				vcpu->run->exit_reason = TVISOR_EXIT_INTR;
+				break;
+			}
+		} else if (vcpu->exit_action == VMEXIT_PAUSE) {
+			vcpu_on_spin(vcpu);
+		} else if (vcpu->exit_action == VMEXIT_HYPERCALL) {
+			run_hypercall(vcpu);
+		} else {
+			// VMEXIT_USER or VMEXIT_STOP, details are in vcpu->run
+			if (vcpu->run->exit_reason == TVISOR_EXIT_SHUTDOWN) {
+				post_event(&vcpu->vm->events,
+					   TVISOR_EVENT_SHUTDOWN, vcpu->id,
+					   vcpu->run->regs.rip);
+			}
+			break;
+		}
+	}
+
+out:
+	set_cpus_allowed_ptr(current, saved_mask);
+	free_cpumask_var(saved_mask);
+	vcpu->stats.run_cycles += rdtsc() - start;
+	WRITE_ONCE(vcpu->ready, 0);
+	WRITE_ONCE(vcpu->task, NULL);
+
+	return ret;
+}
+
+vcpu_state_t *create_vcpu(vm_state_t *vm)
+{
+	if (vm->nr_vcpus >= TVISOR_MAX_VCPUS) {
 		return NULL;
 	}
 
-	vmxon_region_t *vmxon_region = alloc_vmxon_region();
-	if (vmxon_region == NULL) {
-		pr_alert("tvisor: failed to alloc vmxon_region\n");
-		kfree(vm);
+	vcpu_state_t *vcpu = kzalloc(sizeof(vcpu_state_t), GFP_KERNEL);
+	if (vcpu == NULL) {
 		return NULL;
 	}
-	pr_debug("tvisor: alloc vmxon region\n");
 
-	vmcs_t *vmcs_region = alloc_vmcs_region();
-	if (vmcs_region == NULL) {
-		kfree(vm);
-		free_vmxon_region(vmxon_region);
+	vcpu->vmcs_region = alloc_vmcs_region();
+	if (vcpu->vmcs_region == NULL) {
+		kfree(vcpu);
+		return NULL;
+	}
+
+	BUILD_BUG_ON(sizeof(struct tvisor_run) > TVISOR_RUN_MMAP_SIZE);
+	struct page *run_page = alloc_page(GFP_KERNEL | __GFP_ZERO);
+	if (run_page == NULL) {
+		free_vmcs_region(vcpu->vmcs_region);
+		kfree(vcpu);
+		return NULL;
+	}
+	vcpu->run = (struct tvisor_run *)page_address(run_page);
+
+	if (alloc_guest_fpu(vcpu)) {
+		__free_page(run_page);
+		free_vmcs_region(vcpu->vmcs_region);
+		kfree(vcpu);
+		return NULL;
+	}
+
+	if (alloc_guest_pmu(vcpu)) {
+		free_guest_fpu(vcpu);
+		__free_page(run_page);
+		free_vmcs_region(vcpu->vmcs_region);
+		kfree(vcpu);
+		return NULL;
+	}
+
+	// vm->lock keeps TVISOR_SET_PROFILE out
+	if (vm->profile.frequency && alloc_vcpu_profile(vcpu)) {
+		free_guest_pmu(vcpu);
+		free_guest_fpu(vcpu);
+		__free_page(run_page);
+		free_vmcs_region(vcpu->vmcs_region);
+		kfree(vcpu);
 		return NULL;
 	}
 
 	pr_debug("tvisor: alloc vmcs region\n");
 
-	const u64 size_mib = 0x100; // genkai
+	vcpu->vm = vm;
+	vcpu->id = vm->nr_vcpus;
+	vcpu->cpu = 0; // VMX is only enabled on CPU 0
+	vcpu->exit_action = VMEXIT_RESUME;
+	atomic_set(&vcpu->pending_events, 0);
+	init_waitqueue_head(&vcpu->halt_wq);
 
-	ept_pointer_t *ept_pointer = create_ept_by_memsize(size_mib);
-	if (ept_pointer == NULL) {
-		kfree(vm);
-		free_vmxon_region(vmxon_region);
-		free_vmcs_region(vmcs_region);
+	// lockless readers look at vcpus[] below nr_vcpus, with
+	// smp_load_acquire()
+	vm->vcpus[vcpu->id] = vcpu;
+	smp_store_release(&vm->nr_vcpus, vcpu->id + 1);
+
+	return vcpu;
+}
+
+LIST_HEAD(vm_list);
+DEFINE_MUTEX(vm_list_lock);
+static int next_vm_id;
+
+static void destroy_vm(vm_state_t *vm);
+
+static void destroy_vcpu(vcpu_state_t *vcpu)
+{
+	// userspace mappings hold their own reference to the run page
+	__free_page(virt_to_page(vcpu->run));
+	free_guest_fpu(vcpu);
+	free_guest_pmu(vcpu);
+	free_vcpu_profile(vcpu);
+	free_vmcs_region(vcpu->vmcs_region);
+	kfree(vcpu);
+}
+
+// a VM with `size_mib` MiB of RAM and one vCPU
+vm_state_t *create_vm(u64 size_mib)
+{
+	vm_state_t *vm = kzalloc(sizeof(vm_state_t), GFP_KERNEL);
+	if (vm == NULL) {
 		return NULL;
 	}
 
-	pr_debug("tvisor: alloc EPT[%llxMiB]\n", size_mib);
-	const int order = 3; // 2 ^ 3 = 8 pages
-	struct page *vmm_stack_pages = alloc_pages(GFP_KERNEL, order);
-	if (vmm_stack_pages == NULL) {
+	INIT_LIST_HEAD(&vm->list);
+	kref_init(&vm->refcount);
+	mutex_init(&vm->lock);
+
+	ept_pointer_t *ept_pointer = create_ept_by_memsize(size_mib);
+	if (ept_pointer == NULL) {
 		kfree(vm);
-		free_vmxon_region(vmxon_region);
-		free_vmcs_region(vmcs_region);
-		free_ept(ept_pointer);
 		return NULL;
 	}
-	u64 *vmm_stack = (u64 *)page_address(vmm_stack_pages);
-	memset(vmm_stack, 0, 0x1000 * 8);
 
-	pr_debug("tvisor: alloc vmm stack\n");
+	pr_debug("tvisor: alloc EPT[%llxMiB]\n", size_mib);
+	vm->mem_size = size_mib * SZ_1M;
 
 	struct page *msr_bitmap_page = alloc_page(GFP_KERNEL);
 	if (msr_bitmap_page == NULL) {
 		kfree(vm);
-		free_vmxon_region(vmxon_region);
-		free_vmcs_region(vmcs_region);
 		free_ept(ept_pointer);
-		__free_page(virt_to_page(vmm_stack));
 		return NULL;
 	}
 
 	pr_debug("tvisor: alloc msr bitmap\n");
 
-	vm->vmxon_region = vmxon_region;
-	vm->vmcs_region = vmcs_region;
 	vm->ept_pointer = ept_pointer;
-	vm->vmm_stack = vmm_stack;
 	vm->msr_bitmap_virt = (u64 *)page_address(msr_bitmap_page);
 	vm->msr_bitmap_phys = __pa(vm->msr_bitmap_virt);
 
+	cpuid_table_t *cpuid = build_cpuid_table();
+	if (cpuid == NULL) {
+		destroy_vm(vm);
+		return NULL;
+	}
+	RCU_INIT_POINTER(vm->cpuid, cpuid);
+
+	init_vm_tsc(vm);
+	init_event_queue(&vm->events);
+	init_profile(&vm->profile);
+	init_mmio_bus(&vm->mmio);
+	if (init_coalesced(&vm->coalesced)) {
+		destroy_vm(vm);
+		return NULL;
+	}
+
+	if (init_uart(&vm->uart)) {
+		destroy_vm(vm);
+		return NULL;
+	}
+
+	if (create_vcpu(vm) == NULL) {
+		destroy_vm(vm);
+		return NULL;
+	}
+
+	mutex_lock(&vm_list_lock);
+	vm->id = next_vm_id++;
+	list_add_tail(&vm->list, &vm_list);
+	mutex_unlock(&vm_list_lock);
+	add_vm_stats(vm);
+
 	return vm;
 }
 
-void destroy_vm(vm_state_t *vm)
+void get_vm(vm_state_t *vm)
 {
+	kref_get(&vm->refcount);
+}
+
+static void clear_vmcs_on_cpu(void *vmcs)
+{
+	clear_vmcs_state(vmcs);
+}
+
+// VMCLEAR the VMCSs the CPU may still cache. Only while the VM is on
+// vm_list: that keeps VMX on, see set_vmx().
+static void clear_vm_vmcs(vm_state_t *vm)
+{
+	int i;
+
+	for (i = 0; i < vm->nr_vcpus; i++) {
+		vcpu_state_t *vcpu = vm->vcpus[i];
+		if (vcpu->vmcs_active) {
+			smp_call_function_single(vcpu->cpu, clear_vmcs_on_cpu,
+						 vcpu->vmcs_region, 1);
+			vcpu->vmcs_active = 0;
+			vcpu->launched = 0;
+		}
+	}
+}
+
+static void release_vm(struct kref *kref)
+{
+	vm_state_t *vm = container_of(kref, vm_state_t, refcount);
+
+	remove_vm_stats(vm);
+	clear_vm_vmcs(vm);
+	mutex_lock(&vm_list_lock);
+	list_del(&vm->list);
+	mutex_unlock(&vm_list_lock);
+
+	pr_info("tvisor: destroy VM%d\n", vm->id);
+	destroy_vm(vm);
+}
+
+// Drop a reference; the last one tears the VM down. Nothing may be running
+// in it by then, every entry point holds a reference.
+void put_vm(vm_state_t *vm)
+{
+	kref_put(&vm->refcount, release_vm);
+}
+
+static void destroy_vm(vm_state_t *vm)
+{
+	int i;
+	unregister_ring(vm); // before the EPT and the pages it maps go away
+	free_blk(vm);
+	free_uart(&vm->uart);
+	free_coalesced(&vm->coalesced);
+	for (i = 0; i < vm->nr_vcpus; i++) {
+		destroy_vcpu(vm->vcpus[i]);
+	}
+	free_profile(&vm->profile);
+	free_cpuid_table(rcu_dereference_protected(vm->cpuid, 1));
 	__free_page(virt_to_page(vm->msr_bitmap_virt));
-	__free_page(virt_to_page(vm->vmm_stack));
 	free_ept(vm->ept_pointer);
-	free_vmcs_region(vm->vmcs_region);
-	free_vmxon_region(vm->vmxon_region);
 	kfree(vm);
 	vm = NULL;
 }
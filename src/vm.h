@@ -1,23 +1,25 @@
 #pragma once
 
+#include <linux/atomic.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
+#include <linux/wait.h>
 
+#include "blk.h"
+#include "coalesced.h"
+#include "cpuid.h"
 #include "ept.h"
+#include "events.h"
+#include "mmio.h"
+#include "profile.h"
+#include "ring.h"
+#include "tvisor.h"
+#include "uart.h"
 #include "vmx.h"
 
-#define VMM_STACK_SIZE 0x1000
-
-typedef struct _vm_state {
-	vmxon_region_t *vmxon_region;
-	vmcs_t *vmcs_region;
-	ept_pointer_t *ept_pointer;
-	u64 *vmm_stack;
-	u64 *msr_bitmap_virt;
-	u64 msr_bitmap_phys;
-	u64 rsp;
-	u64 rbp;
-} vm_state_t;
-
 typedef struct _guest_regs {
 	u64 rax;
 	u64 rcx;
@@ -37,6 +39,119 @@ typedef struct _guest_regs {
 	u64 r15;
 } guest_regs_t;
 
+typedef struct _halt_poll_stats {
+	u64 halt_exits;
+	u64 attempted_poll; // halts where we polled before sleeping
+	u64 successful_poll; // an event showed up while polling
+	u64 wakeups; // woken up after sleeping
+	u64 poll_success_ns;
+	u64 poll_fail_ns;
+} halt_poll_stats_t;
+
+typedef struct _ple_stats {
+	u64 ple_exits;
+	u64 directed_yield_attempted;
+	u64 directed_yield_successful;
+} ple_stats_t;
+
+// exits handled in the kernel, by basic exit reason; cycles run from the
+// exit landing in vmexit_handler to the next VM entry
+typedef struct _exit_stats {
+	u64 fast_exits[VMX_NR_EXIT_REASONS]; // resumed by vmexit_fast_path()
+	u64 fast_cycles[VMX_NR_EXIT_REASONS];
+	u64 slow_exits[VMX_NR_EXIT_REASONS]; // through the run loop
+	u64 slow_cycles[VMX_NR_EXIT_REASONS];
+} exit_stats_t;
+
+// Written only by the thread running the vCPU, so plain increments; readers
+// sum them up across vCPUs and may see them slightly stale.
+typedef struct _vcpu_stats {
+	u64 exits[VMX_NR_EXIT_REASONS];
+	u64 user_exits;
+	u64 run_cycles;
+	u64 guest_cycles;
+	u64 ept_violations;
+	u64 injected_events;
+} vcpu_stats_t;
+
+#define TVISOR_MAX_VCPUS 8
+
+struct _vm_state;
+struct xregs_state;
+
+typedef struct _vcpu_state {
+	struct _vm_state *vm;
+	int id;
+	int cpu; // physical CPU the vCPU runs on
+	vmcs_t *vmcs_region;
+	guest_regs_t guest_regs;
+	int launched;
+	int vmcs_active; // VMCLEAR it on vcpu->cpu before VMXOFF or freeing
+	int exit_action; // enum VMEXIT_ACTION of the last exit
+	u32 exit_reason; // basic VMX exit reason of the last exit
+	u64 exit_qualification;
+	struct tvisor_run *run; // page shared with userspace
+	u64 host_cr3; // HOST_CR3 and HOST_FS_BASE as last written
+	u64 host_fs_base;
+	u64 nr_vmcs_setups;
+	u64 vmcs_setup_cycles; // TSC cycles to set up the VMCS last time
+	int user_exit_pending; // userspace owes us the result of `run`
+	u32 preemption_timer_value; // 0 if the preemption timer is off
+	atomic_t pending_events; // non-zero wakes the guest from HLT
+	wait_queue_head_t halt_wq;
+	u32 halt_poll_ns; // current polling window
+	halt_poll_stats_t halt_stats;
+	struct task_struct *task; // thread running this vCPU, if any
+	int ready; // wants the CPU back (preempted or woken from HLT)
+	ple_stats_t ple_stats;
+	struct xregs_state *guest_fpu; // guest FPU state while not loaded
+	u64 guest_xcr0;
+	u64 nr_guest_fpu_loads;
+	u64 exit_tsc; // TSC when the last exit landed
+	u64 slow_exit_tsc; // exit_tsc of a slow exit not yet resumed, or 0
+	exit_stats_t exit_stats;
+	u64 tsc_offset; // TSC_OFFSET and TSC_MULTIPLIER as last written
+	u64 tsc_multiplier;
+	u64 tsc_generation; // vm->tsc_generation they came from
+	mmio_vcpu_t mmio;
+	u64 entry_tsc; // TSC at the last VM entry, roughly
+	vcpu_stats_t stats;
+	vmx_msr_entry_t *pmu_msrs; // the guest's counter MSRs, then the host's
+	u32 nr_pmu_msrs; // 0 = no vPMU
+	vcpu_profile_t *profile; // RIP samples, NULL until first profiled
+	u32 profile_generation; // vm->profile.generation it follows
+} vcpu_state_t;
+
+typedef struct _vm_state {
+	int id;
+	struct list_head list; // on vm_list
+	struct kref refcount; // one per fd, the VM goes away with the last
+	struct mutex lock; // serializes configuration: vCPUs, image
+	ept_pointer_t *ept_pointer;
+	u64 mem_size; // bytes of guest RAM from address 0
+	u64 *msr_bitmap_virt;
+	u64 msr_bitmap_phys;
+	int nr_vcpus;
+	vcpu_state_t *vcpus[TVISOR_MAX_VCPUS];
+	int last_boosted_vcpu; // where the next directed yield search starts
+	cpuid_table_t __rcu *cpuid;
+	spinlock_t tsc_lock; // protects the guest TSC settings below
+	u32 tsc_khz;
+	u64 tsc_offset;
+	u64 tsc_multiplier;
+	u64 tsc_generation; // bumped on every change
+	ring_state_t *ring; // guest's exitless ring, if registered
+	blk_state_t *blk; // paravirtual block device, if set up
+	uart_state_t uart; // COM1
+	mmio_bus_t mmio; // in-kernel MMIO devices
+	coalesced_state_t coalesced;
+	u64 boot_cr3; // from TVISOR_LOAD_IMAGE, 0 = sample page tables
+	event_queue_t events;
+	profile_state_t profile;
+	mmio_dev_t bench_mmio; // for TVISOR_BENCH_EXITS
+	struct dentry *debugfs; // the VM's text stats, see stats.c
+} vm_state_t;
+
 typedef union _cr3 {
 	u64 all;
 	struct {
@@ -127,7 +242,21 @@ typedef union _pte {
 	} fields;
 } __pte_t;
 
-void launch_vm(int cpu, vm_state_t *vm);
-vm_state_t *create_vm(void);
-void destroy_vm(vm_state_t *vm);
+int run_vcpu(vcpu_state_t *vcpu);
+int vmexit_handler_main(vcpu_state_t *vcpu);
+int vmexit_fast_path(guest_regs_t *regs);
+void save_user_exit(vcpu_state_t *vcpu);
+void refresh_host_state(vcpu_state_t *vcpu);
+void complete_user_exit(vcpu_state_t *vcpu);
+void kick_vcpu(vcpu_state_t *vcpu);
+int bench_vmcs_access(vcpu_state_t *vcpu, vmcs_access_bench_t *bench);
+vm_state_t *create_vm(u64 size_mib);
+void get_vm(vm_state_t *vm);
+void put_vm(vm_state_t *vm);
+vcpu_state_t *create_vcpu(vm_state_t *vm);
 cr3_t setup_sample_guest_page_table(ept_pointer_t *eptp);
+
+// all live VMs, for status reporting; held only while walking the list,
+// never while using one VM
+extern struct list_head vm_list;
+extern struct mutex vm_list_lock;
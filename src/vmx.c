@@ -1,18 +1,34 @@
 #include <asm/msr.h>
 #include <asm/processor.h>
+#include <asm/tsc.h> /* Needed for tsc_khz */
+#include <linux/bug.h> /* Needed for WARN_ON_ONCE */
 #include <linux/mm.h> /* Needed for struct page, alloc_pages_node, page_address, etc... */
+#include <linux/moduleparam.h> /* Needed for module_param */
+#include <linux/percpu.h> /* Needed for this_cpu_read */
 #include <linux/percpu-defs.h> /* Needed for DEFINE_PER_CPU macro */
 #include <linux/printk.h> /* Needed for pr_alert */
 #include <linux/slab.h> /* Needed for kmalloc */
 
+#include "blk.h"
+#include "coalesced.h"
 #include "cpu.h"
+#include "fpu.h"
 #include "handler.h"
+#include "mmio.h"
+#include "pmu.h"
+#include "profile.h"
+#include "ring.h"
+#include "tsc.h"
+#include "uart.h"
 #include "vm.h"
 #include "vmx.h"
 
-extern vm_state_t *VM;
 extern void *VA_GUEST_MEMORY;
 
+// VMCS that is current on this CPU, so re-entering the same vCPU can skip
+// VMPTRLD
+static DEFINE_PER_CPU(vmcs_t *, current_vmcs);
+
 static int vmxon(u64 phys_vmxon_region)
 {
 	u8 err;
@@ -28,6 +44,7 @@ int vmxoff(void)
 {
 	u8 err;
 	asm volatile("vmxoff; setna %0" : "=q"(err));
+	this_cpu_write(current_vmcs, NULL);
 
 	return err;
 }
@@ -156,12 +173,27 @@ int vmresume(void)
 	return 0;
 }
 
-u64 vmread(enum VMCS_FIELDS field)
+#ifdef DEBUG
+void vmx_vmcs_access_error(const char *insn, unsigned long field)
 {
-	u64 val = 9800, rflags = 0;
+	// not __vmcs_readl(), it would come back here if there is no VMCS
+	unsigned long err = 0;
+	asm volatile("vmread %1, %0"
+		     : "=r"(err)
+		     : "r"((unsigned long)VM_INSTRUCTION_ERROR)
+		     : "cc");
+	pr_alert("tvisor: %s of VMCS field %lx failed, error[%lu]\n", insn,
+		 field, err);
+}
+#endif
+
+// the accessor as it used to be: out of line, RFLAGS decoded on every call
+static noinline u64 vmread_checked(unsigned long field)
+{
+	u64 val = 0, rflags = 0;
 	asm volatile("vmread %2, %0; pushfq; popq %1"
 		     : "=r"(val), "=r"(rflags)
-		     : "r"((u64)field));
+		     : "r"(field));
 
 	u64 cf, pf, af, zf, sf, of;
 	cf = (rflags >> 0) & 1;
@@ -172,21 +204,47 @@ u64 vmread(enum VMCS_FIELDS field)
 	of = (rflags >> 11) & 1;
 
 	if (cf | pf | af | zf | sf | of) {
-		if (cf) {
-			pr_debug("tvisor: VMfail Invaild\n");
-		} else if (zf) {
-			pr_debug("tvisor: VMfail Invalid(ErrorCode)\n");
-		} else {
-			pr_debug("tvisor: undefined state\n");
-		}
 		return 0;
 	}
 	return val;
 }
 
-void vmwrite(enum VMCS_FIELDS field, u64 val)
+// Time `bench->iterations` accesses to GUEST_RIP of `vmcs`. Must run with
+// interrupts off on a CPU that has VMX enabled, and `vmcs` must not be in
+// use by a running vCPU. GUEST_RIP is written back with its own value.
+void vmx_bench_vmcs_access(vmcs_t *vmcs, vmcs_access_bench_t *bench)
 {
-	asm volatile("vmwrite %0, %1" : : "r"(val), "r"((u64)field));
+	u64 n = bench->iterations;
+	u64 i, start, sum = 0;
+
+	if (n == 0 || load_vmcs(vmcs)) {
+		return;
+	}
+
+	u64 rip = vmcs_readl(GUEST_RIP);
+
+	start = rdtsc_ordered();
+	for (i = 0; i < n; i++) {
+		sum += vmcs_readl(GUEST_RIP);
+	}
+	bench->read_cycles = (rdtsc_ordered() - start) / n;
+
+	start = rdtsc_ordered();
+	for (i = 0; i < n; i++) {
+		vmcs_writel(GUEST_RIP, rip);
+	}
+	bench->write_cycles = (rdtsc_ordered() - start) / n;
+
+	start = rdtsc_ordered();
+	for (i = 0; i < n; i++) {
+		sum += vmread_checked(GUEST_RIP);
+	}
+	bench->checked_read_cycles = (rdtsc_ordered() - start) / n;
+
+	// keep the loops from being optimized away
+	if (sum == 1) {
+		pr_debug("tvisor: GUEST_RIP[%llx]\n", rip);
+	}
 }
 
 static void get_segment_descriptor(segment_selector_t *segment_selector,
@@ -222,7 +280,39 @@ static void get_segment_descriptor(segment_selector_t *segment_selector,
 	}
 }
 
-static void fill_guest_selector_data(u64 *gdt_base, u64 segment, u16 selector)
+vmx_capability_t VMX_CAP;
+
+// host state and guest/control defaults of this CPU, captured when VMX is
+// enabled and copied into every new VMCS
+static DEFINE_PER_CPU(vmcs_template_t, vmcs_template);
+
+// bits 31:0 of a control MSR are the must-be-one settings, bits 63:32 the
+// may-be-one settings
+static u64 adjust_controls(u64 ctl, u64 msr_value)
+{
+	ctl &= msr_value >> 32;
+	ctl |= msr_value & 0xffffffff;
+	return ctl;
+}
+
+static void template_add(vmcs_field_value_t *fields, int *nr,
+			 enum VMCS_FIELDS field, u64 value)
+{
+	if (WARN_ON_ONCE(*nr >= VMCS_TEMPLATE_MAX)) {
+		return;
+	}
+	fields[*nr].field = field;
+	fields[*nr].value = value;
+	(*nr)++;
+}
+
+#define template_host(t, field, value)                                         \
+	template_add((t)->host, &(t)->nr_host, field, value)
+#define template_guest(t, field, value)                                        \
+	template_add((t)->guest, &(t)->nr_guest, field, value)
+
+static void template_guest_selector(vmcs_template_t *t, u64 *gdt_base,
+				    u64 segment, u16 selector)
 {
 	segment_selector_t segment_selector = { 0 };
 	get_segment_descriptor(&segment_selector, selector, gdt_base);
@@ -234,43 +324,245 @@ static void fill_guest_selector_data(u64 *gdt_base, u64 segment, u16 selector)
 		access_rights |= 0x10000;
 	}
 
-	vmwrite(GUEST_ES_SELECTOR + segment * 2, selector);
-	vmwrite(GUEST_ES_LIMIT + segment * 2, segment_selector.limit);
-	vmwrite(GUEST_ES_AR_BYTES + segment * 2, access_rights);
-	vmwrite(GUEST_ES_BASE + segment * 2, segment_selector.base);
+	template_guest(t, GUEST_ES_SELECTOR + segment * 2, selector);
+	template_guest(t, GUEST_ES_LIMIT + segment * 2, segment_selector.limit);
+	template_guest(t, GUEST_ES_AR_BYTES + segment * 2, access_rights);
+	template_guest(t, GUEST_ES_BASE + segment * 2, segment_selector.base);
 }
 
-static u64 adjust_controls(u64 ctl, u64 msr)
+// Capture the state of this CPU. HOST_CR3 and HOST_FS_BASE belong to the
+// task rather than the CPU, refresh_host_state() keeps those up to date.
+static void build_vmcs_template(vmcs_template_t *t)
 {
-	u64 content_low, content_high;
-	rdmsr(msr, content_low, content_high);
+	u64 gdt_base = read_gdt_base();
+	u64 msr_val;
+
+	t->nr_host = 0;
+	t->nr_guest = 0;
+
+	template_host(t, HOST_ES_SELECTOR, read_es() & 0xf8);
+	template_host(t, HOST_CS_SELECTOR, read_cs() & 0xf8);
+	template_host(t, HOST_SS_SELECTOR, read_ss() & 0xf8);
+	template_host(t, HOST_DS_SELECTOR, read_ds() & 0xf8);
+	template_host(t, HOST_FS_SELECTOR, read_fs() & 0xf8);
+	template_host(t, HOST_GS_SELECTOR, read_gs() & 0xf8);
+	template_host(t, HOST_TR_SELECTOR, read_tr() & 0xf8);
+	template_host(t, HOST_CR0, read_cr0());
+	template_host(t, HOST_CR4, read_cr4());
+
+	segment_selector_t tr;
+	get_segment_descriptor(&tr, read_tr(), (u64 *)gdt_base);
+	template_host(t, HOST_TR_BASE, tr.base);
+	rdmsrl(MSR_GS_BASE, msr_val);
+	template_host(t, HOST_GS_BASE, msr_val);
+	template_host(t, HOST_GDTR_BASE, gdt_base);
+	template_host(t, HOST_IDTR_BASE, read_idt_base());
+
+	rdmsrl(MSR_IA32_SYSENTER_CS, msr_val);
+	template_host(t, HOST_IA32_SYSENTER_CS, msr_val);
+	rdmsrl(MSR_IA32_SYSENTER_EIP, msr_val);
+	template_host(t, HOST_IA32_SYSENTER_EIP, msr_val);
+	rdmsrl(MSR_IA32_SYSENTER_ESP, msr_val);
+	template_host(t, HOST_IA32_SYSENTER_ESP, msr_val);
+
+	// HOST_RSP is written by vmx_run_guest on every entry
+	template_host(t, HOST_RIP, (u64)vmexit_handler);
+
+	template_guest(t, VMCS_LINK_POINTER, ~0ull);
+	template_guest(t, GUEST_IA32_DEBUGCTL, 0); // no LBRs or BTS for guests
+	template_guest(t, PAGE_FAULT_ERROR_CODE_MASK, 0);
+	template_guest(t, PAGE_FAULT_ERROR_CODE_MATCH, 0);
+	template_guest(t, VM_EXIT_MSR_STORE_COUNT, 0);
+	template_guest(t, VM_EXIT_MSR_LOAD_COUNT, 0);
+	template_guest(t, VM_ENTRY_MSR_LOAD_COUNT, 0);
+	template_guest(t, VM_ENTRY_INTR_INFO_FIELD, 0);
+
+	template_guest_selector(t, (void *)gdt_base, ES, read_es());
+	template_guest_selector(t, (void *)gdt_base, CS, read_cs());
+	template_guest_selector(t, (void *)gdt_base, SS, read_ss());
+	template_guest_selector(t, (void *)gdt_base, DS, read_ds());
+	template_guest_selector(t, (void *)gdt_base, FS, read_fs());
+	template_guest_selector(t, (void *)gdt_base, GS, read_gs());
+	template_guest_selector(t, (void *)gdt_base, LDTR, read_ldt());
+	template_guest_selector(t, (void *)gdt_base, TR, read_tr());
+
+	rdmsrl(MSR_FS_BASE, msr_val);
+	template_guest(t, GUEST_FS_BASE, msr_val);
+	rdmsrl(MSR_GS_BASE, msr_val);
+	template_guest(t, GUEST_GS_BASE, msr_val);
+
+	template_guest(t, GUEST_INTERRUPTIBILITY_INFO, 0);
+	template_guest(t, GUEST_ACTIVITY_STATE, 0); // active state
+
+	template_guest(t, VM_ENTRY_CONTROLS,
+		       adjust_controls(VM_ENTRY_IA32E_MODE,
+				       VMX_CAP.ctls.entry));
+
+	template_guest(t, CR3_TARGET_COUNT, 0);
+	template_guest(t, CR3_TARGET_VALUE0, 0);
+	template_guest(t, CR3_TARGET_VALUE1, 0);
+	template_guest(t, CR3_TARGET_VALUE2, 0);
+	template_guest(t, CR3_TARGET_VALUE3, 0);
+
+	template_guest(t, GUEST_CR0, read_cr0());
+	template_guest(t, GUEST_CR4, read_cr4());
+	template_guest(t, GUEST_DR7, 0x400);
+
+	template_guest(t, GUEST_GDTR_BASE, gdt_base);
+	template_guest(t, GUEST_IDTR_BASE, read_idt_base());
+	template_guest(t, GUEST_GDTR_LIMIT, read_gdt_limit());
+	template_guest(t, GUEST_IDTR_LIMIT, read_idt_limit());
+
+	template_guest(t, GUEST_RFLAGS, read_rflags());
+
+	rdmsrl(MSR_IA32_SYSENTER_CS, msr_val);
+	template_guest(t, GUEST_SYSENTER_CS, msr_val);
+	rdmsrl(MSR_IA32_SYSENTER_EIP, msr_val);
+	template_guest(t, GUEST_SYSENTER_EIP, msr_val);
+	rdmsrl(MSR_IA32_SYSENTER_ESP, msr_val);
+	template_guest(t, GUEST_SYSENTER_ESP, msr_val);
+
+	template_guest(t, GUEST_RSP, 0);
+	template_guest(t, GUEST_RIP, 0);
+
+	pr_debug("tvisor: VMCS template of CPU%d: %d host, %d guest fields\n",
+		 smp_processor_id(), t->nr_host, t->nr_guest);
+}
 
-	ctl &= content_high;
-	ctl |= content_low;
-	return ctl;
+static void write_vmcs_fields(const vmcs_field_value_t *fields, int nr)
+{
+	int i;
+	for (i = 0; i < nr; i++) {
+		vmwrite(fields[i].field, fields[i].value);
+	}
+}
+
+// Snapshot everything VMX-related the CPU reports, once at module load.
+// The IA32_VMX_* MSRs are identical on all CPUs.
+void read_vmx_capability(vmx_capability_t *cap)
+{
+	cpuid_t cpuid;
+	u64 feature_control = 0;
+
+	memset(cap, 0, sizeof(vmx_capability_t));
+
+	cpuid = get_cpuid(0x80000000);
+	if (cpuid.eax >= 0x80000008) {
+		cpuid = get_cpuid(0x80000008);
+		cap->max_phys_addr_bits = cpuid.eax & 0xff;
+	} else {
+		cap->max_phys_addr_bits = 36;
+	}
+
+	cpuid = get_cpuid(1);
+	cap->vmx_supported = !!(cpuid.ecx & 0b100000);
+	if (!cap->vmx_supported) {
+		return;
+	}
+
+	// VMXON outside SMX is forbidden only once the MSR is locked
+	rdmsrl(MSR_IA32_FEAT_CTL, feature_control);
+	cap->vmxon_allowed = !(feature_control & 0b1) ||
+			     (feature_control & 0b100);
+
+	rdmsrl(MSR_IA32_VMX_BASIC, cap->basic);
+	rdmsrl(MSR_IA32_VMX_PINBASED_CTLS, cap->pinbased_ctls);
+	rdmsrl(MSR_IA32_VMX_PROCBASED_CTLS, cap->procbased_ctls);
+	rdmsrl(MSR_IA32_VMX_EXIT_CTLS, cap->exit_ctls);
+	rdmsrl(MSR_IA32_VMX_ENTRY_CTLS, cap->entry_ctls);
+	rdmsrl(MSR_IA32_VMX_MISC, cap->misc);
+	rdmsrl(MSR_IA32_VMX_CR0_FIXED0, cap->cr0_fixed0);
+	rdmsrl(MSR_IA32_VMX_CR0_FIXED1, cap->cr0_fixed1);
+	rdmsrl(MSR_IA32_VMX_CR4_FIXED0, cap->cr4_fixed0);
+	rdmsrl(MSR_IA32_VMX_CR4_FIXED1, cap->cr4_fixed1);
+	rdmsrl(MSR_IA32_VMX_VMCS_ENUM, cap->vmcs_enum);
+
+	cap->ctls.pinbased = cap->pinbased_ctls;
+	cap->ctls.procbased = cap->procbased_ctls;
+	cap->ctls.exit = cap->exit_ctls;
+	cap->ctls.entry = cap->entry_ctls;
+	if (cap->basic & VMX_BASIC_TRUE_CTLS) {
+		// the TRUE_* MSRs also allow clearing some default1 bits
+		rdmsrl(MSR_IA32_VMX_TRUE_PINBASED_CTLS,
+		       cap->true_pinbased_ctls);
+		rdmsrl(MSR_IA32_VMX_TRUE_PROCBASED_CTLS,
+		       cap->true_procbased_ctls);
+		rdmsrl(MSR_IA32_VMX_TRUE_EXIT_CTLS, cap->true_exit_ctls);
+		rdmsrl(MSR_IA32_VMX_TRUE_ENTRY_CTLS, cap->true_entry_ctls);
+		cap->ctls.pinbased = cap->true_pinbased_ctls;
+		cap->ctls.procbased = cap->true_procbased_ctls;
+		cap->ctls.exit = cap->true_exit_ctls;
+		cap->ctls.entry = cap->true_entry_ctls;
+	}
+
+	if ((cap->procbased_ctls >> 32) &
+	    CPU_BASED_ACTIVATE_SECONDARY_CONTROLS) {
+		rdmsrl(MSR_IA32_VMX_PROCBASED_CTLS2, cap->procbased_ctls2);
+		cap->ctls.procbased2 = cap->procbased_ctls2;
+
+		u64 allowed2 = cap->procbased_ctls2 >> 32;
+		if (allowed2 &
+		    (CPU_BASED_CTL2_ENABLE_EPT | CPU_BASED_CTL2_ENABLE_VPID)) {
+			rdmsrl(MSR_IA32_VMX_EPT_VPID_CAP, cap->ept_vpid_cap);
+		}
+		if (allowed2 & CPU_BASED_CTL2_ENABLE_VMFUNC) {
+			rdmsrl(MSR_IA32_VMX_VMFUNC, cap->vmfunc);
+		}
+	}
+}
+
+static int allowed1(u64 ctl_msr, u64 bit)
+{
+	return !!((ctl_msr >> 32) & bit);
+}
+
+int vmx_has_preemption_timer(void)
+{
+	return allowed1(VMX_CAP.ctls.pinbased,
+			PIN_BASED_VM_EXECUTION_CONTROLS_ACTIVE_VMX_TIMER);
+}
+
+int vmx_has_ple(void)
+{
+	return allowed1(VMX_CAP.ctls.procbased2,
+			CPU_BASED_CTL2_PAUSE_LOOP_EXITING);
 }
 
-static u32 is_vmx_supported(void)
+int vmx_has_vpid(void)
 {
-	cpuid_t cpuid = get_cpuid(1);
-	return (u32)(cpuid.ecx & 0b100000);
+	return allowed1(VMX_CAP.ctls.procbased2, CPU_BASED_CTL2_ENABLE_VPID) &&
+	       (VMX_CAP.ept_vpid_cap & VMX_VPID_INVVPID);
 }
 
-static u32 is_vmxon_supported(void)
+int vmx_has_pml(void)
 {
-	u64 ia32_feature_control = 0;
-	rdmsrl(MSR_IA32_FEAT_CTL, ia32_feature_control);
-	u64 lock = ia32_feature_control & 0b1;
-	u64 vmxon_in_smx = ia32_feature_control & 0b10;
-	u64 vmxon_outside_smx = ia32_feature_control & 0b100;
+	return allowed1(VMX_CAP.ctls.procbased2, CPU_BASED_CTL2_ENABLE_PML);
+}
 
-	return (u32)(lock | vmxon_in_smx | vmxon_outside_smx);
+int vmx_has_vmfunc(void)
+{
+	return allowed1(VMX_CAP.ctls.procbased2, CPU_BASED_CTL2_ENABLE_VMFUNC);
+}
+
+int vmx_has_tsc_scaling(void)
+{
+	return allowed1(VMX_CAP.ctls.procbased2, CPU_BASED_CTL2_TSC_SCALING);
+}
+
+int vmx_has_ept_2mb_pages(void)
+{
+	return !!(VMX_CAP.ept_vpid_cap & VMX_EPT_2MB_PAGE);
+}
+
+int vmx_has_ept_1gb_pages(void)
+{
+	return !!(VMX_CAP.ept_vpid_cap & VMX_EPT_1GB_PAGE);
 }
 
 vmcs_t *alloc_vmcs_region(void)
 {
-	u32 vmx_msr_low, vmx_msr_high;
-	rdmsr(MSR_IA32_VMX_BASIC, vmx_msr_low, vmx_msr_high);
+	u32 vmx_msr_low = (u32)VMX_CAP.basic;
+	u32 vmx_msr_high = (u32)(VMX_CAP.basic >> 32);
 
 	struct page *page = alloc_page(GFP_KERNEL);
 	if (page == NULL) {
@@ -313,18 +605,13 @@ static int enable_vmx(vmcs_t *vmxon_region)
 	}
 
 	u64 cr0 = read_cr0();
-	u64 msr_val = 0;
-	rdmsrl(MSR_IA32_VMX_CR0_FIXED1, msr_val);
-	cr0 &= msr_val;
-	rdmsrl(MSR_IA32_VMX_CR0_FIXED0, msr_val);
-	cr0 |= msr_val;
+	cr0 &= VMX_CAP.cr0_fixed1;
+	cr0 |= VMX_CAP.cr0_fixed0;
 	write_cr0(cr0);
 
 	u64 cr4 = read_cr4();
-	rdmsrl(MSR_IA32_VMX_CR4_FIXED1, msr_val);
-	cr4 &= msr_val;
-	rdmsrl(MSR_IA32_VMX_CR4_FIXED0, msr_val);
-	cr4 |= msr_val;
+	cr4 &= VMX_CAP.cr4_fixed1;
+	cr4 |= VMX_CAP.cr4_fixed0;
 	write_cr4(cr4);
 
 	u64 phys_vmxon_vmcs = __pa(vmxon_vmcs);
@@ -343,7 +630,10 @@ static void enable_vmx_per_cpu(void *data)
 	int err = enable_vmx(vmxon_region);
 	if (err) {
 		pr_alert("tvisor: failed to enable VMX[%d]\n", err);
+		return;
 	}
+
+	build_vmcs_template(this_cpu_ptr(&vmcs_template));
 }
 
 static void disable_vmx_per_cpu(void *_dummy)
@@ -356,9 +646,8 @@ static void disable_vmx_per_cpu(void *_dummy)
 
 int enable_vmx_on_each_cpu(vmcs_t *vmxon_region)
 {
-	u32 b = is_vmx_supported() | is_vmxon_supported();
-	if (!b) {
-		return b;
+	if (!VMX_CAP.vmx_supported || !VMX_CAP.vmxon_allowed) {
+		return -ENODEV;
 	}
 
 	on_each_cpu(enable_vmx_per_cpu, vmxon_region, 1);
@@ -375,9 +664,8 @@ int disable_vmx_on_each_cpu(void)
 
 int enable_vmx_on_each_cpu_mask(int cpu, vmcs_t *vmxon_region)
 {
-	u32 b = is_vmx_supported() | is_vmxon_supported();
-	if (!b) {
-		return b;
+	if (!VMX_CAP.vmx_supported || !VMX_CAP.vmxon_allowed) {
+		return -ENODEV;
 	}
 
 	struct cpumask mask;
@@ -402,203 +690,463 @@ int clear_vmcs_state(vmcs_t *vmcs)
 {
 	u64 vmcs_phys = __pa(vmcs);
 	pr_debug("tvisor: VMCS physaddr = %llx\n", vmcs_phys);
+	if (this_cpu_read(current_vmcs) == vmcs) {
+		this_cpu_write(current_vmcs, NULL);
+	}
 	return vmclear(vmcs_phys);
 }
 
 int load_vmcs(vmcs_t *vmcs)
 {
+	if (this_cpu_read(current_vmcs) == vmcs) {
+		return 0;
+	}
+
 	u64 vmcs_phys = __pa(vmcs);
 	pr_debug("tvisor: VMCS physaddr = %llx\n", vmcs_phys);
-	return vmptrld(vmcs_phys);
+	int err = vmptrld(vmcs_phys);
+	if (!err) {
+		this_cpu_write(current_vmcs, vmcs);
+	}
+	return err;
 }
 
-int setup_vmcs(vmcs_t *vmcs, ept_pointer_t *eptp, u64 *vmm_stack)
+// Initialize the current VMCS from this CPU's template plus the per-vCPU
+// settings. Must run with preemption off on a CPU that has VMX enabled.
+int setup_vmcs(vmcs_t *vmcs, const vmcs_config_t *config)
 {
-	vmwrite(EPT_POINTER, eptp->all); // set EPT Pointer
+	vmcs_template_t *t = this_cpu_ptr(&vmcs_template);
+	u32 preemption_timer_value = config->preemption_timer_value;
+
+	write_vmcs_fields(t->host, t->nr_host);
+	write_vmcs_fields(t->guest, t->nr_guest);
+
+	vmcs_write64(EPT_POINTER, config->eptp->all); // set EPT Pointer
+	vmcs_writel(GUEST_CR3,
+		    config->guest_cr3 ?:
+			    setup_sample_guest_page_table(config->eptp).all);
+
+	// port I/O and RDPMC (see pmu.c) always exit; the guest reads its TSC
+	// natively unless we are asked to trap it
+	u64 primary = CPU_BASED_HLT_EXITING | CPU_BASED_UNCOND_IO_EXITING |
+		      CPU_BASED_RDPMC_EXITING |
+		      CPU_BASED_ACTIVATE_SECONDARY_CONTROLS |
+		      CPU_BASED_USE_TSC_OFFSETING;
+	if (config->rdtsc_exiting) {
+		primary |= CPU_BASED_RDTSC_EXITING;
+	}
+	vmcs_write32(CPU_BASED_VM_EXEC_CONTROL,
+		adjust_controls(primary, VMX_CAP.ctls.procbased));
+	vmcs_write64(TSC_OFFSET, config->tsc_offset);
 
-	u16 es, cs, ss, ds, fs, gs, tr;
-	es = read_es();
-	cs = read_cs();
-	ss = read_ss();
-	ds = read_ds();
-	fs = read_fs();
-	gs = read_gs();
-	tr = read_tr();
-	pr_debug("tvisor: es=%x, cs=%x, ss=%x, ds=%x, fs=%x, gs=%x, tr=%x\n",
-		 es, cs, ss, ds, fs, gs, tr);
-	vmwrite(HOST_ES_SELECTOR, es & 0xf8);
-	vmwrite(HOST_CS_SELECTOR, cs & 0xf8);
-	vmwrite(HOST_SS_SELECTOR, ss & 0xf8);
-	vmwrite(HOST_DS_SELECTOR, ds & 0xf8);
-	vmwrite(HOST_FS_SELECTOR, fs & 0xf8);
-	vmwrite(HOST_GS_SELECTOR, gs & 0xf8);
-	vmwrite(HOST_TR_SELECTOR, tr & 0xf8);
+	u64 secondary = CPU_BASED_CTL2_RDTSCP | CPU_BASED_CTL2_ENABLE_EPT;
+	if (config->ple_gap && vmx_has_ple()) {
+		secondary |= CPU_BASED_CTL2_PAUSE_LOOP_EXITING;
+	}
+	if (config->tsc_multiplier != VMX_TSC_MULTIPLIER_ONE &&
+	    vmx_has_tsc_scaling()) {
+		secondary |= CPU_BASED_CTL2_TSC_SCALING;
+		vmcs_write64(TSC_MULTIPLIER, config->tsc_multiplier);
+	}
+	vmcs_write32(SECONDARY_VM_EXEC_CONTROL,
+		adjust_controls(secondary, VMX_CAP.ctls.procbased2));
+	vmcs_write32(PLE_GAP, config->ple_gap);
+	vmcs_write32(PLE_WINDOW, config->ple_window);
+
+	// Host interrupts arriving in the guest cause an exit and stay pending,
+	// they get delivered once the run loop turns interrupts back on.
+	u64 pin_based = PIN_BASED_VM_EXECUTION_CONTROLS_EXTERNAL_INTERRUPT;
+	u64 vm_exit_ctls = VM_EXIT_IA32E_MODE;
+	if (preemption_timer_value) {
+		pin_based |= PIN_BASED_VM_EXECUTION_CONTROLS_ACTIVE_VMX_TIMER;
+		// keep the remaining quantum across exits handled in kernel
+		vm_exit_ctls |= VM_EXIT_SAVE_VMX_PREEMPTION_TIMER;
+	}
+	vmcs_write32(PIN_BASED_VM_EXEC_CONTROL,
+		adjust_controls(pin_based, VMX_CAP.ctls.pinbased));
+	vmcs_write32(VM_EXIT_CONTROLS,
+		adjust_controls(vm_exit_ctls, VMX_CAP.ctls.exit));
+	vmcs_write32(VMX_PREEMPTION_TIMER_VALUE, preemption_timer_value);
+
+	// the guest's counters are stored to the same area they are loaded from
+	if (config->nr_pmu_msrs) {
+		vmcs_write64(VM_ENTRY_MSR_LOAD_ADDR, config->guest_pmu_msrs);
+		vmcs_write64(VM_EXIT_MSR_STORE_ADDR, config->guest_pmu_msrs);
+		vmcs_write64(VM_EXIT_MSR_LOAD_ADDR, config->host_pmu_msrs);
+		vmcs_write32(VM_ENTRY_MSR_LOAD_COUNT, config->nr_pmu_msrs);
+		vmcs_write32(VM_EXIT_MSR_STORE_COUNT, config->nr_pmu_msrs);
+		vmcs_write32(VM_EXIT_MSR_LOAD_COUNT, config->nr_pmu_msrs);
+	}
 
-	vmwrite(VMCS_LINK_POINTER, ~0ull);
+	return 0;
+}
 
-	u32 debug_msr_low, debug_msr_high;
-	rdmsr(MSR_IA32_DEBUGCTLMSR, debug_msr_low, debug_msr_high);
-	pr_debug("tvisor: GUEST_IA32_DEBUGCTL=%x_%x\n", debug_msr_high,
-		 debug_msr_low);
-	vmwrite(GUEST_IA32_DEBUGCTL, debug_msr_low);
-	vmwrite(GUEST_IA32_DEBUGCTL_HIGH, debug_msr_high);
+// HOST_CR3 and HOST_FS_BASE follow the task that runs the vCPU, rewrite them
+// only when they changed since the last entry. VMCS must be current.
+void refresh_host_state(vcpu_state_t *vcpu)
+{
+	u64 cr3 = read_cr3();
+	u64 fs_base;
+	rdmsrl(MSR_FS_BASE, fs_base);
 
-	vmwrite(TSC_OFFSET, 0);
-	vmwrite(TSC_OFFSET_HIGH, 0);
+	if (cr3 != vcpu->host_cr3) {
+		vmcs_writel(HOST_CR3, cr3);
+		vcpu->host_cr3 = cr3;
+	}
+	if (fs_base != vcpu->host_fs_base) {
+		vmcs_writel(HOST_FS_BASE, fs_base);
+		vcpu->host_fs_base = fs_base;
+	}
+}
 
-	vmwrite(PAGE_FAULT_ERROR_CODE_MASK, 0);
-	vmwrite(PAGE_FAULT_ERROR_CODE_MATCH, 0);
+// Turn the preemption timer of the current VMCS on with `value` ticks, or
+// off for 0. The CPU must have one if `value` is not 0.
+void set_preemption_timer(u32 value)
+{
+	u32 pin_based = vmcs_read32(PIN_BASED_VM_EXEC_CONTROL);
+	u32 vm_exit_ctls = vmcs_read32(VM_EXIT_CONTROLS);
+
+	if (value) {
+		pin_based |= PIN_BASED_VM_EXECUTION_CONTROLS_ACTIVE_VMX_TIMER;
+		vm_exit_ctls |= VM_EXIT_SAVE_VMX_PREEMPTION_TIMER;
+	} else {
+		pin_based &= ~PIN_BASED_VM_EXECUTION_CONTROLS_ACTIVE_VMX_TIMER;
+		vm_exit_ctls &= ~VM_EXIT_SAVE_VMX_PREEMPTION_TIMER;
+	}
+	vmcs_write32(PIN_BASED_VM_EXEC_CONTROL, pin_based);
+	vmcs_write32(VM_EXIT_CONTROLS, vm_exit_ctls);
+	vmcs_write32(VMX_PREEMPTION_TIMER_VALUE, value);
+}
 
-	vmwrite(VM_EXIT_MSR_STORE_COUNT, 0);
-	vmwrite(VM_EXIT_MSR_LOAD_COUNT, 0);
+// The timer counts down at the TSC rate divided by 2^IA32_VMX_MISC[4:0].
+// Returns 0 (timer off) if the CPU has no preemption timer.
+u32 vmx_preemption_timer_ticks(u64 quantum_us)
+{
+	if (!vmx_has_preemption_timer()) {
+		return 0;
+	}
 
-	vmwrite(VM_ENTRY_MSR_LOAD_COUNT, 0);
-	vmwrite(VM_ENTRY_INTR_INFO_FIELD, 0);
+	u64 ticks = ((u64)tsc_khz * quantum_us / 1000) >>
+		    (VMX_CAP.misc & 0x1f);
+	if (ticks > U32_MAX) {
+		ticks = U32_MAX;
+	}
+	if (quantum_us && !ticks) {
+		ticks = 1;
+	}
+	return (u32)ticks;
+}
 
-	u64 gdt_base = read_gdt_base();
-	pr_debug("tvisor: guest GDT Base = %llx\n", gdt_base);
-
-	fill_guest_selector_data((void *)gdt_base, ES, read_es());
-	fill_guest_selector_data((void *)gdt_base, CS, read_cs());
-	fill_guest_selector_data((void *)gdt_base, SS, read_ss());
-	fill_guest_selector_data((void *)gdt_base, DS, read_ds());
-	fill_guest_selector_data((void *)gdt_base, FS, read_fs());
-	fill_guest_selector_data((void *)gdt_base, GS, read_gs());
-	fill_guest_selector_data((void *)gdt_base, LDTR, read_ldt());
-	fill_guest_selector_data((void *)gdt_base, TR, read_tr());
-
-	u64 guest_fs_base, guest_gs_base;
-	rdmsrl(MSR_FS_BASE, guest_fs_base);
-	rdmsrl(MSR_GS_BASE, guest_gs_base);
-	pr_debug("tvisor: GUEST_FS_BASE=%llx, GUEST_GS_BASE=%llx\n",
-		 guest_fs_base, guest_gs_base);
-	vmwrite(GUEST_FS_BASE, guest_fs_base);
-	vmwrite(GUEST_GS_BASE, guest_gs_base);
-
-	vmwrite(GUEST_INTERRUPTIBILITY_INFO, 0);
-	vmwrite(GUEST_ACTIVITY_STATE, 0); // active state
-
-	vmwrite(CPU_BASED_VM_EXEC_CONTROL,
-		adjust_controls(CPU_BASED_HLT_EXITING |
-					CPU_BASED_ACTIVATE_SECONDARY_CONTROLS,
-				MSR_IA32_VMX_PROCBASED_CTLS));
-	vmwrite(SECONDARY_VM_EXEC_CONTROL,
-		adjust_controls(CPU_BASED_CTL2_RDTSCP |
-					CPU_BASED_CTL2_ENABLE_EPT,
-				MSR_IA32_VMX_PROCBASED_CTLS2));
-
-	vmwrite(PIN_BASED_VM_EXEC_CONTROL,
-		adjust_controls(0, MSR_IA32_VMX_PINBASED_CTLS));
-	vmwrite(VM_EXIT_CONTROLS,
-		adjust_controls(VM_EXIT_IA32E_MODE | VM_EXIT_ACK_INTR_ON_EXIT,
-				MSR_IA32_VMX_EXIT_CTLS));
-	vmwrite(VM_ENTRY_CONTROLS,
-		adjust_controls(VM_ENTRY_IA32E_MODE, MSR_IA32_VMX_ENTRY_CTLS));
-
-	vmwrite(CR3_TARGET_COUNT, 0);
-	vmwrite(CR3_TARGET_VALUE0, 0);
-	vmwrite(CR3_TARGET_VALUE1, 0);
-	vmwrite(CR3_TARGET_VALUE2, 0);
-	vmwrite(CR3_TARGET_VALUE3, 0);
-
-	u64 cr0, cr3, cr4;
-	cr0 = read_cr0();
-	cr3 = setup_sample_guest_page_table(eptp).all; // cr3 = read_cr3();
-	cr4 = read_cr4();
-	pr_debug("tvisor: GUEST_CR0=%llx, GUEST_CR3=%llx, GUEST_CR4=%llx\n",
-		 cr0, cr3, cr4);
-	vmwrite(GUEST_CR0, cr0);
-	vmwrite(GUEST_CR3, cr3);
-	vmwrite(GUEST_CR4, cr4);
-
-	vmwrite(GUEST_DR7, 0x400);
-
-	cr0 = read_cr0();
-	cr3 = read_cr3();
-	cr4 = read_cr4();
-	pr_debug("tvisor: HOST_CR0=%llx, HOST_CR3=%llx, HOST_CR4=%llx\n", cr0,
-		 cr3, cr4);
-	vmwrite(HOST_CR0, cr0);
-	vmwrite(HOST_CR3, cr3);
-	vmwrite(HOST_CR4, cr4);
-
-	u64 guest_gdt_base, guest_idt_base;
-	guest_gdt_base = read_gdt_base();
-	guest_idt_base = read_idt_base();
-	u16 guest_gdt_limit, guest_idt_limit;
-	guest_gdt_limit = read_gdt_limit();
-	guest_idt_limit = read_idt_limit();
-	pr_debug("tvisor: GUEST_GDTR BASE=%llx, LIMIT=%x\n", guest_gdt_base,
-		 guest_gdt_limit);
-	pr_debug("tvisor: GUEST IDTR BASE=%llx, LIMIT=%x\n", guest_idt_base,
-		 guest_idt_limit);
-	vmwrite(GUEST_GDTR_BASE, guest_gdt_base);
-	vmwrite(GUEST_IDTR_BASE, guest_idt_base);
-	vmwrite(GUEST_GDTR_LIMIT, guest_gdt_limit);
-	vmwrite(GUEST_IDTR_LIMIT, guest_idt_limit);
-
-	u64 rflags = read_rflags();
-	pr_debug("tvisor: GUEST_RFLAGS=%llx\n", rflags);
-	vmwrite(GUEST_RFLAGS, rflags);
-
-	u64 sysenter_cs, sysenter_eip, sysenter_esp;
-	rdmsrl(MSR_IA32_SYSENTER_CS, sysenter_cs);
-	rdmsrl(MSR_IA32_SYSENTER_EIP, sysenter_eip);
-	rdmsrl(MSR_IA32_SYSENTER_ESP, sysenter_esp);
-	pr_debug("tvisor: GUEST SYSENTER cs=%llx, eip=%llx, esp=%llx\n",
-		 sysenter_cs, sysenter_eip, sysenter_esp);
-	vmwrite(GUEST_SYSENTER_CS, sysenter_cs);
-	vmwrite(GUEST_SYSENTER_EIP, sysenter_eip);
-	vmwrite(GUEST_SYSENTER_ESP, sysenter_esp);
-
-	segment_selector_t segment_selector;
-	get_segment_descriptor(&segment_selector, read_tr(),
-			       (u64 *)read_gdt_base());
-	pr_debug(
-		"tvisor: HOST_TR_BASE segment_selector sel=%x, base=%llx, limit=%x\n",
-		segment_selector.sel, segment_selector.base,
-		segment_selector.limit);
-	vmwrite(HOST_TR_BASE, segment_selector.base);
-
-	u64 host_fs_base, host_gs_base;
-	rdmsrl(MSR_FS_BASE, host_fs_base);
-	rdmsrl(MSR_GS_BASE, host_gs_base);
-	pr_debug("tvisor: MSR host fs_base=%llx, gs_base=%llx\n", host_fs_base,
-		 host_gs_base);
-	vmwrite(HOST_FS_BASE, host_fs_base);
-	vmwrite(HOST_GS_BASE, host_gs_base);
-
-	vmwrite(HOST_GDTR_BASE, read_gdt_base());
-	vmwrite(HOST_IDTR_BASE, read_idt_base());
-
-	rdmsrl(MSR_IA32_SYSENTER_CS, sysenter_cs);
-	rdmsrl(MSR_IA32_SYSENTER_EIP, sysenter_eip);
-	rdmsrl(MSR_IA32_SYSENTER_ESP, sysenter_esp);
-	vmwrite(HOST_IA32_SYSENTER_CS, sysenter_cs);
-	vmwrite(HOST_IA32_SYSENTER_EIP, sysenter_eip);
-	vmwrite(HOST_IA32_SYSENTER_ESP, sysenter_esp);
-
-	vmwrite(GUEST_RSP, (u64)0);
-	vmwrite(GUEST_RIP, (u64)0);
-
-	pr_debug("tvisor: HOST_RSP=%llx, HOST_RIP=%llx\n",
-		 ((u64)vmm_stack + VMM_STACK_SIZE - 0x50), (u64)vmexit_handler);
-	vmwrite(HOST_RSP, ((u64)vmm_stack + VMM_STACK_SIZE - 0x50));
-	vmwrite(HOST_RIP, (u64)vmexit_handler);
+static const u64 io_size_mask[] = { 0, 0xff, 0xffff, 0, 0xffffffff };
 
-	return 0;
+// Hand a port I/O exit to userspace through the run page, unless the port
+// belongs to a device emulated here.
+static int handle_io(vcpu_state_t *vcpu, u64 qualification)
+{
+	struct tvisor_run *run = vcpu->run;
+	u8 size = (qualification & 0x7) + 1;
+
+	if (is_uart_port((u16)(qualification >> 16))) {
+		return handle_uart_io(vcpu, qualification);
+	}
+
+	if (qualification & 0x10) { // INS/OUTS are not emulated
+		run->exit_reason = TVISOR_EXIT_UNKNOWN;
+		return VMEXIT_STOP;
+	}
+
+	if (!(qualification & 0x8) &&
+	    coalesce_pio(&vcpu->vm->coalesced, (u16)(qualification >> 16), size,
+			 vcpu->guest_regs.rax & io_size_mask[size]) == 0) {
+		resume_to_next_instruction();
+		return VMEXIT_RESUME;
+	}
+
+	run->exit_reason = TVISOR_EXIT_IO;
+	run->io.size = size;
+	run->io.port = (u16)(qualification >> 16);
+	if (qualification & 0x8) {
+		run->io.direction = TVISOR_EXIT_IO_IN;
+		run->io.data = 0;
+	} else {
+		run->io.direction = TVISOR_EXIT_IO_OUT;
+		run->io.data = vcpu->guest_regs.rax & io_size_mask[size];
+	}
+	vcpu->user_exit_pending = 1;
+
+	return VMEXIT_USER;
+}
+
+// Fill in the register snapshot of the run page. VMCS must be current.
+void save_user_exit(vcpu_state_t *vcpu)
+{
+	struct tvisor_run *run = vcpu->run;
+
+	run->vmx_exit_reason = vcpu->exit_reason;
+	run->exit_qualification = vcpu->exit_qualification;
+	memcpy(&run->regs, &vcpu->guest_regs, sizeof(guest_regs_t));
+	run->regs.rsp = vmcs_readl(GUEST_RSP);
+	run->regs.rip = vmcs_readl(GUEST_RIP);
+	run->regs.rflags = vmcs_readl(GUEST_RFLAGS);
+}
+
+// Take back what userspace did with the run page before re-entering the
+// guest. VMCS must be current.
+void complete_user_exit(vcpu_state_t *vcpu)
+{
+	struct tvisor_run *run = vcpu->run;
+
+	if (run->regs_dirty) {
+		memcpy(&vcpu->guest_regs, &run->regs, sizeof(guest_regs_t));
+		vmcs_writel(GUEST_RSP, run->regs.rsp);
+		vmcs_writel(GUEST_RIP, run->regs.rip);
+		vmcs_writel(GUEST_RFLAGS, run->regs.rflags);
+		run->regs_dirty = 0;
+	}
+
+	if (!vcpu->user_exit_pending) {
+		return;
+	}
+	vcpu->user_exit_pending = 0;
+
+	if (run->exit_reason == TVISOR_EXIT_IO) {
+		if (run->io.direction == TVISOR_EXIT_IO_IN) {
+			// the page is writable by userspace, don't trust size
+			u8 size = READ_ONCE(run->io.size);
+			u64 mask = size <= 4 ? io_size_mask[size] : 0;
+			if (size == 4) {
+				// 32-bit IN zero-extends into RAX
+				vcpu->guest_regs.rax = run->io.data & mask;
+			} else {
+				vcpu->guest_regs.rax &= ~mask;
+				vcpu->guest_regs.rax |= run->io.data & mask;
+			}
+		}
+		resume_to_next_instruction();
+	} else if (run->exit_reason == TVISOR_EXIT_MMIO) {
+		complete_mmio_user_exit(vcpu);
+	}
+}
+
+static bool fast_exits = true;
+module_param(fast_exits, bool, 0644);
+MODULE_PARM_DESC(fast_exits,
+		 "serve CPUID, no-op VMCALLs, RDTSC(P) and some RDMSRs without "
+		 "leaving the VM exit handler");
+
+// answered from the VM's CPUID table, no host CPUID involved
+static int handle_cpuid(vcpu_state_t *vcpu)
+{
+	guest_regs_t *regs = &vcpu->guest_regs;
+	cpuid_t cpuid = lookup_cpuid(vcpu, (u32)regs->rax, (u32)regs->rcx);
+
+	regs->rax = cpuid.eax;
+	regs->rbx = cpuid.ebx;
+	regs->rcx = cpuid.ecx;
+	regs->rdx = cpuid.edx;
+	resume_to_next_instruction();
+	return 1;
+}
+
+// the MSRs we can answer without any state, 0 if it is not one of them
+static int handle_fast_rdmsr(vcpu_state_t *vcpu)
+{
+	guest_regs_t *regs = &vcpu->guest_regs;
+	u64 value;
+
+	switch ((u32)regs->rcx) {
+	case MSR_IA32_TSC:
+		value = guest_tsc(vcpu, rdtsc());
+		break;
+	case MSR_IA32_FEAT_CTL:
+		value = FEAT_CTL_LOCKED; // and VMXON not allowed
+		break;
+	case MSR_IA32_MISC_ENABLE:
+		value = MSR_IA32_MISC_ENABLE_FAST_STRING;
+		break;
+	case MSR_IA32_UCODE_REV:
+		value = 0;
+		break;
+	default:
+		return 0;
+	}
+
+	regs->rax = (u32)value;
+	regs->rdx = value >> 32;
+	resume_to_next_instruction();
+	return 1;
 }
 
-void vmexit_handler_main(guest_regs_t *guest_regs)
+// RDMSR that needs per-vCPU state, 0 if we know no such MSR
+static int handle_rdmsr(vcpu_state_t *vcpu)
 {
-	u64 exit_reason = vmread(VM_EXIT_REASON);
+	guest_regs_t *regs = &vcpu->guest_regs;
+	u32 msr = (u32)regs->rcx;
+	u64 value;
 
-	u64 exit_qualification = vmread(EXIT_QUALIFICATION);
+	if (msr == MSR_IA32_DEBUGCTLMSR) {
+		value = vmcs_read64(GUEST_IA32_DEBUGCTL);
+	} else if (handle_pmu_rdmsr(vcpu, msr, &value)) {
+		return 0;
+	}
 
-	pr_info("tvisor: exit reason[%lld]\n", exit_reason & 0xffff);
-	pr_info("tvisor: exit qualification[%lld]\n", exit_qualification);
+	regs->rax = (u32)value;
+	regs->rdx = value >> 32;
+	resume_to_next_instruction();
+	return 1;
+}
 
-	switch (exit_reason) {
+// 0 if we know no such MSR; values the MSR does not take get a #GP
+static int handle_wrmsr(vcpu_state_t *vcpu)
+{
+	guest_regs_t *regs = &vcpu->guest_regs;
+	u32 msr = (u32)regs->rcx;
+	u64 value = (u32)regs->rax | (regs->rdx << 32);
+	int ret;
+
+	if (msr == MSR_IA32_DEBUGCTLMSR) {
+		ret = value ? -EINVAL : 0; // no LBRs or BTS for guests
+	} else {
+		ret = handle_pmu_wrmsr(vcpu, msr, value);
+	}
+	if (ret == -ENOENT) {
+		return 0;
+	}
+	if (ret) {
+		inject_gp(vcpu, 0);
+	} else {
+		resume_to_next_instruction();
+	}
+	return 1;
+}
+
+// from the switched counters; anything else, or no vPMU, gets a #GP
+static void handle_rdpmc(vcpu_state_t *vcpu)
+{
+	guest_regs_t *regs = &vcpu->guest_regs;
+	u64 value;
+
+	if (handle_pmu_rdpmc(vcpu, (u32)regs->rcx, &value)) {
+		inject_gp(vcpu, 0);
+		return;
+	}
+	regs->rax = (u32)value;
+	regs->rdx = value >> 32;
+	resume_to_next_instruction();
+}
+
+static int handle_fast_vmcall(vcpu_state_t *vcpu)
+{
+	switch (vcpu->guest_regs.rax) {
+	case TVISOR_HC_NOP:
+		break;
+	case TVISOR_HC_WAKE_SELF:
+		atomic_set(&vcpu->pending_events, 1);
+		break;
+	default:
+		return 0;
+	}
+	vcpu->guest_regs.rax = 0;
+	resume_to_next_instruction();
+	return 1;
+}
+
+static int handle_vmcall(vcpu_state_t *vcpu)
+{
+	if (handle_fast_vmcall(vcpu)) {
+		return VMEXIT_RESUME;
+	}
+
+	switch (vcpu->guest_regs.rax) {
+	case TVISOR_HC_RING_REGISTER:
+	case TVISOR_HC_RING_UNREGISTER:
+		// may sleep, RAX is set by run_hypercall()
+		resume_to_next_instruction();
+		return VMEXIT_HYPERCALL;
+	case TVISOR_HC_RING_KICK:
+		kick_ring(vcpu->vm);
+		vcpu->guest_regs.rax = 0;
+		resume_to_next_instruction();
+		return VMEXIT_RESUME;
+	case TVISOR_HC_BLK_CAPACITY:
+		vcpu->guest_regs.rax = blk_capacity(vcpu->vm);
+		resume_to_next_instruction();
+		return VMEXIT_RESUME;
+	}
+
+	pr_debug("tvisor: unknown hypercall[%lld]\n", vcpu->guest_regs.rax);
+	vcpu->guest_regs.rax = TVISOR_HC_ENOSYS;
+	resume_to_next_instruction();
+	return VMEXIT_RESUME;
+}
+
+// Called by vmexit_handler right after an exit, with interrupts off and the
+// guest GPRs stored in `regs`. Returns 1 if the exit has been handled and
+// the guest can be resumed immediately, 0 to take the exit through
+// enter_vcpu() and vmexit_handler_main().
+int vmexit_fast_path(guest_regs_t *regs)
+{
+	vcpu_state_t *vcpu = container_of(regs, vcpu_state_t, guest_regs);
+	u64 start = rdtsc();
+	int handled;
+
+	vcpu->exit_tsc = start;
+	vcpu->stats.guest_cycles += start - vcpu->entry_tsc;
+	if (!READ_ONCE(fast_exits)) {
+		return 0;
+	}
+
+	u32 reason = vmcs_read32(VM_EXIT_REASON);
+	switch (reason) {
+	case EXIT_REASON_CPUID:
+		handled = handle_cpuid(vcpu);
+		break;
+	case EXIT_REASON_VMCALL:
+		handled = handle_fast_vmcall(vcpu);
+		break;
+	case EXIT_REASON_MSR_READ:
+		handled = handle_fast_rdmsr(vcpu);
+		break;
+	case EXIT_REASON_RDTSC:
+		handled = handle_rdtsc(vcpu, 0);
+		break;
+	case EXIT_REASON_RDTSCP:
+		handled = handle_rdtsc(vcpu, 1);
+		break;
+	default:
+		return 0;
+	}
+
+	if (handled) {
+		// straight back to VMRESUME: the host counters the exit put
+		// back need a fresh snapshot too
+		load_guest_pmu(vcpu);
+		u64 end = rdtsc();
+		vcpu->exit_stats.fast_exits[reason]++;
+		vcpu->exit_stats.fast_cycles[reason] += end - start;
+		vcpu->stats.exits[reason]++;
+		vcpu->entry_tsc = end;
+	}
+	return handled;
+}
+
+int vmexit_handler_main(vcpu_state_t *vcpu)
+{
+	u64 exit_reason = vmcs_read32(VM_EXIT_REASON);
+	vcpu->exit_reason = exit_reason & 0xffff;
+	if (vcpu->exit_reason < VMX_NR_EXIT_REASONS) {
+		vcpu->stats.exits[vcpu->exit_reason]++;
+	}
+
+	u64 exit_qualification = vmcs_readl(EXIT_QUALIFICATION);
+	vcpu->exit_qualification = exit_qualification;
+
+	pr_debug("tvisor: exit reason[%lld]\n", exit_reason & 0xffff);
+	pr_debug("tvisor: exit qualification[%lld]\n", exit_qualification);
+
+	switch (exit_reason & 0xffff) {
+	case EXIT_REASON_EXTERNAL_INTERRUPT:
+		return VMEXIT_RESUME;
 	case EXIT_REASON_VMCLEAR:
 	case EXIT_REASON_VMPTRLD:
 	case EXIT_REASON_VMPTRST:
@@ -609,36 +1157,82 @@ void vmexit_handler_main(guest_regs_t *guest_regs)
 	case EXIT_REASON_VMXON:
 	case EXIT_REASON_VMLAUNCH:
 		pr_info("tvisor: execution of vmx instruction detected...\n");
-		break;
+		vcpu->run->exit_reason = TVISOR_EXIT_UNKNOWN;
+		return VMEXIT_STOP;
 	case EXIT_REASON_HLT:
-		pr_info("tvisor: execution of hlt detected...\n");
-		// restore_vmxoff_state(VM->rsp, VM->rbp);
-		break;
+		pr_debug("tvisor: execution of hlt detected...\n");
+		resume_to_next_instruction();
+		return VMEXIT_HALT;
 	case EXIT_REASON_TRIPLE_FAULT:
 		pr_info("tvisor: triple fault detected...\n");
-		break;
+		vcpu->run->exit_reason = TVISOR_EXIT_SHUTDOWN;
+		return VMEXIT_STOP;
+	case EXIT_REASON_IO_INSTRUCTION:
+		return handle_io(vcpu, exit_qualification);
+	case EXIT_REASON_EPT_VIOLATION:
+		vcpu->stats.ept_violations++;
+		return handle_mmio(vcpu);
+	case EXIT_REASON_EPT_MISCONFIG:
+		return handle_mmio(vcpu);
+	case EXIT_REASON_VMX_PREEMPTION_TIMER_EXPIRED:
+		// the saved value is 0 now, hand out a fresh quantum
+		vmcs_write32(VMX_PREEMPTION_TIMER_VALUE,
+			vcpu->preemption_timer_value);
+		return profile_tick(vcpu);
+	case EXIT_REASON_PAUSE_INSTRUCTION:
+		resume_to_next_instruction();
+		return VMEXIT_PAUSE;
+	case EXIT_REASON_XSETBV:
+		return handle_xsetbv(vcpu);
+	case EXIT_REASON_CPUID:
+		return handle_cpuid(vcpu) ? VMEXIT_RESUME : VMEXIT_STOP;
+	case EXIT_REASON_VMCALL:
+		return handle_vmcall(vcpu);
+	case EXIT_REASON_RDTSC:
+	case EXIT_REASON_RDTSCP:
+		handle_rdtsc(vcpu, vcpu->exit_reason == EXIT_REASON_RDTSCP);
+		return VMEXIT_RESUME;
+	case EXIT_REASON_MSR_READ:
+		if (handle_fast_rdmsr(vcpu) || handle_rdmsr(vcpu)) {
+			return VMEXIT_RESUME;
+		}
+		pr_info("tvisor: rdmsr of unknown MSR[%llx]\n",
+			vcpu->guest_regs.rcx);
+		vcpu->run->exit_reason = TVISOR_EXIT_UNKNOWN;
+		return VMEXIT_STOP;
+	case EXIT_REASON_MSR_WRITE:
+		if (handle_wrmsr(vcpu)) {
+			return VMEXIT_RESUME;
+		}
+		pr_info("tvisor: wrmsr of unknown MSR[%llx]\n",
+			vcpu->guest_regs.rcx);
+		vcpu->run->exit_reason = TVISOR_EXIT_UNKNOWN;
+		return VMEXIT_STOP;
+	case EXIT_REASON_RDPMC:
+		handle_rdpmc(vcpu);
+		return VMEXIT_RESUME;
 	default:
 		pr_info("tvisor: execution of other reason detected...\n");
-		break;
+		vcpu->run->exit_reason = TVISOR_EXIT_UNKNOWN;
+		return VMEXIT_STOP;
 	}
 }
 
 void resume_to_next_instruction(void)
 {
-	char *current_rip = (char *)vmread(GUEST_RIP);
-	u64 exit_instruction_length = (u64)vmread(VM_EXIT_INSTRUCTION_LEN);
+	char *current_rip = (char *)vmcs_readl(GUEST_RIP);
+	u64 exit_instruction_length = vmcs_read32(VM_EXIT_INSTRUCTION_LEN);
 
 	char *resume_rip = current_rip + exit_instruction_length;
-	vmwrite(GUEST_RIP, (u64)resume_rip);
+	vmcs_writel(GUEST_RIP, (u64)resume_rip);
 }
 
-void vm_resumer(void)
+// raise #GP(error_code) in the guest on the next VM entry
+void inject_gp(vcpu_state_t *vcpu, u32 error_code)
 {
-	vmresume();
-
-	u64 err = vmread(VM_INSTRUCTION_ERROR);
-	pr_info("tvisor: vmlaunch is failed\n");
-	pr_debug("tvisor: vm instruction error[%lld]\n", err);
-	for (;;) { // (; o ;)
-	}
-}
\ No newline at end of file
+	vcpu->stats.injected_events++;
+	vmcs_write32(VM_ENTRY_INTR_INFO_FIELD,
+		     INTR_INFO_VALID_MASK | INTR_INFO_DELIVER_CODE_MASK |
+			     INTR_TYPE_HARD_EXCEPTION | GP_VECTOR);
+	vmcs_write32(VM_ENTRY_EXCEPTION_ERROR_CODE, error_code);
+}
@@ -1,30 +1,12 @@
 #pragma once
 
+#include <asm/asm.h> /* Needed for CC_SET, CC_OUT */
+#include <linux/build_bug.h> /* Needed for BUILD_BUG_ON_MSG */
+#include <linux/compiler.h> /* Needed for __always_inline, unlikely */
 #include <linux/types.h>
 
 #include "ept.h"
 
-// void save_vmxoff_state(u64 *rsp, u64 *rbp);
-#define save_vmxoff_state(rsp, rbp)                                            \
-	asm volatile("mov %%rsp,%0; mov %%rbp, %1"                             \
-		     : "=m"(*rsp), "=m"(*rbp)                                  \
-		     :                                                         \
-		     : "cc")
-
-// void restore_vmxoff_state(u64 rsp, u64 rbp);
-#define restore_vmxoff_state(rsp, rbp)                                         \
-	asm volatile("vmxoff\n"                                                \
-		     "mov %0, %%rsp\n"                                         \
-		     "mov %1, %%rbp\n"                                         \
-		     "add $8, %%rsp\n"                                         \
-		     "mov 0x30(%%rsp), %%rbx\n"                                \
-		     "mov 0x38(%%rbp), %%rsi\n"                                \
-		     "add $0x20, %%rsp\n"                                      \
-		     "pop %%rdi\n"                                             \
-		     "ret"                                                     \
-		     :                                                         \
-		     : "r"(rsp), "r"(rbp))
-
 // Primary Processor-Based VM-Execution Controls
 #define CPU_BASED_VIRTUAL_INTR_PENDING 0x00000004
 #define CPU_BASED_USE_TSC_OFFSETING 0x00000008
@@ -53,7 +35,32 @@
 #define CPU_BASED_CTL2_RDTSCP 0x8
 #define CPU_BASED_CTL2_ENABLE_VPID 0x20
 #define CPU_BASED_CTL2_UNRESTRICTED_GUEST 0x80
+#define CPU_BASED_CTL2_PAUSE_LOOP_EXITING 0x400
 #define CPU_BASED_CTL2_ENABLE_VMFUNC 0x2000
+#define CPU_BASED_CTL2_ENABLE_PML 0x20000
+#define CPU_BASED_CTL2_TSC_SCALING 0x02000000
+
+// TSC_MULTIPLIER is a fixed point number with 48 fraction bits
+#define VMX_TSC_MULTIPLIER_SHIFT 48
+#define VMX_TSC_MULTIPLIER_ONE (1ull << VMX_TSC_MULTIPLIER_SHIFT)
+
+// VM-entry interruption-information field
+#define INTR_INFO_VECTOR_MASK 0xff
+#define INTR_TYPE_EXT_INTR (0 << 8)
+#define INTR_TYPE_HARD_EXCEPTION (3 << 8)
+#define INTR_TYPE_SOFT_INTR (4 << 8)
+#define INTR_INFO_DELIVER_CODE_MASK 0x800
+#define INTR_INFO_VALID_MASK 0x80000000
+
+#define GP_VECTOR 13
+
+// IA32_VMX_BASIC
+#define VMX_BASIC_TRUE_CTLS (1ull << 55)
+
+// IA32_VMX_EPT_VPID_CAP
+#define VMX_EPT_2MB_PAGE (1ull << 16)
+#define VMX_EPT_1GB_PAGE (1ull << 17)
+#define VMX_VPID_INVVPID (1ull << 32)
 
 // VM-entry Control Bits
 #define VM_ENTRY_IA32E_MODE 0x00000200
@@ -66,6 +73,7 @@
 #define VM_EXIT_ACK_INTR_ON_EXIT 0x00008000
 #define VM_EXIT_SAVE_GUEST_PAT 0x00040000
 #define VM_EXIT_LOAD_HOST_PAT 0x00080000
+#define VM_EXIT_SAVE_VMX_PREEMPTION_TIMER 0x00400000
 
 // Pin-Based VM-Execution Controls
 #define PIN_BASED_VM_EXECUTION_CONTROLS_EXTERNAL_INTERRUPT 0x00000001
@@ -134,6 +142,7 @@
 #define EXIT_REASON_XSAVES 63
 #define EXIT_REASON_XRSTORS 64
 #define EXIT_REASON_PCOMMIT 65
+#define VMX_NR_EXIT_REASONS 66
 
 typedef struct _vmcs {
 	u32 rev_id;
@@ -143,6 +152,19 @@ typedef struct _vmcs {
 
 typedef vmcs_t vmxon_region_t;
 
+struct _vcpu_state;
+
+// what the run loop does after an exit has been handled
+enum VMEXIT_ACTION {
+	VMEXIT_RESUME = 0, // re-enter the guest immediately
+	VMEXIT_YIELD, // time slice used up, give the CPU back to the host
+	VMEXIT_HALT, // guest executed HLT, block until an event is pending
+	VMEXIT_PAUSE, // guest is spinning, let a sibling vCPU run instead
+	VMEXIT_USER, // userspace has to emulate something, then run again
+	VMEXIT_STOP, // guest cannot continue
+	VMEXIT_HYPERCALL, // finish a hypercall that may sleep, then resume
+};
+
 enum VMCS_FIELDS {
 	GUEST_ES_SELECTOR = 0x00000800,
 	GUEST_CS_SELECTOR = 0x00000802,
@@ -173,6 +195,7 @@ enum VMCS_FIELDS {
 	VM_ENTRY_MSR_LOAD_ADDR_HIGH = 0x0000200b,
 	TSC_OFFSET = 0x00002010,
 	TSC_OFFSET_HIGH = 0x00002011,
+	TSC_MULTIPLIER = 0x00002032,
 	VIRTUAL_APIC_PAGE_ADDR = 0x00002012,
 	VIRTUAL_APIC_PAGE_ADDR_HIGH = 0x00002013,
 	VMFUNC_CONTROLS = 0x00002018,
@@ -203,6 +226,8 @@ enum VMCS_FIELDS {
 	VM_ENTRY_INSTRUCTION_LEN = 0x0000401a,
 	TPR_THRESHOLD = 0x0000401c,
 	SECONDARY_VM_EXEC_CONTROL = 0x0000401e,
+	PLE_GAP = 0x00004020,
+	PLE_WINDOW = 0x00004022,
 	VM_INSTRUCTION_ERROR = 0x00004400,
 	VM_EXIT_REASON = 0x00004402,
 	VM_EXIT_INTR_INFO = 0x00004404,
@@ -233,6 +258,7 @@ enum VMCS_FIELDS {
 	GUEST_ACTIVITY_STATE = 0x00004826,
 	GUEST_SM_BASE = 0x00004828,
 	GUEST_SYSENTER_CS = 0x0000482A,
+	VMX_PREEMPTION_TIMER_VALUE = 0x0000482e,
 	HOST_IA32_SYSENTER_CS = 0x00004c00,
 	CR0_GUEST_HOST_MASK = 0x00006000,
 	CR4_GUEST_HOST_MASK = 0x00006002,
@@ -278,6 +304,88 @@ enum VMCS_FIELDS {
 	HOST_RIP = 0x00006c16,
 };
 
+typedef struct _vmx_control_msrs {
+	u64 pinbased;
+	u64 procbased;
+	u64 procbased2;
+	u64 exit;
+	u64 entry;
+} vmx_control_msrs_t;
+
+// everything the CPU reports about VMX, read once at module load
+typedef struct _vmx_capability {
+	int vmx_supported; // CPUID.1:ECX.VMX
+	int vmxon_allowed; // IA32_FEATURE_CONTROL permits VMXON
+	u32 max_phys_addr_bits; // CPUID.80000008H:EAX[7:0]
+	u64 basic;
+	u64 pinbased_ctls;
+	u64 procbased_ctls;
+	u64 procbased_ctls2;
+	u64 exit_ctls;
+	u64 entry_ctls;
+	u64 true_pinbased_ctls;
+	u64 true_procbased_ctls;
+	u64 true_exit_ctls;
+	u64 true_entry_ctls;
+	u64 misc;
+	u64 cr0_fixed0;
+	u64 cr0_fixed1;
+	u64 cr4_fixed0;
+	u64 cr4_fixed1;
+	u64 vmcs_enum;
+	u64 ept_vpid_cap;
+	u64 vmfunc;
+	vmx_control_msrs_t ctls; // what adjust_controls() goes by
+} vmx_capability_t;
+
+extern vmx_capability_t VMX_CAP;
+
+typedef struct _vmcs_field_value {
+	u64 field;
+	u64 value;
+} vmcs_field_value_t;
+
+#define VMCS_TEMPLATE_MAX 96
+
+typedef struct _vmcs_template {
+	int nr_host;
+	vmcs_field_value_t host[VMCS_TEMPLATE_MAX];
+	int nr_guest;
+	vmcs_field_value_t guest[VMCS_TEMPLATE_MAX];
+} vmcs_template_t;
+
+// an entry of the VM-entry/VM-exit MSR areas
+typedef struct _vmx_msr_entry {
+	u32 index;
+	u32 reserved;
+	u64 value;
+} vmx_msr_entry_t;
+
+// per-vCPU settings setup_vmcs() applies on top of the template
+typedef struct _vmcs_config {
+	ept_pointer_t *eptp;
+	u32 preemption_timer_value; // 0 = timer off
+	u32 ple_gap; // 0 = PAUSE-loop exiting off
+	u32 ple_window;
+	u64 tsc_offset;
+	u64 tsc_multiplier; // VMX_TSC_MULTIPLIER_ONE = no scaling
+	int rdtsc_exiting; // trap RDTSC/RDTSCP instead of offsetting
+	u64 guest_cr3; // 0 = build the sample page tables
+	u32 nr_pmu_msrs; // 0 = counters not passed through, RDPMC exits
+	u64 guest_pmu_msrs; // physical: loaded on entry, stored on exit
+	u64 host_pmu_msrs; // physical: loaded on exit
+} vmcs_config_t;
+
+void read_vmx_capability(vmx_capability_t *cap);
+int vmx_has_preemption_timer(void);
+int vmx_has_ple(void);
+int vmx_has_vpid(void);
+int vmx_has_pml(void);
+int vmx_has_vmfunc(void);
+int vmx_has_tsc_scaling(void);
+int vmx_has_ept_2mb_pages(void);
+int vmx_has_ept_1gb_pages(void);
+
 vmcs_t *alloc_vmcs_region(void);
 vmxon_region_t *alloc_vmxon_region(void);
 void free_vmcs_region(vmcs_t *vmcs);
@@ -291,8 +399,141 @@ int disable_vmx_on_each_cpu_mask(int cpu);
 
 int clear_vmcs_state(vmcs_t *vmcs);
 int load_vmcs(vmcs_t *vmcs);
-int setup_vmcs(vmcs_t *vmcs, ept_pointer_t *eptp, u64 *vmm_stack);
+int setup_vmcs(vmcs_t *vmcs, const vmcs_config_t *config);
+u32 vmx_preemption_timer_ticks(u64 quantum_us);
+void set_preemption_timer(u32 value);
 int vmlaunch(void);
-u64 vmread(enum VMCS_FIELDS field);
-void vmwrite(enum VMCS_FIELDS field, u64 val);
+void resume_to_next_instruction(void);
+void inject_gp(struct _vcpu_state *vcpu, u32 error_code);
 int vmxoff(void);
+
+// cycles per VMCS access, measured by vmx_bench_vmcs_access()
+typedef struct _vmcs_access_bench {
+	u64 iterations;
+	u64 read_cycles; // vmcs_readl()
+	u64 write_cycles; // vmcs_writel()
+	u64 checked_read_cycles; // out-of-line read decoding RFLAGS every time
+} vmcs_access_bench_t;
+
+void vmx_bench_vmcs_access(vmcs_t *vmcs, vmcs_access_bench_t *bench);
+
+// Bits 14:13 of a field encoding give its width. On a 64-bit host the
+// full encoding of a 64-bit field accesses all of it, so the odd "HIGH"
+// encodings are never needed.
+#define VMCS_FIELD_WIDTH(field) (((field) >> 13) & 0x3)
+#define VMCS_FIELD_WIDTH_16 0
+#define VMCS_FIELD_WIDTH_64 1
+#define VMCS_FIELD_WIDTH_32 2
+#define VMCS_FIELD_WIDTH_NATURAL 3
+
+#define vmcs_check_width(field, width)                                        \
+	BUILD_BUG_ON_MSG(__builtin_constant_p(field) &&                       \
+				 (VMCS_FIELD_WIDTH(field) != (width) ||       \
+				  ((width) == VMCS_FIELD_WIDTH_64 &&          \
+				   ((field) & 1))),                           \
+			 "VMCS accessor does not match the field width")
+
+#ifdef DEBUG
+void vmx_vmcs_access_error(const char *insn, unsigned long field);
+#endif
+
+static __always_inline unsigned long __vmcs_readl(unsigned long field)
+{
+	unsigned long value;
+#ifdef DEBUG
+	bool fail;
+	asm volatile("vmread %[field], %[value]" CC_SET(be)
+		     : [value] "=r"(value), CC_OUT(be)(fail)
+		     : [field] "r"(field)
+		     : "cc");
+	if (unlikely(fail)) {
+		vmx_vmcs_access_error("vmread", field);
+	}
+#else
+	asm volatile("vmread %[field], %[value]"
+		     : [value] "=r"(value)
+		     : [field] "r"(field)
+		     : "cc");
+#endif
+	return value;
+}
+
+static __always_inline void __vmcs_writel(unsigned long field,
+					  unsigned long value)
+{
+#ifdef DEBUG
+	bool fail;
+	asm volatile("vmwrite %[value], %[field]" CC_SET(be)
+		     : CC_OUT(be)(fail)
+		     : [value] "rm"(value), [field] "r"(field)
+		     : "cc");
+	if (unlikely(fail)) {
+		vmx_vmcs_access_error("vmwrite", field);
+	}
+#else
+	asm volatile("vmwrite %[value], %[field]"
+		     :
+		     : [value] "rm"(value), [field] "r"(field)
+		     : "cc");
+#endif
+}
+
+static __always_inline u16 vmcs_read16(unsigned long field)
+{
+	vmcs_check_width(field, VMCS_FIELD_WIDTH_16);
+	return __vmcs_readl(field);
+}
+
+static __always_inline u32 vmcs_read32(unsigned long field)
+{
+	vmcs_check_width(field, VMCS_FIELD_WIDTH_32);
+	return __vmcs_readl(field);
+}
+
+static __always_inline u64 vmcs_read64(unsigned long field)
+{
+	vmcs_check_width(field, VMCS_FIELD_WIDTH_64);
+	return __vmcs_readl(field);
+}
+
+static __always_inline unsigned long vmcs_readl(unsigned long field)
+{
+	vmcs_check_width(field, VMCS_FIELD_WIDTH_NATURAL);
+	return __vmcs_readl(field);
+}
+
+static __always_inline void vmcs_write16(unsigned long field, u16 value)
+{
+	vmcs_check_width(field, VMCS_FIELD_WIDTH_16);
+	__vmcs_writel(field, value);
+}
+
+static __always_inline void vmcs_write32(unsigned long field, u32 value)
+{
+	vmcs_check_width(field, VMCS_FIELD_WIDTH_32);
+	__vmcs_writel(field, value);
+}
+
+static __always_inline void vmcs_write64(unsigned long field, u64 value)
+{
+	vmcs_check_width(field, VMCS_FIELD_WIDTH_64);
+	__vmcs_writel(field, value);
+}
+
+static __always_inline void vmcs_writel(unsigned long field,
+					unsigned long value)
+{
+	vmcs_check_width(field, VMCS_FIELD_WIDTH_NATURAL);
+	__vmcs_writel(field, value);
+}
+
+// for fields only known at run time, e.g. the VMCS template
+static inline u64 vmread(enum VMCS_FIELDS field)
+{
+	return __vmcs_readl(field);
+}
+
+static inline void vmwrite(enum VMCS_FIELDS field, u64 val)
+{
+	__vmcs_writel(field, val);
+}